@@ -0,0 +1,693 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Throughput and latency benchmark for the fatfs sysfs entry points on an
+// emulated drive (see fatfs_host.h)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fatfs.h"
+#include "fatfs_host.h"
+
+#define DRIVE_NAME "bench0"
+
+FATFS_DECLARE_CONFIG_STATE(bench, 0, DRIVE_NAME, 0, 10, 0);
+FATFS_DECLARE_CONFIG_STATE_WAIT_READY(
+  bench_wait_ready,
+  0,
+  DRIVE_NAME,
+  0,
+  fatfs_host_drive_wait_ready,
+  0);
+
+typedef struct {
+  const char *image_path;
+  u32 block_size;
+  u32 block_count;
+  u32 access_latency_us;
+  u32 block_latency_us;
+  u32 write_busy_us;
+  u32 is_wait_ready;
+  u32 file_size;
+  u32 chunk_size;
+  u32 random_ops;
+  u32 append_ops;
+  u32 append_size;
+  u32 append_sync_interval;
+  u32 file_count;
+  u32 tree_depth;
+  u32 seed;
+  u32 buffer_offset;
+  const char *workload;
+} options_t;
+
+typedef struct {
+  const char *name;
+  u32 capacity;
+  u32 count;
+  u64 bytes;
+  u64 start_ns;
+  u64 total_ns;
+  u32 *latency_us;
+  fatfs_stats_t stats_start;
+  fatfs_stats_t stats_end;
+} result_t;
+
+static options_t options = {
+  .block_size = 512,
+  .block_count = 262144,
+  .file_size = 4 * 1024 * 1024,
+  .chunk_size = 4096,
+  .random_ops = 2000,
+  .append_ops = 4000,
+  .append_size = 64,
+  .append_sync_interval = 16,
+  .file_count = 200,
+  .tree_depth = 6,
+  .seed = 1,
+  .workload = "all"};
+
+static const void *cfg = &bench_config;
+static u8 *buffer_allocation;
+static u8 *buffer; // buffer_allocation + buffer_offset
+
+static u64 now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void check(int result, const char *what) {
+  if (result < 0) {
+    fprintf(stderr, "%s failed (%d)\n", what, result);
+    exit(1);
+  }
+}
+
+// file contents are a function of the byte's location so data read back from
+// the wrong place or a stale buffer does not match
+static u8 pattern_byte(u32 loc) { return (u8)(loc * 31 + (loc >> 9) * 7 + 7); }
+
+static void fill_pattern(u32 loc, u32 size) {
+  for (u32 i = 0; i < size; i++) {
+    buffer[i] = pattern_byte(loc + i);
+  }
+}
+
+// reading is timed on its own; the data is checked after the operation ends
+static void verify_pattern(const char *what, u32 loc, int result, u32 nbyte) {
+  check(result, what);
+  if ((u32)result != nbyte) {
+    fprintf(
+      stderr,
+      "%s: read %d of %u bytes at %u\n",
+      what,
+      result,
+      nbyte,
+      loc);
+    exit(1);
+  }
+  for (u32 i = 0; i < nbyte; i++) {
+    if (buffer[i] != pattern_byte(loc + i)) {
+      fprintf(
+        stderr,
+        "%s: byte at %u is 0x%02x instead of 0x%02x\n",
+        what,
+        loc + i,
+        buffer[i],
+        pattern_byte(loc + i));
+      exit(1);
+    }
+  }
+}
+
+static fatfs_stats_t get_stats() {
+  fatfs_stats_t stats;
+  check(fatfs_ioctl(cfg, NULL, I_FATFS_GETSTATS, &stats), "I_FATFS_GETSTATS");
+  return stats;
+}
+
+static void format_volume() {
+  // f_mkfs() needs the volume registered, which a mount attempt does
+  if (fatfs_mount(cfg) == 0) {
+    fatfs_unmount(cfg);
+  }
+  check(fatfs_mkfs(cfg), "fatfs_mkfs");
+  check(fatfs_mount(cfg), "fatfs_mount");
+}
+
+static void result_start(result_t *result, const char *name, u32 capacity) {
+  memset(result, 0, sizeof(result_t));
+  result->name = name;
+  result->capacity = capacity;
+  result->latency_us = malloc(capacity * sizeof(u32));
+  if (result->latency_us == NULL) {
+    check(-ENOMEM, "malloc");
+  }
+  result->stats_start = get_stats();
+  result->start_ns = now_ns();
+}
+
+static u64 op_start() { return now_ns(); }
+
+static void op_end(result_t *result, u64 start, u32 bytes) {
+  const u64 elapsed = now_ns() - start;
+  if (result->count < result->capacity) {
+    result->latency_us[result->count++] = (u32)(elapsed / 1000);
+  }
+  result->bytes += bytes;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  const u32 x = *(const u32 *)a;
+  const u32 y = *(const u32 *)b;
+  return (x > y) - (x < y);
+}
+
+static u32 percentile(const result_t *result, u32 percent) {
+  if (result->count == 0) {
+    return 0;
+  }
+  u32 index = (result->count * percent + 99) / 100;
+  if (index > 0) {
+    index--;
+  }
+  return result->latency_us[index];
+}
+
+static void result_print_header() {
+  printf(
+    "%-14s %8s %10s %10s %9s %9s %10s %10s\n",
+    "workload",
+    "ops",
+    "MB/s",
+    "ops/s",
+    "p50(us)",
+    "p99(us)",
+    "rd sec/op",
+    "wr sec/op");
+}
+
+static void result_finish(result_t *result) {
+  result->total_ns = now_ns() - result->start_ns;
+  result->stats_end = get_stats();
+  qsort(result->latency_us, result->count, sizeof(u32), compare_u32);
+
+  const double seconds = result->total_ns / 1e9;
+  const u32 ops = result->count ? result->count : 1;
+  printf(
+    "%-14s %8u %10.2f %10.1f %9u %9u %10.2f %10.2f\n",
+    result->name,
+    result->count,
+    seconds > 0 ? result->bytes / seconds / (1024.0 * 1024.0) : 0,
+    seconds > 0 ? result->count / seconds : 0,
+    percentile(result, 50),
+    percentile(result, 99),
+    (double)(result->stats_end.read_sectors - result->stats_start.read_sectors)
+      / ops,
+    (double)(result->stats_end.write_sectors - result->stats_start.write_sectors)
+      / ops);
+  free(result->latency_us);
+}
+
+static void *open_file(const char *path, int flags) {
+  void *handle;
+  check(fatfs_open(cfg, &handle, path, flags, 0666), path);
+  return handle;
+}
+
+static void close_file(void **handle) {
+  check(fatfs_close(cfg, handle), "fatfs_close");
+}
+
+static void verify_count(const char *what, u32 count, u32 expected) {
+  if (count != expected) {
+    fprintf(stderr, "%s: %u entries instead of %u\n", what, count, expected);
+    exit(1);
+  }
+}
+
+// reads the whole file back (untimed) after a workload that wrote it
+static void verify_file(const char *path, u32 size) {
+  void *handle = open_file(path, O_RDONLY);
+  for (u32 loc = 0; loc < size; loc += options.chunk_size) {
+    const u32 nbyte
+      = size - loc < options.chunk_size ? size - loc : options.chunk_size;
+    const int result = fatfs_read(cfg, handle, 0, loc, buffer, nbyte);
+    verify_pattern(path, loc, result, nbyte);
+  }
+  close_file(&handle);
+}
+
+static void fill_file(const char *path) {
+  void *handle = open_file(path, O_CREAT | O_TRUNC | O_RDWR);
+  for (u32 loc = 0; loc < options.file_size; loc += options.chunk_size) {
+    fill_pattern(loc, options.chunk_size);
+    check(
+      fatfs_write(cfg, handle, 0, loc, buffer, options.chunk_size),
+      "fatfs_write");
+  }
+  close_file(&handle);
+}
+
+static void run_sequential() {
+  result_t result;
+  const u32 chunks = options.file_size / options.chunk_size;
+
+  format_volume();
+  result_start(&result, "seq-write", chunks + 1);
+  void *handle = open_file("/seq.bin", O_CREAT | O_TRUNC | O_RDWR);
+  for (u32 i = 0; i < chunks; i++) {
+    fill_pattern(i * options.chunk_size, options.chunk_size);
+    const u64 start = op_start();
+    check(
+      fatfs_write(
+        cfg,
+        handle,
+        0,
+        i * options.chunk_size,
+        buffer,
+        options.chunk_size),
+      "fatfs_write");
+    op_end(&result, start, options.chunk_size);
+  }
+  const u64 start = op_start();
+  check(fatfs_fsync(cfg, handle), "fatfs_fsync");
+  op_end(&result, start, 0);
+  close_file(&handle);
+  result_finish(&result);
+
+  result_start(&result, "seq-read", chunks);
+  handle = open_file("/seq.bin", O_RDONLY);
+  for (u32 i = 0; i < chunks; i++) {
+    memset(buffer, 0, options.chunk_size);
+    const u64 start = op_start();
+    const int read_result = fatfs_read(
+      cfg,
+      handle,
+      0,
+      i * options.chunk_size,
+      buffer,
+      options.chunk_size);
+    op_end(&result, start, options.chunk_size);
+    verify_pattern(
+      "seq-read",
+      i * options.chunk_size,
+      read_result,
+      options.chunk_size);
+  }
+  close_file(&handle);
+  result_finish(&result);
+}
+
+static void run_random() {
+  result_t result;
+  const u32 chunks = options.file_size / options.chunk_size;
+
+  format_volume();
+  fill_file("/random.bin");
+  srand(options.seed);
+
+  result_start(&result, "random-read", options.random_ops);
+  void *handle = open_file("/random.bin", O_RDWR);
+  for (u32 i = 0; i < options.random_ops; i++) {
+    const u32 loc = (rand() % chunks) * options.chunk_size;
+    memset(buffer, 0, options.chunk_size);
+    const u64 start = op_start();
+    const int read_result
+      = fatfs_read(cfg, handle, 0, loc, buffer, options.chunk_size);
+    op_end(&result, start, options.chunk_size);
+    verify_pattern("random-read", loc, read_result, options.chunk_size);
+  }
+  result_finish(&result);
+
+  result_start(&result, "random-write", options.random_ops);
+  for (u32 i = 0; i < options.random_ops; i++) {
+    const u32 loc = (rand() % chunks) * options.chunk_size;
+    fill_pattern(loc, options.chunk_size);
+    const u64 start = op_start();
+    check(
+      fatfs_write(cfg, handle, 0, loc, buffer, options.chunk_size),
+      "fatfs_write");
+    op_end(&result, start, options.chunk_size);
+  }
+  check(fatfs_fsync(cfg, handle), "fatfs_fsync");
+  close_file(&handle);
+  result_finish(&result);
+  verify_file("/random.bin", chunks * options.chunk_size);
+}
+
+static void run_append() {
+  result_t result;
+
+  format_volume();
+  result_start(&result, "small-append", options.append_ops);
+  void *handle = open_file("/append.log", O_CREAT | O_TRUNC | O_RDWR);
+  u32 loc = 0;
+  for (u32 i = 0; i < options.append_ops; i++) {
+    fill_pattern(loc, options.append_size);
+    const u64 start = op_start();
+    check(
+      fatfs_write(cfg, handle, 0, loc, buffer, options.append_size),
+      "fatfs_write");
+    if (options.append_sync_interval && (i + 1) % options.append_sync_interval == 0) {
+      check(fatfs_fsync(cfg, handle), "fatfs_fsync");
+    }
+    op_end(&result, start, options.append_size);
+    loc += options.append_size;
+  }
+  close_file(&handle);
+  result_finish(&result);
+  verify_file("/append.log", loc);
+}
+
+static void build_dir_path(char *path, u32 depth) {
+  strcpy(path, "");
+  for (u32 level = 0; level < depth; level++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/level_directory_%u", level);
+    strcat(path, name);
+  }
+}
+
+static void run_metadata() {
+  result_t result;
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  struct stat st;
+
+  format_volume();
+  for (u32 depth = 1; depth <= options.tree_depth; depth++) {
+    build_dir_path(dir, depth);
+    check(fatfs_mkdir(cfg, dir, 0777), dir);
+  }
+
+  fill_pattern(0, 100);
+  result_start(&result, "create", options.file_count);
+  for (u32 i = 0; i < options.file_count; i++) {
+    build_dir_path(dir, 1 + i % options.tree_depth);
+    snprintf(path, sizeof(path), "%s/small_file_number_%u.dat", dir, i);
+    const u64 start = op_start();
+    void *handle = open_file(path, O_CREAT | O_TRUNC | O_RDWR);
+    check(fatfs_write(cfg, handle, 0, 0, buffer, 100), "fatfs_write");
+    close_file(&handle);
+    op_end(&result, start, 100);
+  }
+  result_finish(&result);
+
+  result_start(&result, "stat", options.file_count);
+  for (u32 i = 0; i < options.file_count; i++) {
+    // visit the files out of creation order
+    const u32 file = (i * 7919) % options.file_count;
+    build_dir_path(dir, 1 + file % options.tree_depth);
+    snprintf(path, sizeof(path), "%s/small_file_number_%u.dat", dir, file);
+    const u64 start = op_start();
+    const int stat_result = fatfs_stat(cfg, path, &st);
+    op_end(&result, start, 0);
+    check(stat_result, path);
+    if (st.st_size != 100) {
+      fprintf(stderr, "%s: size %ld instead of 100\n", path, (long)st.st_size);
+      exit(1);
+    }
+  }
+  result_finish(&result);
+
+  result_start(&result, "stat-missing", options.file_count);
+  for (u32 i = 0; i < options.file_count; i++) {
+    build_dir_path(dir, options.tree_depth);
+    snprintf(path, sizeof(path), "%s/missing_file_%u.dat", dir, i);
+    const u64 start = op_start();
+    fatfs_stat(cfg, path, &st);
+    op_end(&result, start, 0);
+  }
+  result_finish(&result);
+
+  // every directory but the deepest also holds the next level
+  const u32 entry_count = options.file_count + options.tree_depth - 1;
+  u32 entries_read = 0;
+  result_start(&result, "readdir", options.file_count + options.tree_depth);
+  for (u32 depth = 1; depth <= options.tree_depth; depth++) {
+    struct dirent entry;
+    void *handle;
+    build_dir_path(dir, depth);
+    check(fatfs_opendir(cfg, &handle, dir), dir);
+    int loc = 0;
+    for (;;) {
+      const u64 start = op_start();
+      int readdir_result = fatfs_readdir_r(cfg, handle, loc, &entry);
+      op_end(&result, start, 0);
+      if (readdir_result != 0) {
+        break;
+      }
+      loc++;
+    }
+    check(fatfs_closedir(cfg, &handle), "fatfs_closedir");
+    entries_read += loc;
+  }
+  result_finish(&result);
+  verify_count("readdir", entries_read, entry_count);
+
+  // one operation per I_FATFS_READDIR_BATCH request, as an application would
+  // issue it on a directory opened with O_DIRECTORY
+  static fatfs_dirent_t entries[64];
+  const u32 batch_count = sizeof(entries) / sizeof(entries[0]);
+  result_start(
+    &result,
+    "readdir-batch",
+    (options.file_count + options.tree_depth) / batch_count
+      + 2 * options.tree_depth);
+  entries_read = 0;
+  for (u32 depth = 1; depth <= options.tree_depth; depth++) {
+    build_dir_path(dir, depth);
+    void *handle = open_file(dir, O_RDONLY | O_DIRECTORY);
+    fatfs_readdir_batch_t batch
+      = {.loc = 0, .count = batch_count, .entries = entries};
+    for (;;) {
+      const u64 start = op_start();
+      int readdir_result
+        = fatfs_ioctl(cfg, handle, I_FATFS_READDIR_BATCH, &batch);
+      op_end(&result, start, 0);
+      if (readdir_result <= 0) {
+        check(readdir_result, "I_FATFS_READDIR_BATCH");
+        break;
+      }
+      batch.loc += readdir_result;
+    }
+    close_file(&handle);
+    entries_read += batch.loc;
+  }
+  result_finish(&result);
+  verify_count("readdir-batch", entries_read, entry_count);
+
+  result_start(&result, "unlink", options.file_count);
+  for (u32 i = 0; i < options.file_count; i++) {
+    build_dir_path(dir, 1 + i % options.tree_depth);
+    snprintf(path, sizeof(path), "%s/small_file_number_%u.dat", dir, i);
+    const u64 start = op_start();
+    check(fatfs_unlink(cfg, path), path);
+    op_end(&result, start, 0);
+  }
+  result_finish(&result);
+}
+
+static void usage(const char *name) {
+  printf(
+    "usage: %s [options]\n"
+    "  --workload all|seq|random|append|metadata\n"
+    "  --image PATH            back the drive with an image file (default: RAM)\n"
+    "  --sector-size BYTES     drive block (sector) size: 512 to 4096 (%u)\n"
+    "  --blocks N              drive size in blocks (%u)\n"
+    "  --latency-us N          latency added to every drive access\n"
+    "  --block-latency-us N    latency added per block transferred\n"
+    "  --busy-us N             time the drive reports busy after a write\n"
+    "  --wait-ready            wait for the drive with fatfs_config_t::wait_ready\n"
+    "                          instead of polling\n"
+    "  --file-size BYTES       file size for seq/random (%u)\n"
+    "  --chunk BYTES           transfer size for seq/random (%u)\n"
+    "  --ops N                 random operations (%u)\n"
+    "  --appends N             small appends (%u)\n"
+    "  --append-size BYTES     bytes per append (%u)\n"
+    "  --append-sync N         fsync every N appends, 0: never (%u)\n"
+    "  --files N               files for the metadata workload (%u)\n"
+    "  --depth N               directory depth for the metadata workload (%u)\n"
+    "  --seed N                random seed (%u)\n"
+    "  --buffer-offset BYTES   misalign the transfer buffer by BYTES (0)\n",
+    name,
+    options.block_size,
+    options.block_count,
+    options.file_size,
+    options.chunk_size,
+    options.random_ops,
+    options.append_ops,
+    options.append_size,
+    options.append_sync_interval,
+    options.file_count,
+    options.tree_depth,
+    options.seed);
+}
+
+static void parse_options(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+    {"workload", required_argument, 0, 'w'},
+    {"image", required_argument, 0, 'i'},
+    {"sector-size", required_argument, 0, 'z'},
+    {"blocks", required_argument, 0, 'b'},
+    {"latency-us", required_argument, 0, 'l'},
+    {"block-latency-us", required_argument, 0, 'L'},
+    {"busy-us", required_argument, 0, 'B'},
+    {"wait-ready", no_argument, 0, 'W'},
+    {"file-size", required_argument, 0, 's'},
+    {"chunk", required_argument, 0, 'c'},
+    {"ops", required_argument, 0, 'o'},
+    {"appends", required_argument, 0, 'a'},
+    {"append-size", required_argument, 0, 'A'},
+    {"append-sync", required_argument, 0, 'S'},
+    {"files", required_argument, 0, 'f'},
+    {"depth", required_argument, 0, 'd'},
+    {"seed", required_argument, 0, 'r'},
+    {"buffer-offset", required_argument, 0, 'O'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}};
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'w':
+      options.workload = optarg;
+      break;
+    case 'i':
+      options.image_path = optarg;
+      break;
+    case 'z':
+      options.block_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      options.block_count = strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      options.access_latency_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'L':
+      options.block_latency_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      options.write_busy_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'W':
+      options.is_wait_ready = 1;
+      break;
+    case 's':
+      options.file_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      options.chunk_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'o':
+      options.random_ops = strtoul(optarg, NULL, 0);
+      break;
+    case 'a':
+      options.append_ops = strtoul(optarg, NULL, 0);
+      break;
+    case 'A':
+      options.append_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'S':
+      options.append_sync_interval = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      options.file_count = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      options.tree_depth = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      options.seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      options.buffer_offset = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      exit(c == 'h' ? 0 : 1);
+    }
+  }
+
+  if (
+    options.chunk_size == 0 || options.file_size < options.chunk_size
+    || options.block_size < 512 || options.block_size > 4096
+    || (options.block_size & (options.block_size - 1))
+    || options.tree_depth == 0 || options.file_count == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+}
+
+static int is_selected(const char *workload) {
+  return strcmp(options.workload, "all") == 0
+         || strcmp(options.workload, workload) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  parse_options(argc, argv);
+  if (options.is_wait_ready) {
+    cfg = &bench_wait_ready_config;
+  }
+
+  const fatfs_host_drive_config_t drive = {
+    .image_path = options.image_path,
+    .block_size = options.block_size,
+    .block_count = options.block_count,
+    .access_latency_us = options.access_latency_us,
+    .block_latency_us = options.block_latency_us,
+    .write_busy_us = options.write_busy_us};
+  if (fatfs_host_drive_attach(DRIVE_NAME, &drive) < 0) {
+    perror("fatfs_host_drive_attach");
+    return 1;
+  }
+
+  u32 buffer_size = options.chunk_size > options.append_size
+                      ? options.chunk_size
+                      : options.append_size;
+  if (buffer_size < 100) {
+    buffer_size = 100;
+  }
+  buffer_allocation = malloc(buffer_size + options.buffer_offset);
+  buffer = buffer_allocation + options.buffer_offset;
+  if (buffer_allocation == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  printf(
+    "drive: %u x %u byte blocks, latency %u us + %u us/block, busy %u us (%s)\n",
+    options.block_count,
+    options.block_size,
+    options.access_latency_us,
+    options.block_latency_us,
+    options.write_busy_us,
+    options.is_wait_ready ? "wait ready" : "polled");
+  result_print_header();
+
+  if (is_selected("seq")) {
+    run_sequential();
+  }
+  if (is_selected("random")) {
+    run_random();
+  }
+  if (is_selected("append")) {
+    run_append();
+  }
+  if (is_selected("metadata")) {
+    run_metadata();
+  }
+
+  fatfs_unmount(cfg);
+  fatfs_host_drive_detach(DRIVE_NAME);
+  free(buffer_allocation);
+  return 0;
+}
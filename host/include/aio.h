@@ -0,0 +1,26 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS <aio.h>; fatfs_aio() completes a request
+// before it returns and records the result in async.nbyte
+
+#ifndef AIO_H_
+#define AIO_H_
+
+#include <signal.h>
+#include <sos/fs/devfs.h>
+#include <sys/types.h>
+
+enum { LIO_NOP, LIO_READ, LIO_WRITE };
+
+struct aiocb {
+  int aio_fildes;
+  off_t aio_offset;
+  volatile void *aio_buf;
+  size_t aio_nbytes;
+  int aio_reqprio;
+  struct sigevent aio_sigevent;
+  int aio_lio_opcode;
+  devfs_async_t async;
+};
+
+#endif /* AIO_H_ */
@@ -0,0 +1,43 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+#ifndef FATFS_HOST_H_
+#define FATFS_HOST_H_
+
+#include <sdk/types.h>
+
+// emulated drive behind the sysfs_shared_* calls of a host build; a write that
+// arrives while I_DRIVE_ISBUSY reports busy fails with EBUSY
+typedef struct {
+  const char *image_path; // backing image file (NULL: RAM buffer)
+  u32 block_size;         // bytes per block reported by I_DRIVE_GETINFO
+  u32 block_count;        // number of blocks on the drive
+  u32 access_latency_us;  // added to every read and write call
+  u32 block_latency_us;   // added for every block transferred
+  u32 write_busy_us;      // I_DRIVE_ISBUSY reports busy this long after a write
+  u32 erase_busy_us;      // I_DRIVE_ISBUSY reports busy this long after an erase
+} fatfs_host_drive_config_t;
+
+// makes a drive available to sysfs_shared_open() under the given device name;
+// an image file is created (or extended) to block_count * block_size bytes
+int fatfs_host_drive_attach(
+  const char *name,
+  const fatfs_host_drive_config_t *config);
+
+// changes the latency and busy injection of an attached drive
+int fatfs_host_drive_set_timing(
+  const char *name,
+  u32 access_latency_us,
+  u32 block_latency_us,
+  u32 write_busy_us);
+
+// makes every write to the drive fail with the errno value error (0: writes
+// succeed again) to test how failures are reported
+int fatfs_host_drive_set_write_error(const char *name, int error);
+
+void fatfs_host_drive_detach(const char *name);
+
+// fatfs_config_t::wait_ready for host drives: sleeps exactly until the
+// emulated busy period ends, the way a ready interrupt would wake the caller
+int fatfs_host_drive_wait_ready(const void *cfg, u32 timeout_microseconds);
+
+#endif /* FATFS_HOST_H_ */
@@ -0,0 +1,10 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS MCU core interface (not used on the host)
+
+#ifndef MCU_CORE_H_
+#define MCU_CORE_H_
+
+#include <sdk/types.h>
+
+#endif /* MCU_CORE_H_ */
@@ -0,0 +1,25 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS SDK type definitions
+
+#ifndef SDK_TYPES_H_
+#define SDK_TYPES_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef int8_t s8;
+typedef uint16_t u16;
+typedef int16_t s16;
+typedef uint32_t u32;
+typedef int32_t s32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define MCU_UNUSED_ARGUMENT(x) (void)x
+#define MCU_ALIGN(x) __attribute__((aligned(x)))
+#define MCU_PACK __attribute__((packed))
+
+#endif /* SDK_TYPES_H_ */
@@ -0,0 +1,33 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS debug log; define FATFS_HOST_LOG to print
+// the messages to stderr
+
+#ifndef SOS_DEBUG_H_
+#define SOS_DEBUG_H_
+
+#include <sdk/types.h>
+
+#define SOS_DEBUG_FILESYSTEM 0
+
+#if defined FATFS_HOST_LOG
+#include <stdio.h>
+#define SOS_DEBUG_HOST_LOG(level, flags, ...)                                  \
+  do {                                                                         \
+    fprintf(stderr, level ": " __VA_ARGS__);                                   \
+    fprintf(stderr, "\n");                                                     \
+  } while (0)
+#else
+#define SOS_DEBUG_HOST_LOG(level, flags, ...)                                  \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#define sos_debug_log_error(flags, ...)                                        \
+  SOS_DEBUG_HOST_LOG("ERROR", flags, __VA_ARGS__)
+#define sos_debug_log_warning(flags, ...)                                      \
+  SOS_DEBUG_HOST_LOG("WARNING", flags, __VA_ARGS__)
+#define sos_debug_log_info(flags, ...)                                         \
+  SOS_DEBUG_HOST_LOG("INFO", flags, __VA_ARGS__)
+
+#endif /* SOS_DEBUG_H_ */
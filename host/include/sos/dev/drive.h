@@ -0,0 +1,53 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS drive device interface
+
+#ifndef SOS_DEV_DRIVE_H_
+#define SOS_DEV_DRIVE_H_
+
+#include <sdk/types.h>
+
+#include "ioctl.h"
+
+#define DRIVE_IOC_IDENT_CHAR 'd'
+
+enum drive_flags {
+  DRIVE_FLAG_PROTECT = (1 << 0),
+  DRIVE_FLAG_UNPROTECT = (1 << 1),
+  DRIVE_FLAG_ERASE_BLOCKS = (1 << 2),
+  DRIVE_FLAG_ERASE_DEVICE = (1 << 3),
+  DRIVE_FLAG_POWERDOWN = (1 << 4),
+  DRIVE_FLAG_POWERUP = (1 << 5),
+  DRIVE_FLAG_INIT = (1 << 6),
+  DRIVE_FLAG_RESET = (1 << 7),
+};
+
+typedef struct MCU_PACK {
+  u32 o_flags;
+  u32 o_events;
+  u16 address_size;
+  u16 resd;
+  u32 write_block_size;
+  u32 num_write_blocks;
+  u32 erase_block_size;
+  u32 erase_block_time;
+  u32 erase_device_time;
+  u32 frequency;
+  u32 resd_ioctl[8];
+} drive_info_t;
+
+typedef struct MCU_PACK {
+  u32 o_flags;
+  u32 start;
+  u32 end;
+  u32 frequency;
+  u32 resd[8];
+} drive_attr_t;
+
+#define I_DRIVE_GETINFO                                                        \
+  _IOCTLR(DRIVE_IOC_IDENT_CHAR, I_MCU_GETINFO, drive_info_t)
+#define I_DRIVE_SETATTR                                                        \
+  _IOCTLW(DRIVE_IOC_IDENT_CHAR, I_MCU_SETATTR, drive_attr_t)
+#define I_DRIVE_ISBUSY _IOCTL(DRIVE_IOC_IDENT_CHAR, I_MCU_TOTAL + 1)
+
+#endif /* SOS_DEV_DRIVE_H_ */
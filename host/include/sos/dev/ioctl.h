@@ -0,0 +1,27 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS ioctl request encoding
+
+#ifndef SOS_DEV_IOCTL_H_
+#define SOS_DEV_IOCTL_H_
+
+#define _IOCTL_IDENT_SHIFT 8
+#define _IOCTL_SIZE_SHIFT 16
+#define _IOCTL_READ 0x40000000
+#define _IOCTL_WRITE 0x80000000
+
+#define _IOCTL(i, n) (((i) << _IOCTL_IDENT_SHIFT) | (n))
+#define _IOCTLR(i, n, t)                                                       \
+  (_IOCTL(i, n) | (sizeof(t) << _IOCTL_SIZE_SHIFT) | _IOCTL_READ)
+#define _IOCTLW(i, n, t)                                                       \
+  (_IOCTL(i, n) | (sizeof(t) << _IOCTL_SIZE_SHIFT) | _IOCTL_WRITE)
+#define _IOCTLRW(i, n, t)                                                      \
+  (_IOCTL(i, n) | (sizeof(t) << _IOCTL_SIZE_SHIFT) | _IOCTL_READ               \
+   | _IOCTL_WRITE)
+
+#define I_MCU_GETINFO 0
+#define I_MCU_SETATTR 1
+#define I_MCU_SETACTION 2
+#define I_MCU_TOTAL 3
+
+#endif /* SOS_DEV_IOCTL_H_ */
@@ -0,0 +1,10 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS timer device interface (not used on the host)
+
+#ifndef SOS_DEV_TMR_H_
+#define SOS_DEV_TMR_H_
+
+#include <sdk/types.h>
+
+#endif /* SOS_DEV_TMR_H_ */
@@ -0,0 +1,35 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the StratifyOS asynchronous transfer types; only the
+// members fatfs uses to complete aio requests are provided
+
+#ifndef SOS_FS_DEVFS_H_
+#define SOS_FS_DEVFS_H_
+
+#include <sdk/types.h>
+
+typedef struct {
+  u32 o_events;
+  void *data;
+} mcu_event_t;
+
+typedef int (*mcu_callback_t)(void *, const mcu_event_t *);
+
+typedef struct {
+  mcu_callback_t callback;
+  void *context;
+} mcu_event_handler_t;
+
+typedef struct {
+  int tid;
+  int flags;
+  int loc;
+  union {
+    const volatile void *buf_const;
+    volatile void *buf;
+  };
+  int nbyte;
+  mcu_event_handler_t handler;
+} devfs_async_t;
+
+#endif /* SOS_FS_DEVFS_H_ */
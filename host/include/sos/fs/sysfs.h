@@ -0,0 +1,57 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the parts of the StratifyOS filesystem interface used by
+// fatfs; the sysfs_shared_* calls are implemented by host/src/sysfs_host.c
+
+#ifndef SOS_FS_SYSFS_H_
+#define SOS_FS_SYSFS_H_
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sdk/types.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct aiocb;
+
+typedef struct {
+  const void *fs;
+  void *handle;
+  int flags;
+  int loc;
+} sysfs_file_t;
+
+typedef struct {
+  sysfs_file_t file;
+  pthread_mutex_t mutex;
+} sysfs_shared_state_t;
+
+typedef struct {
+  const void *devfs;
+  char name[NAME_MAX + 1];
+  sysfs_shared_state_t *state;
+} sysfs_shared_config_t;
+
+int sysfs_shared_open(const sysfs_shared_config_t *config);
+int sysfs_shared_ioctl(
+  const sysfs_shared_config_t *config,
+  int request,
+  void *ctl);
+int sysfs_shared_read(
+  const sysfs_shared_config_t *config,
+  int loc,
+  void *buf,
+  int nbyte);
+int sysfs_shared_write(
+  const sysfs_shared_config_t *config,
+  int loc,
+  const void *buf,
+  int nbyte);
+int sysfs_shared_close(const sysfs_shared_config_t *config);
+
+#define SYSFS_SET_RETURN(x) (-(x))
+#define SYSFS_RETURN_SUCCESS 0
+#define SYSFS_NOTSUP ((void *)0)
+
+#endif /* SOS_FS_SYSFS_H_ */
@@ -0,0 +1,10 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// Host stand-in for the newlib lock header included by fatfs.h
+
+#ifndef SYS_LOCK_H_
+#define SYS_LOCK_H_
+
+#include <pthread.h>
+
+#endif /* SYS_LOCK_H_ */
@@ -0,0 +1,23 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// StratifyOS kernel calls referenced by fatfs, reduced to what a host process
+// can do
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sdk/types.h>
+
+int pthread_mutex_force_unlock(pthread_mutex_t *mutex) {
+  return pthread_mutex_unlock(mutex);
+}
+
+void cortexm_svcall(void (*function)(void *), void *args) { function(args); }
+
+void scheduler_svcall_set_delaymutex(void *args) { MCU_UNUSED_ARGUMENT(args); }
+
+u32 scheduler_timing_get_realtime() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000UL;
+}
@@ -0,0 +1,322 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// sysfs_shared_* on top of an image file or a RAM buffer so fatfs can run on a
+// workstation
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sos/dev/drive.h>
+#include <sos/fs/sysfs.h>
+
+#include "fatfs_host.h"
+
+#define HOST_DRIVE_COUNT 4
+
+typedef struct {
+  char name[NAME_MAX + 1];
+  fatfs_host_drive_config_t config;
+  u8 *ram;
+  int fd;
+  u64 busy_until_ns;
+  int write_error; // errno value every write fails with (0: none)
+  pthread_mutex_t mutex;
+} host_drive_t;
+
+static host_drive_t host_drives[HOST_DRIVE_COUNT];
+
+static u64 now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void delay_us(u64 microseconds) {
+  if (microseconds == 0) {
+    return;
+  }
+  struct timespec duration
+    = {.tv_sec = microseconds / 1000000UL,
+       .tv_nsec = (microseconds % 1000000UL) * 1000UL};
+  while (nanosleep(&duration, &duration) < 0 && errno == EINTR) {
+  }
+}
+
+static host_drive_t *find_drive(const char *name) {
+  for (int i = 0; i < HOST_DRIVE_COUNT; i++) {
+    if (host_drives[i].name[0] && strcmp(host_drives[i].name, name) == 0) {
+      return host_drives + i;
+    }
+  }
+  return NULL;
+}
+
+int fatfs_host_drive_attach(
+  const char *name,
+  const fatfs_host_drive_config_t *config) {
+  host_drive_t *drive = find_drive(name);
+  if (drive != NULL) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  if (
+    config->block_size == 0 || config->block_count == 0
+    || strnlen(name, NAME_MAX + 1) > NAME_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (int i = 0; i < HOST_DRIVE_COUNT && drive == NULL; i++) {
+    if (host_drives[i].name[0] == 0) {
+      drive = host_drives + i;
+    }
+  }
+  if (drive == NULL) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  const off_t size = (off_t)config->block_size * config->block_count;
+  memset(drive, 0, sizeof(host_drive_t));
+  drive->fd = -1;
+  if (config->image_path) {
+    drive->fd = open(config->image_path, O_RDWR | O_CREAT, 0666);
+    if (drive->fd < 0) {
+      return -1;
+    }
+    struct stat st;
+    if (fstat(drive->fd, &st) < 0 || (st.st_size < size && ftruncate(drive->fd, size) < 0)) {
+      close(drive->fd);
+      return -1;
+    }
+  } else {
+    drive->ram = calloc(1, size);
+    if (drive->ram == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  pthread_mutex_init(&drive->mutex, NULL);
+  drive->config = *config;
+  drive->config.image_path = NULL;
+  strcpy(drive->name, name);
+  return 0;
+}
+
+int fatfs_host_drive_set_timing(
+  const char *name,
+  u32 access_latency_us,
+  u32 block_latency_us,
+  u32 write_busy_us) {
+  host_drive_t *drive = find_drive(name);
+  if (drive == NULL) {
+    errno = ENODEV;
+    return -1;
+  }
+  pthread_mutex_lock(&drive->mutex);
+  drive->config.access_latency_us = access_latency_us;
+  drive->config.block_latency_us = block_latency_us;
+  drive->config.write_busy_us = write_busy_us;
+  pthread_mutex_unlock(&drive->mutex);
+  return 0;
+}
+
+int fatfs_host_drive_set_write_error(const char *name, int error) {
+  host_drive_t *drive = find_drive(name);
+  if (drive == NULL) {
+    errno = ENODEV;
+    return -1;
+  }
+  pthread_mutex_lock(&drive->mutex);
+  drive->write_error = error;
+  pthread_mutex_unlock(&drive->mutex);
+  return 0;
+}
+
+void fatfs_host_drive_detach(const char *name) {
+  host_drive_t *drive = find_drive(name);
+  if (drive == NULL) {
+    return;
+  }
+  if (drive->fd >= 0) {
+    close(drive->fd);
+  }
+  free(drive->ram);
+  pthread_mutex_destroy(&drive->mutex);
+  memset(drive, 0, sizeof(host_drive_t));
+}
+
+static host_drive_t *get_drive(const sysfs_shared_config_t *config) {
+  return (host_drive_t *)config->state->file.handle;
+}
+
+int fatfs_host_drive_wait_ready(const void *cfg, u32 timeout_microseconds) {
+  // fatfs_config_t starts with its sysfs_shared_config_t
+  host_drive_t *drive = get_drive(cfg);
+  if (drive == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&drive->mutex);
+  const u64 busy_until_ns = drive->busy_until_ns;
+  pthread_mutex_unlock(&drive->mutex);
+
+  const u64 now = now_ns();
+  if (now >= busy_until_ns) {
+    return 0;
+  }
+  const u64 remaining_us = (busy_until_ns - now + 999) / 1000;
+  if (timeout_microseconds && remaining_us > timeout_microseconds) {
+    delay_us(timeout_microseconds);
+    return -1;
+  }
+  delay_us(remaining_us);
+  return 0;
+}
+
+static int transfer(
+  host_drive_t *drive,
+  int loc,
+  void *buf,
+  int nbyte,
+  int is_write) {
+  const fatfs_host_drive_config_t *config = &drive->config;
+  const u32 blocks = nbyte / config->block_size;
+  int result = nbyte;
+
+  if (
+    loc < 0 || nbyte % config->block_size
+    || (u32)loc + blocks > config->block_count) {
+    return SYSFS_SET_RETURN(EINVAL);
+  }
+
+  pthread_mutex_lock(&drive->mutex);
+  if (is_write && now_ns() < drive->busy_until_ns) {
+    // like a card still programming: the caller must wait for I_DRIVE_ISBUSY
+    pthread_mutex_unlock(&drive->mutex);
+    return SYSFS_SET_RETURN(EBUSY);
+  }
+  delay_us(config->access_latency_us + (u64)config->block_latency_us * blocks);
+
+  const off_t offset = (off_t)loc * config->block_size;
+  if (is_write && drive->write_error) {
+    result = SYSFS_SET_RETURN(drive->write_error);
+  } else if (drive->ram) {
+    if (is_write) {
+      memcpy(drive->ram + offset, buf, nbyte);
+    } else {
+      memcpy(buf, drive->ram + offset, nbyte);
+    }
+  } else {
+    const ssize_t bytes = is_write ? pwrite(drive->fd, buf, nbyte, offset)
+                                   : pread(drive->fd, buf, nbyte, offset);
+    if (bytes != nbyte) {
+      result = SYSFS_SET_RETURN(EIO);
+    }
+  }
+
+  if (is_write && config->write_busy_us) {
+    drive->busy_until_ns = now_ns() + config->write_busy_us * 1000ULL;
+  }
+  pthread_mutex_unlock(&drive->mutex);
+  return result;
+}
+
+int sysfs_shared_open(const sysfs_shared_config_t *config) {
+  host_drive_t *drive = find_drive(config->name);
+  if (drive == NULL) {
+    return SYSFS_SET_RETURN(ENODEV);
+  }
+  config->state->file.fs = config->devfs ? config->devfs : (const void *)drive;
+  config->state->file.handle = drive;
+  config->state->file.flags = O_RDWR;
+  config->state->file.loc = 0;
+  return 0;
+}
+
+int sysfs_shared_ioctl(
+  const sysfs_shared_config_t *config,
+  int request,
+  void *ctl) {
+  host_drive_t *drive = get_drive(config);
+  if (drive == NULL) {
+    return SYSFS_SET_RETURN(EBADF);
+  }
+
+  switch (request) {
+  case I_DRIVE_ISBUSY:
+    return now_ns() < drive->busy_until_ns;
+
+  case I_DRIVE_GETINFO: {
+    drive_info_t *info = ctl;
+    memset(info, 0, sizeof(drive_info_t));
+    info->o_flags = DRIVE_FLAG_ERASE_BLOCKS | DRIVE_FLAG_INIT | DRIVE_FLAG_RESET;
+    info->address_size = 1;
+    info->write_block_size = drive->config.block_size;
+    info->num_write_blocks = drive->config.block_count;
+    info->erase_block_size = drive->config.block_size;
+    info->erase_block_time = drive->config.erase_busy_us;
+    return 0;
+  }
+
+  case I_DRIVE_SETATTR: {
+    const drive_attr_t *attr = ctl;
+    if (attr->o_flags & DRIVE_FLAG_ERASE_BLOCKS) {
+      // erased blocks read back as zero like on an SD card
+      if (attr->end < attr->start || attr->end >= drive->config.block_count) {
+        return SYSFS_SET_RETURN(EINVAL);
+      }
+      pthread_mutex_lock(&drive->mutex);
+      const u32 count = attr->end - attr->start + 1;
+      if (drive->ram) {
+        memset(
+          drive->ram + (size_t)attr->start * drive->config.block_size,
+          0,
+          (size_t)count * drive->config.block_size);
+      }
+      drive->busy_until_ns = now_ns() + drive->config.erase_busy_us * 1000ULL;
+      pthread_mutex_unlock(&drive->mutex);
+    }
+    return 0;
+  }
+  }
+
+  return SYSFS_SET_RETURN(EINVAL);
+}
+
+int sysfs_shared_read(
+  const sysfs_shared_config_t *config,
+  int loc,
+  void *buf,
+  int nbyte) {
+  host_drive_t *drive = get_drive(config);
+  if (drive == NULL) {
+    return SYSFS_SET_RETURN(EBADF);
+  }
+  return transfer(drive, loc, buf, nbyte, 0);
+}
+
+int sysfs_shared_write(
+  const sysfs_shared_config_t *config,
+  int loc,
+  const void *buf,
+  int nbyte) {
+  host_drive_t *drive = get_drive(config);
+  if (drive == NULL) {
+    return SYSFS_SET_RETURN(EBADF);
+  }
+  return transfer(drive, loc, (void *)buf, nbyte, 1);
+}
+
+int sysfs_shared_close(const sysfs_shared_config_t *config) {
+  config->state->file.handle = NULL;
+  config->state->file.fs = NULL;
+  return 0;
+}
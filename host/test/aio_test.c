@@ -0,0 +1,77 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// fatfs_aio() completes reads and writes before it returns, with the result in
+// the return value and async.nbyte, and never calls the handler
+
+#include <aio.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "fatfs_test.h"
+
+#define DRIVE_NAME "test0"
+#define CHUNK_SIZE 3000
+#define CHUNK_COUNT 6
+
+FATFS_DECLARE_CONFIG_STATE(volume, 0, DRIVE_NAME, 0, 10, 0);
+
+static const void *cfg = &volume_config;
+static u8 buffer[CHUNK_SIZE];
+static int handler_calls;
+
+static int handler(void *context, const mcu_event_t *event) {
+  MCU_UNUSED_ARGUMENT(context);
+  MCU_UNUSED_ARGUMENT(event);
+  handler_calls++;
+  return 0;
+}
+
+static int submit(void *handle, int opcode, u32 loc, u32 nbyte) {
+  struct aiocb aio = {};
+  aio.aio_lio_opcode = opcode;
+  aio.aio_offset = loc;
+  aio.aio_buf = buffer;
+  aio.aio_nbytes = nbyte;
+  aio.async.handler.callback = handler;
+  aio.async.nbyte = -1;
+  const int result = fatfs_aio(cfg, handle, &aio);
+  TEST_CHECK(aio.async.nbyte == result);
+  return result;
+}
+
+int main() {
+  void *handle;
+
+  test_attach(DRIVE_NAME, 512, 65536);
+  test_format(cfg);
+
+  TEST_CALL(fatfs_open(cfg, &handle, "/aio.bin", O_CREAT | O_RDWR, 0666));
+  for (u32 i = 0; i < CHUNK_COUNT; i++) {
+    test_fill(buffer, 1, i * CHUNK_SIZE, CHUNK_SIZE);
+    const int result = submit(handle, LIO_WRITE, i * CHUNK_SIZE, CHUNK_SIZE);
+    TEST_CHECK(result == CHUNK_SIZE);
+  }
+
+  // backwards, so each read seeks
+  for (int i = CHUNK_COUNT - 1; i >= 0; i--) {
+    memset(buffer, 0, sizeof(buffer));
+    const int result = submit(handle, LIO_READ, i * CHUNK_SIZE, CHUNK_SIZE);
+    TEST_CHECK(result == CHUNK_SIZE);
+    TEST_CHECK(test_compare(buffer, 1, i * CHUNK_SIZE, CHUNK_SIZE) < 0);
+  }
+
+  // past the end of the file nothing is read
+  TEST_CHECK(submit(handle, LIO_READ, CHUNK_COUNT * CHUNK_SIZE, 100) == 0);
+  TEST_CHECK(submit(handle, LIO_NOP, 0, 100) < 0);
+  TEST_CHECK(handler_calls == 0);
+  TEST_CALL(fatfs_close(cfg, &handle));
+
+  // a read-only file refuses the write
+  TEST_CALL(fatfs_open(cfg, &handle, "/aio.bin", O_RDONLY, 0));
+  TEST_CHECK(submit(handle, LIO_WRITE, 0, 100) < 0);
+  TEST_CALL(fatfs_close(cfg, &handle));
+
+  TEST_CALL(fatfs_unmount(cfg));
+  printf("aio_test passed\n");
+  return 0;
+}
@@ -0,0 +1,98 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// threads writing different files of one volume each wait for the drive to be
+// ready: the host drive refuses a write while it is busy, so a request that
+// slips in between another thread's busy wait and its transfer shows up as a
+// retry or a failed write
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "fatfs_test.h"
+
+#define DRIVE_NAME "test0"
+#define THREAD_COUNT 4
+#define CHUNK_SIZE 4096
+#define CHUNK_COUNT 32
+
+FATFS_DECLARE_CONFIG_STATE(volume, 0, DRIVE_NAME, 0, 10, 0);
+
+static const void *cfg = &volume_config;
+
+static void build_path(char *path, u32 seed) {
+  sprintf(path, "/thread%u.bin", seed);
+}
+
+static void *write_thread(void *args) {
+  const u32 seed = (u32)(uintptr_t)args;
+  u8 *buffer = malloc(CHUNK_SIZE);
+  char path[32];
+  void *handle;
+
+  TEST_CHECK(buffer);
+  build_path(path, seed);
+  TEST_CALL(fatfs_open(cfg, &handle, path, O_CREAT | O_RDWR, 0666));
+  for (u32 i = 0; i < CHUNK_COUNT; i++) {
+    const u32 loc = i * CHUNK_SIZE;
+    test_fill(buffer, seed, loc, CHUNK_SIZE);
+    TEST_CHECK(
+      fatfs_write(cfg, handle, 0, loc, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+  }
+  TEST_CALL(fatfs_close(cfg, &handle));
+  free(buffer);
+  return NULL;
+}
+
+static void check_file(u32 seed) {
+  u8 *buffer = malloc(CHUNK_SIZE);
+  char path[32];
+  void *handle;
+
+  TEST_CHECK(buffer);
+  build_path(path, seed);
+  TEST_CALL(fatfs_open(cfg, &handle, path, O_RDONLY, 0));
+  for (u32 i = 0; i < CHUNK_COUNT; i++) {
+    const u32 loc = i * CHUNK_SIZE;
+    TEST_CHECK(
+      fatfs_read(cfg, handle, 0, loc, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+    TEST_CHECK(test_compare(buffer, seed, loc, CHUNK_SIZE) < 0);
+  }
+  TEST_CALL(fatfs_close(cfg, &handle));
+  free(buffer);
+}
+
+int main() {
+  pthread_t threads[THREAD_COUNT];
+  fatfs_stats_t stats;
+
+  test_attach(DRIVE_NAME, 512, 32768);
+  test_format(cfg);
+  // a thread polling during another's transfer finds the drive idle
+  TEST_CALL(fatfs_host_drive_set_timing(DRIVE_NAME, 100, 0, 200));
+  TEST_CALL(fatfs_ioctl(cfg, NULL, I_FATFS_RESETSTATS, NULL));
+
+  for (u32 i = 0; i < THREAD_COUNT; i++) {
+    TEST_CHECK(
+      pthread_create(threads + i, NULL, write_thread, (void *)(uintptr_t)i)
+      == 0);
+  }
+  for (u32 i = 0; i < THREAD_COUNT; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  TEST_CALL(fatfs_ioctl(cfg, NULL, I_FATFS_GETSTATS, &stats));
+  printf(
+    "%u writes, %u busy polls, %u retries\n",
+    stats.write_count,
+    stats.busy_polls,
+    stats.write_retries);
+  TEST_CHECK(stats.write_retries == 0);
+
+  for (u32 i = 0; i < THREAD_COUNT; i++) {
+    check_file(i);
+  }
+  TEST_CALL(fatfs_unmount(cfg));
+  printf("busy_drive_test passed\n");
+  return 0;
+}
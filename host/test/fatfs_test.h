@@ -0,0 +1,78 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// helpers shared by the host regression tests; each test is an executable
+// that exits non-zero on the first failed check (see host/CMakeLists.txt)
+
+#ifndef FATFS_TEST_H_
+#define FATFS_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fatfs.h"
+#include "fatfs_host.h"
+
+#define TEST_CHECK(expr)                                                       \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+// checks a fatfs_*() call that returns a negative errno on failure
+#define TEST_CALL(expr)                                                        \
+  do {                                                                         \
+    const int test_result = (expr);                                            \
+    if (test_result < 0) {                                                     \
+      fprintf(                                                                 \
+        stderr,                                                                \
+        "%s:%d: %s failed (%d)\n",                                             \
+        __FILE__,                                                              \
+        __LINE__,                                                              \
+        #expr,                                                                 \
+        test_result);                                                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+// deterministic file contents: byte i of a file depends on i and the seed
+static inline u8 test_pattern(u32 seed, u32 i) {
+  u32 x = (i + 1) * 2654435761UL + seed * 40503UL;
+  return (u8)(x ^ (x >> 13) ^ (x >> 24));
+}
+
+static inline void test_fill(u8 *buf, u32 seed, u32 offset, u32 size) {
+  for (u32 i = 0; i < size; i++) {
+    buf[i] = test_pattern(seed, offset + i);
+  }
+}
+
+// returns the offset of the first byte that differs from the pattern, or -1
+static inline int test_compare(const u8 *buf, u32 seed, u32 offset, u32 size) {
+  for (u32 i = 0; i < size; i++) {
+    if (buf[i] != test_pattern(seed, offset + i)) {
+      return (int)(offset + i);
+    }
+  }
+  return -1;
+}
+
+// attaches a RAM drive under name for a FATFS_DECLARE_CONFIG_STATE() volume
+static inline void test_attach(const char *name, u32 block_size, u32 count) {
+  const fatfs_host_drive_config_t drive
+    = {.block_size = block_size, .block_count = count};
+  TEST_CHECK(fatfs_host_drive_attach(name, &drive) == 0);
+}
+
+// formats the volume and leaves it mounted
+static inline void test_format(const void *cfg) {
+  // f_mkfs() needs the volume registered, which a mount attempt does
+  if (fatfs_mount(cfg) == 0) {
+    fatfs_unmount(cfg);
+  }
+  TEST_CALL(fatfs_mkfs(cfg));
+  TEST_CALL(fatfs_mount(cfg));
+}
+
+#endif /* FATFS_TEST_H_ */
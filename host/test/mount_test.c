@@ -0,0 +1,85 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// files and directories written through the sysfs entry points read back the
+// same after the volume is unmounted and mounted again
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fatfs_test.h"
+
+#define DRIVE_NAME "test0"
+#define FILE_COUNT 8
+#define FILE_SIZE 20000
+
+FATFS_DECLARE_CONFIG_STATE(volume, 0, DRIVE_NAME, 0, 10, 0);
+
+static const void *cfg = &volume_config;
+static u8 buffer[FILE_SIZE];
+
+static void build_path(char *path, int i) {
+  sprintf(path, "/dir%d/file number %d.dat", i % 2, i);
+}
+
+static void write_files() {
+  char path[64];
+  TEST_CALL(fatfs_mkdir(cfg, "/dir0", 0777));
+  TEST_CALL(fatfs_mkdir(cfg, "/dir1", 0777));
+  for (int i = 0; i < FILE_COUNT; i++) {
+    void *handle;
+    const u32 size = FILE_SIZE - i * 1000;
+    build_path(path, i);
+    test_fill(buffer, i, 0, size);
+    TEST_CALL(fatfs_open(cfg, &handle, path, O_CREAT | O_RDWR, 0666));
+    // uneven pieces so transfers start and end inside sectors
+    for (u32 loc = 0; loc < size; loc += 777) {
+      const u32 nbyte = size - loc < 777 ? size - loc : 777;
+      TEST_CHECK(
+        fatfs_write(cfg, handle, 0, loc, buffer + loc, nbyte) == (int)nbyte);
+    }
+    TEST_CALL(fatfs_close(cfg, &handle));
+  }
+}
+
+static void check_files() {
+  char path[64];
+  for (int i = 0; i < FILE_COUNT; i++) {
+    void *handle;
+    struct stat st;
+    const u32 size = FILE_SIZE - i * 1000;
+    build_path(path, i);
+    TEST_CALL(fatfs_stat(cfg, path, &st));
+    TEST_CHECK(st.st_size == size);
+    TEST_CALL(fatfs_open(cfg, &handle, path, O_RDONLY, 0));
+    memset(buffer, 0, sizeof(buffer));
+    TEST_CHECK(fatfs_read(cfg, handle, 0, 0, buffer, FILE_SIZE) == (int)size);
+    TEST_CHECK(test_compare(buffer, i, 0, size) < 0);
+    TEST_CALL(fatfs_close(cfg, &handle));
+  }
+}
+
+int main() {
+  test_attach(DRIVE_NAME, 512, 65536);
+  test_format(cfg);
+
+  write_files();
+  check_files();
+
+  TEST_CALL(fatfs_unmount(cfg));
+  TEST_CALL(fatfs_mount(cfg));
+  check_files();
+
+  // a renamed file keeps its data and the old name is gone
+  struct stat st;
+  TEST_CALL(fatfs_rename(cfg, "/dir0/file number 0.dat", "/dir1/renamed.dat"));
+  TEST_CHECK(fatfs_stat(cfg, "/dir0/file number 0.dat", &st) < 0);
+  TEST_CALL(fatfs_stat(cfg, "/dir1/renamed.dat", &st));
+  TEST_CHECK(st.st_size == FILE_SIZE);
+  TEST_CALL(fatfs_unlink(cfg, "/dir1/renamed.dat"));
+  TEST_CHECK(fatfs_stat(cfg, "/dir1/renamed.dat", &st) < 0);
+
+  TEST_CALL(fatfs_unmount(cfg));
+  printf("mount_test passed\n");
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// O_NONBLOCK reads and writes fail with EAGAIN while another thread holds the
+// volume, and only the call that passed the flag: a blocking read on the same
+// handle waits and succeeds
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fatfs_test.h"
+
+#define DRIVE_NAME "test0"
+#define FILE_SIZE 5000
+
+FATFS_DECLARE_CONFIG_STATE(volume, 0, DRIVE_NAME, 0, 10, 0);
+
+static const void *cfg = &volume_config;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int is_held;
+static int is_released;
+static void *handle;
+static u8 buffer[FILE_SIZE];
+
+static void *hold_thread(void *args) {
+  MCU_UNUSED_ARGUMENT(args);
+  _SYNC_t sobj = volume_state.fs.sobj;
+  TEST_CHECK(ff_req_grant(sobj, 0));
+  pthread_mutex_lock(&mutex);
+  is_held = 1;
+  pthread_cond_broadcast(&cond);
+  while (is_released == 0) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+  ff_rel_grant(sobj);
+  return NULL;
+}
+
+static void *read_thread(void *args) {
+  MCU_UNUSED_ARGUMENT(args);
+  static u8 data[FILE_SIZE];
+  TEST_CHECK(fatfs_read(cfg, handle, 0, 0, data, FILE_SIZE) == FILE_SIZE);
+  TEST_CHECK(test_compare(data, 1, 0, FILE_SIZE) < 0);
+  return NULL;
+}
+
+int main() {
+  pthread_t holder;
+  pthread_t reader;
+
+  test_attach(DRIVE_NAME, 512, 8192);
+  test_format(cfg);
+  TEST_CALL(fatfs_open(cfg, &handle, "/data.bin", O_CREAT | O_RDWR, 0666));
+  test_fill(buffer, 1, 0, FILE_SIZE);
+  TEST_CHECK(fatfs_write(cfg, handle, 0, 0, buffer, FILE_SIZE) == FILE_SIZE);
+  TEST_CALL(fatfs_fsync(cfg, handle));
+
+  TEST_CHECK(pthread_create(&holder, NULL, hold_thread, NULL) == 0);
+  pthread_mutex_lock(&mutex);
+  while (is_held == 0) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  TEST_CHECK(pthread_create(&reader, NULL, read_thread, NULL) == 0);
+  // the reader waits for the volume meanwhile
+  for (int i = 0; i < 20; i++) {
+    TEST_CHECK(
+      fatfs_read(cfg, handle, O_NONBLOCK, 0, buffer, FILE_SIZE)
+      == SYSFS_SET_RETURN(EAGAIN));
+    TEST_CHECK(
+      fatfs_write(cfg, handle, O_NONBLOCK, 0, buffer, FILE_SIZE)
+      == SYSFS_SET_RETURN(EAGAIN));
+    usleep(1000);
+  }
+
+  pthread_mutex_lock(&mutex);
+  is_released = 1;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(holder, NULL);
+  pthread_join(reader, NULL);
+
+  // nothing holds the volume now
+  TEST_CHECK(
+    fatfs_read(cfg, handle, O_NONBLOCK, 0, buffer, FILE_SIZE) == FILE_SIZE);
+  TEST_CHECK(test_compare(buffer, 1, 0, FILE_SIZE) < 0);
+  TEST_CALL(fatfs_close(cfg, &handle));
+  TEST_CALL(fatfs_unmount(cfg));
+  printf("nonblock_test passed\n");
+  return 0;
+}
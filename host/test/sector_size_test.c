@@ -0,0 +1,140 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// data written to volumes with 512, 1024, 2048 and 4096 byte sectors reads
+// back the same, before and after a remount, for transfers that start and end
+// inside sectors, use unaligned buffers and cross cluster boundaries
+
+#include <fcntl.h>
+#include <string.h>
+
+#include "fatfs_test.h"
+
+#define VOLUME_SIZE (16UL * 1024 * 1024)
+
+FATFS_DECLARE_CONFIG_STATE(volume0, 0, "test0", 0, 10, 0);
+FATFS_DECLARE_CONFIG_STATE(volume1, 0, "test1", 1, 10, 0);
+FATFS_DECLARE_CONFIG_STATE(volume2, 0, "test2", 2, 10, 0);
+FATFS_DECLARE_CONFIG_STATE(volume3, 0, "test3", 3, 10, 0);
+
+typedef struct {
+  const void *cfg;
+  const char *name;
+  u32 sector_size;
+} volume_t;
+
+static const volume_t volumes[] = {
+  {&volume0_config, "test0", 512},
+  {&volume1_config, "test1", 1024},
+  {&volume2_config, "test2", 2048},
+  {&volume3_config, "test3", 4096}};
+
+static u8 *expected; // what the file should hold
+static u8 *allocation;
+static u8 *buffer; // allocation + 1: never word aligned
+
+static void write_piece(const void *cfg, void *handle, u32 loc, u32 size) {
+  // the seed changes with every write so an overwrite that is lost shows
+  static u32 seed;
+  seed++;
+  test_fill(buffer, seed, loc, size);
+  memcpy(expected + loc, buffer, size);
+  TEST_CHECK(fatfs_write(cfg, handle, 0, loc, buffer, size) == (int)size);
+}
+
+static void check_piece(
+  const void *cfg,
+  void *handle,
+  u32 loc,
+  u32 size,
+  u8 *destination) {
+  memset(destination, 0, size);
+  TEST_CHECK(fatfs_read(cfg, handle, 0, loc, destination, size) == (int)size);
+  if (memcmp(destination, expected + loc, size) != 0) {
+    fprintf(stderr, "mismatch in %u bytes at %u\n", size, loc);
+    exit(1);
+  }
+}
+
+// reads the file back in pieces of the given size (the last one shorter)
+static void check_file(
+  const void *cfg,
+  const char *path,
+  u32 file_size,
+  u32 piece_size,
+  u8 *destination) {
+  void *handle;
+  TEST_CALL(fatfs_open(cfg, &handle, path, O_RDONLY, 0));
+  for (u32 loc = 0; loc < file_size; loc += piece_size) {
+    const u32 remaining = file_size - loc;
+    const u32 size = remaining < piece_size ? remaining : piece_size;
+    check_piece(cfg, handle, loc, size, destination);
+  }
+  // nothing past the end
+  TEST_CHECK(fatfs_read(cfg, handle, 0, file_size, destination, 1) == 0);
+  TEST_CALL(fatfs_close(cfg, &handle));
+}
+
+static void test_volume(const volume_t *volume) {
+  const void *cfg = volume->cfg;
+  const u32 ss = volume->sector_size;
+  fatfs_free_t info;
+  void *handle;
+
+  test_attach(volume->name, ss, VOLUME_SIZE / ss);
+  test_format(cfg);
+  TEST_CALL(fatfs_ioctl(cfg, NULL, I_FATFS_GETFREE, &info));
+  const u32 cluster = info.cluster_size;
+  TEST_CHECK(cluster % ss == 0);
+  const u32 file_size = 6 * cluster + ss + 1234;
+
+  expected = calloc(1, file_size);
+  allocation = malloc(file_size + 1);
+  TEST_CHECK(expected && allocation);
+  buffer = allocation + 1;
+
+  // sequential pieces around the sector and cluster sizes
+  const u32 sizes[]
+    = {1, ss - 1, ss + 1, 3 * ss + 7, cluster - 13, cluster + 13, 2 * cluster};
+  TEST_CALL(fatfs_open(cfg, &handle, "/data.bin", O_CREAT | O_RDWR, 0666));
+  u32 loc = 0;
+  for (u32 i = 0; loc < file_size; i++) {
+    u32 size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+    if (size > file_size - loc) {
+      size = file_size - loc;
+    }
+    write_piece(cfg, handle, loc, size);
+    loc += size;
+  }
+
+  // overwrites that straddle every cluster boundary, and one spanning several
+  for (u32 boundary = cluster; boundary < file_size; boundary += cluster) {
+    write_piece(cfg, handle, boundary - ss / 2 - 3, ss + 9);
+  }
+  write_piece(cfg, handle, cluster / 2 + 1, 3 * cluster + ss);
+
+  // read back through the same handle before anything is synced
+  check_piece(cfg, handle, 0, file_size, buffer);
+  check_piece(cfg, handle, cluster - 1, cluster + 2, buffer);
+  TEST_CALL(fatfs_close(cfg, &handle));
+
+  check_file(cfg, "/data.bin", file_size, 997, buffer);
+  check_file(cfg, "/data.bin", file_size, cluster, allocation);
+
+  TEST_CALL(fatfs_unmount(cfg));
+  TEST_CALL(fatfs_mount(cfg));
+  check_file(cfg, "/data.bin", file_size, file_size, buffer);
+  check_file(cfg, "/data.bin", file_size, ss + 1, allocation);
+  TEST_CALL(fatfs_unmount(cfg));
+
+  free(allocation);
+  free(expected);
+  printf("%u byte sectors, %u byte clusters: ok\n", ss, cluster);
+}
+
+int main() {
+  for (u32 i = 0; i < sizeof(volumes) / sizeof(volumes[0]); i++) {
+    test_volume(volumes + i);
+  }
+  printf("sector_size_test passed\n");
+  return 0;
+}
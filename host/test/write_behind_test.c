@@ -0,0 +1,91 @@
+// Copyright 2015-2021 Tyler Gilbert and Stratify Labs, Inc; see LICENSE.md
+
+// write-behind sectors the device refuses stay buffered, and the failure is
+// reported by the next fsync or close once they have been written
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fatfs_test.h"
+
+#define DRIVE_NAME "test0"
+// large enough that FATFS_MERGE_SIZE does not take the buffered sectors
+#define SECTOR_SIZE 2048
+#define PIECE_SIZE 100
+// three full sectors go to the write-behind buffer, the rest stays in file.buf
+#define FILE_SIZE (3 * SECTOR_SIZE + PIECE_SIZE)
+#define WRITE_BEHIND_SIZE (8 * SECTOR_SIZE)
+
+FATFS_DECLARE_CONFIG_STATE(volume, 0, DRIVE_NAME, 0, 10, 0);
+
+static const void *cfg = &volume_config;
+static u8 buffer[FILE_SIZE];
+
+static void *create_file(const char *path, u32 seed) {
+  const fatfs_write_behind_t write_behind = {.size = WRITE_BEHIND_SIZE};
+  void *handle;
+
+  TEST_CALL(fatfs_open(cfg, &handle, path, O_CREAT | O_RDWR, 0666));
+  TEST_CALL(
+    fatfs_ioctl(cfg, handle, I_FATFS_WRITEBEHIND, (void *)&write_behind));
+  test_fill(buffer, seed, 0, FILE_SIZE);
+  for (u32 loc = 0; loc < FILE_SIZE; loc += PIECE_SIZE) {
+    const u32 remaining = FILE_SIZE - loc;
+    const u32 size = remaining < PIECE_SIZE ? remaining : PIECE_SIZE;
+    const int result = fatfs_write(cfg, handle, 0, loc, buffer + loc, size);
+    TEST_CHECK(result == (int)size);
+  }
+  TEST_CHECK(((fatfs_file_t *)handle)->file.wbcnt == 3);
+  return handle;
+}
+
+static void check_file(const char *path, u32 seed) {
+  void *handle;
+  TEST_CALL(fatfs_open(cfg, &handle, path, O_RDONLY, 0));
+  TEST_CHECK(fatfs_read(cfg, handle, 0, 0, buffer, FILE_SIZE) == FILE_SIZE);
+  TEST_CHECK(test_compare(buffer, seed, 0, FILE_SIZE) < 0);
+  TEST_CALL(fatfs_close(cfg, &handle));
+}
+
+// the buffer is turned off while the device fails
+static void test_release(void) {
+  const fatfs_write_behind_t off = {.size = 0};
+  void *handle = create_file("/release.bin", 1);
+
+  TEST_CALL(fatfs_host_drive_set_write_error(DRIVE_NAME, EIO));
+  TEST_CHECK(fatfs_ioctl(cfg, handle, I_FATFS_WRITEBEHIND, (void *)&off) < 0);
+  TEST_CHECK(((fatfs_file_t *)handle)->file.wbcnt == 3);
+  TEST_CALL(fatfs_host_drive_set_write_error(DRIVE_NAME, 0));
+
+  // the retry writes the sectors, the failure is still reported once
+  TEST_CHECK(fatfs_fsync(cfg, handle) < 0);
+  TEST_CHECK(((fatfs_file_t *)handle)->file.wbcnt == 0);
+  TEST_CALL(fatfs_fsync(cfg, handle));
+  TEST_CALL(fatfs_close(cfg, &handle));
+  check_file("/release.bin", 1);
+}
+
+// the worker's flush of the aged buffer fails
+static void test_worker(void) {
+  void *handle = create_file("/worker.bin", 2);
+
+  TEST_CALL(fatfs_host_drive_set_write_error(DRIVE_NAME, EIO));
+  usleep(FATFS_WRITE_BEHIND_MAX_AGE_MS * 1500UL);
+  TEST_CHECK(((fatfs_file_t *)handle)->file.wbcnt == 3);
+  TEST_CALL(fatfs_host_drive_set_write_error(DRIVE_NAME, 0));
+
+  // close writes the sectors and reports the failure
+  TEST_CHECK(fatfs_close(cfg, &handle) < 0);
+  TEST_CHECK(handle == NULL);
+  check_file("/worker.bin", 2);
+}
+
+int main() {
+  test_attach(DRIVE_NAME, SECTOR_SIZE, 4096);
+  test_format(cfg);
+  test_release();
+  test_worker();
+  TEST_CALL(fatfs_unmount(cfg));
+  printf("write_behind_test passed\n");
+  return 0;
+}
@@ -3,17 +3,246 @@
 #ifndef FATFS_FATFS_H_
 #define FATFS_FATFS_H_
 
+#include <limits.h>
+#include <pthread.h>
 #include <sdk/types.h>
+#include <sos/dev/ioctl.h>
 #include <sos/fs/sysfs.h>
 #include <sys/lock.h>
 
 #include "fatfs/ff.h"
 
+#define FATFS_LOCK_WAIT_BUCKETS 7
+
+typedef struct {
+  u32 read_count;      // disk_read() calls
+  u32 read_sectors;    // sectors read
+  u32 write_count;     // disk_write() calls
+  u32 write_sectors;   // sectors written
+  u32 merged_writes;   // disk_write() calls joined to a pending device write
+  u32 read_retries;    // repeated attempts in fatfs_dev_read()
+  u32 write_retries;   // repeated attempts in fatfs_dev_write()
+  u32 busy_polls;      // I_DRIVE_ISBUSY polls that found the drive busy
+  u32 busy_timeouts;   // fatfs_dev_waitbusy() calls that timed out
+  u32 window_hits;     // move_window() calls served without a disk read
+  u32 window_misses;   // move_window() calls that read the disk
+  u32 fat_hits;        // FAT sector accesses served by the FAT cache
+  u32 fat_misses;      // FAT sector accesses that read the disk
+  u32 lock_waits;      // volume lock requests that had to wait
+  u32 dentry_hits;     // name lookups served by the directory entry cache
+  u32 dentry_misses;   // name lookups that scanned the directory
+  // volume lock grants by wait: none, <100us, <1ms, <10ms, <100ms, <1s, longer
+  u32 lock_wait_histogram[FATFS_LOCK_WAIT_BUCKETS];
+  u32 lock_timeouts;          // lock requests not granted (timeout or O_NONBLOCK)
+  u32 lock_hold_max_microseconds; // longest time the volume lock was held
+  u32 lock_hold_max_thread;   // thread that held it that long
+} fatfs_stats_t;
+
+#if _FS_WRITEBEHIND
+#if !defined FATFS_WORKER_STACK_SIZE
+// stack of the per-volume thread that writes aged write-behind buffers
+#define FATFS_WORKER_STACK_SIZE 4096
+#endif
+
+struct fatfs_file;
+
+// per-volume thread writing buffered sectors that nothing else writes within
+// FATFS_WRITE_BEHIND_MAX_AGE_MS; it runs from fatfs_mount() to fatfs_unmount()
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t request_cond;    // signaled when a file is listed or on stop
+  pthread_cond_t complete_cond;   // signaled when a flush ends or on exit
+  struct fatfs_file *aged_list;   // files with write-behind sectors
+  struct fatfs_file *active_file; // file being flushed (NULL: idle)
+  u8 is_initialized;
+  u8 is_running;
+  u8 is_stopping;                 // set by fatfs_unmount() until the exit
+} fatfs_worker_state_t;
+#endif
+
+#if !defined FATFS_FREE_COUNT_STACK_SIZE
+// stack of the thread counting free clusters in the background after mount
+#define FATFS_FREE_COUNT_STACK_SIZE 2048
+#endif
+
+#if !defined FATFS_FREE_COUNT_STOP_TIMEOUT_MS
+// how long fatfs_unmount() waits for the count to finish its current step
+#define FATFS_FREE_COUNT_STOP_TIMEOUT_MS 5000
+#endif
+
+#if !defined FATFS_MERGE_SIZE
+// bytes of small adjacent disk_write() requests collected into one device
+// write (0: every request goes to the device as it is)
+#define FATFS_MERGE_SIZE 0
+#endif
+
+#if FATFS_MERGE_SIZE
+// run of sectors written to the volume but not yet to the device
+typedef struct {
+  pthread_mutex_t mutex; // disk_write() is called without the volume lock
+  u32 sector;            // first sector of the run
+  u32 count;             // sectors in the run (0: none)
+  u32 next_sector;       // sector following the last write sent to the device
+  u8 is_initialized;
+  u8 is_failed; // a write of the run failed; reported by the next CTRL_SYNC
+  BYTE buffer[FATFS_MERGE_SIZE] FF_ALIGN_WINDOW;
+} fatfs_merge_t;
+#endif
+
 typedef struct {
   sysfs_shared_state_t drive;
+  // held by fatfs_dev.c from the busy wait to the end of the transfer and its
+  // retries, so no thread's request reaches the drive while it is busy
+  pthread_mutex_t device_mutex;
+  u8 is_device_initialized;
   FATFS fs;
+#if _FS_WRITEBEHIND
+  fatfs_worker_state_t worker;
+#endif
+#if _FS_FREECOUNT && !_FS_READONLY
+  // set while a thread counts the free clusters (see fatfs_mount())
+  volatile u8 is_free_count_running;
+  // set by fatfs_unmount() to end the count after its current step
+  volatile u8 is_free_count_stopping;
+  // process the counting thread belongs to (it ends with the process)
+  int free_count_pid;
+#endif
+  // driver level counters; the ff.c counters live in fs (see I_FATFS_GETSTATS)
+  fatfs_stats_t stats;
+#if FATFS_MERGE_SIZE
+  // adjacent writes waiting to reach the device as one (see diskio.c)
+  fatfs_merge_t merge;
+#endif
+#if _FS_WINCACHE
+  // arena for the sector cache behind fs.win (see _FS_WINCACHE in ffconf.h)
+  BYTE win_cache[_FS_WINCACHE * _MAX_SS] FF_ALIGN_WINDOW;
+#endif
+#if _FS_FATCACHE
+  // arena for the FAT sector cache (see _FS_FATCACHE in ffconf.h)
+  BYTE fat_cache[_FS_FATCACHE * _MAX_SS] FF_ALIGN_WINDOW;
+#endif
+#if _FS_BOUNCE
+  // staging buffer for reads/writes of unaligned buffers (see _FS_BOUNCE)
+  BYTE bounce_buffer[_FS_BOUNCE * _MAX_SS] FF_ALIGN_WINDOW;
+#endif
+#if _FS_DCACHE
+  // directory entry cache table (see _FS_DCACHE in ffconf.h)
+  DCENT dentry_cache[_FS_DCACHE];
+#endif
+#if _FS_FREEMAP
+  // arena for the free cluster bitmap (see _FS_FREEMAP in ffconf.h)
+  DWORD free_map[_FS_FREEMAP / 4];
+#endif
+#if _FS_DIRINDEX
+  // arenas for the indexes of large directories (see _FS_DIRINDEX in ffconf.h)
+  DWORD dir_index[_FS_DIRINDEX * (_FS_DIRIXMAX / 4)];
+#endif
 } fatfs_state_t;
 
+#if !defined FATFS_LINK_MAP_INITIAL_SIZE
+// items first allocated for a file's cluster link map (2 per fragment + 2)
+#define FATFS_LINK_MAP_INITIAL_SIZE 10
+#endif
+
+#if !defined FATFS_LINK_MAP_MAX_SIZE
+// files needing a larger link map fall back to walking the FAT on seek
+#define FATFS_LINK_MAP_MAX_SIZE 258
+#endif
+
+#if !defined FATFS_READ_AHEAD_SIZE
+// read-ahead buffer attached once sequential reads are detected (bytes)
+#define FATFS_READ_AHEAD_SIZE 2048
+#endif
+
+#if !defined FATFS_READ_AHEAD_TRIGGER
+// back-to-back sequential reads that turn read-ahead on
+#define FATFS_READ_AHEAD_TRIGGER 2
+#endif
+
+#if !defined FATFS_WRITE_BEHIND_SIZE
+// write-behind buffer attached once sequential writes are detected (bytes)
+#define FATFS_WRITE_BEHIND_SIZE 4096
+#endif
+
+#if !defined FATFS_WRITE_BEHIND_TRIGGER
+// back-to-back sequential writes that turn write-behind on
+#define FATFS_WRITE_BEHIND_TRIGGER 2
+#endif
+
+#if !defined FATFS_WRITE_BEHIND_MAX_AGE_MS
+// buffered sectors older than this are written by the next fatfs_write() or,
+// once the file is no longer written, by the volume's worker thread
+#define FATFS_WRITE_BEHIND_MAX_AGE_MS 1000
+#endif
+
+#if !defined FATFS_DIR_MARK_INTERVAL
+// entries between the positions a directory handle remembers for seeking (loc
+// is reached from the nearest mark instead of rescanning from the start)
+#define FATFS_DIR_MARK_INTERVAL 16
+#endif
+
+// position of a directory entry (see f_seekdir())
+typedef struct {
+  DWORD cluster;
+  WORD index;
+} fatfs_dir_mark_t;
+
+// handle returned by fatfs_opendir(); dir stays first so handles can be used as
+// FDIR pointers
+typedef struct {
+  FDIR dir;
+  int loc;                 // loc of the entry dir reads next
+  fatfs_dir_mark_t *marks; // marks[n]: where loc (n + 1) * interval starts
+  u16 mark_count;          // marks recorded
+  u16 mark_size;           // items allocated for marks
+} fatfs_dir_t;
+
+// handle returned by fatfs_open(); file stays first so handles can be used as
+// FIL pointers
+typedef struct fatfs_file {
+  FIL file;
+  fatfs_dir_t *dir; // set when opened with O_DIRECTORY (file is not used)
+#if _USE_FASTSEEK
+  DWORD *link_map;         // cluster link map for f_lseek() (NULL: not built)
+  DWORD link_map_clusters; // file clusters when link_map was last built
+  u16 link_map_size;       // items allocated for link_map
+#endif
+#if _FS_READAHEAD
+  BYTE *read_ahead;        // buffer behind file.rabuf (NULL: not allocated)
+  u32 read_ahead_size;     // bytes allocated for read_ahead
+  u32 next_loc;            // location a sequential read continues from
+  u8 sequential_count;     // back-to-back sequential reads (saturates)
+  u8 is_read_ahead_fixed;  // set by I_FATFS_READAHEAD (no detection)
+#endif
+#if _FS_WRITEBEHIND
+  BYTE *write_behind;        // buffer behind file.wbbuf (NULL: not allocated)
+  u32 write_behind_size;     // bytes allocated for write_behind
+  u32 write_behind_time;     // when the oldest buffered sector was added (us)
+  u32 next_write_loc;        // location a sequential write continues from
+  u8 sequential_writes;      // back-to-back sequential writes (saturates)
+  u8 is_write_behind_fixed;  // set by I_FATFS_WRITEBEHIND (no detection)
+  u8 is_write_behind_failed; // a flush failed; reported by fsync or close
+  // the volume's worker thread writes the buffer once it is too old
+  struct fatfs_file *next_aged; // next file in the worker's aged_list
+  int pid;                      // process that opened the file (owns buffers)
+#endif
+} fatfs_file_t;
+
+// entry filled by fatfs_readdir_batch()
+typedef struct {
+  u32 size;      // file size in bytes
+  u16 date;      // last modified date (FAT format, as FILINFO::fdate)
+  u16 time;      // last modified time (FAT format, as FILINFO::ftime)
+  u8 attributes; // AM_* attributes
+  char name[NAME_MAX + 1];
+} fatfs_dirent_t;
+
+typedef struct {
+  int loc;                 // first entry to read
+  int count;               // entries available in entries
+  fatfs_dirent_t *entries; // receives the entries
+} fatfs_readdir_batch_t;
+
 typedef struct {
   u32 block_offset;
   u32 block_count;
@@ -23,6 +252,18 @@ typedef struct {
   sysfs_shared_config_t drive;
   fatfs_config_partition_t partition;
   int (*is_drive_present)();
+  // optional: blocks until the drive is no longer busy (for example on a
+  // semaphore given by the drive's ready interrupt) and returns 0, or a
+  // negative value on error or when timeout_microseconds (0: no limit) passes;
+  // when NULL the drive is polled every wait_busy_microseconds
+  int (*wait_ready)(const void *cfg, u32 timeout_microseconds);
+  u32 wait_ready_timeout_microseconds;
+  // longest wait for the volume or a file lock before a call fails with
+  // EAGAIN (0: _FS_TIMEOUT)
+  u32 lock_timeout_microseconds;
+  // keep only the first FAT up to date; the other copies are never written (0:
+  // they are written in batches at sync, see _FS_FATMIRROR in ffconf.h)
+  u8 is_single_fat;
   u16 wait_busy_microseconds;
   u16 wait_busy_timeout_count;
   u8 vol_id;
@@ -64,6 +305,89 @@ typedef struct {
     .partition.block_offset = partition_block_offset_value,                                               \
     .partition.block_count = partition_block_count_value}
 
+#define FATFS_DECLARE_CONFIG_STATE_WAIT_READY(                                                            \
+  config_name,                                                                                            \
+  devfs_value,                                                                                            \
+  device_name,                                                                                            \
+  vol_id_value,                                                                                           \
+  wait_ready_value,                                                                                       \
+  wait_ready_timeout_microseconds_value)                                                                  \
+  fatfs_state_t config_name##_state;                                                                      \
+  const fatfs_config_t config_name##_config = {                                                           \
+    .drive                                                                                                \
+    = {.devfs = devfs_value, .name = device_name, .state = (sysfs_shared_state_t *)&config_name##_state}, \
+    .vol_id = vol_id_value,                                                                               \
+    .wait_ready = wait_ready_value,                                                                       \
+    .wait_ready_timeout_microseconds = wait_ready_timeout_microseconds_value,                             \
+    .partition.block_offset = 0,                                                                          \
+    .partition.block_count = 0}
+
+#define FATFS_IOC_IDENT_CHAR 'F'
+
+enum fatfs_expand_flags {
+  FATFS_EXPAND_FLAG_ALLOCATE
+  = (1 << 0), // reserve the clusters now and set the file size (otherwise only
+              // point the next allocation at the contiguous block)
+};
+
+typedef struct {
+  u32 o_flags; // FATFS_EXPAND_FLAG_*
+  u32 size;    // number of bytes to reserve in one contiguous block
+} fatfs_expand_t;
+
+enum fatfs_read_ahead_flags {
+  FATFS_READ_AHEAD_FLAG_AUTO
+  = (1 << 0), // go back to turning read-ahead on when sequential reads are
+              // detected (size is ignored)
+};
+
+typedef struct {
+  u32 o_flags; // FATFS_READ_AHEAD_FLAG_*
+  u32 size;    // bytes to prefetch for partial sector reads (0: disable)
+} fatfs_read_ahead_t;
+
+enum fatfs_write_behind_flags {
+  FATFS_WRITE_BEHIND_FLAG_AUTO
+  = (1 << 0), // go back to turning write-behind on when sequential writes
+              // are detected (size is ignored)
+};
+
+typedef struct {
+  u32 o_flags; // FATFS_WRITE_BEHIND_FLAG_*
+  u32 size;    // bytes of written sectors to collect (0: disable)
+} fatfs_write_behind_t;
+
+enum fatfs_free_flags {
+  FATFS_FREE_FLAG_COUNTING
+  = (1 << 0), // the free clusters are still being counted in the background
+              // and free_clusters only covers the part counted so far
+};
+
+typedef struct {
+  u32 o_flags;        // FATFS_FREE_FLAG_*
+  u32 free_clusters;  // free clusters on the volume
+  u32 total_clusters; // clusters on the volume
+  u32 cluster_size;   // bytes per cluster
+} fatfs_free_t;
+
+// reserve a contiguous block for an empty file opened for writing
+#define I_FATFS_EXPAND _IOCTLW(FATFS_IOC_IDENT_CHAR, 0, fatfs_expand_t)
+// read the access counters of the volume the file belongs to
+#define I_FATFS_GETSTATS _IOCTLR(FATFS_IOC_IDENT_CHAR, 1, fatfs_stats_t)
+// zero the access counters of the volume the file belongs to
+#define I_FATFS_RESETSTATS _IOCTL(FATFS_IOC_IDENT_CHAR, 2)
+// set the read-ahead buffer of the file
+#define I_FATFS_READAHEAD _IOCTLW(FATFS_IOC_IDENT_CHAR, 3, fatfs_read_ahead_t)
+// set the write-behind buffer of the file (buffered sectors are written first)
+#define I_FATFS_WRITEBEHIND                                                    \
+  _IOCTLW(FATFS_IOC_IDENT_CHAR, 4, fatfs_write_behind_t)
+// read the free space of the volume the file belongs to
+#define I_FATFS_GETFREE _IOCTLR(FATFS_IOC_IDENT_CHAR, 5, fatfs_free_t)
+// read entries of a directory opened with O_DIRECTORY (see
+// fatfs_readdir_batch()); returns the number read (0: end of directory)
+#define I_FATFS_READDIR_BATCH                                                  \
+  _IOCTLRW(FATFS_IOC_IDENT_CHAR, 6, fatfs_readdir_batch_t)
+
 int fatfs_mount(const void *cfg);     // initialize the filesystem
 int fatfs_unmount(const void *cfg);   // initialize the filesystem
 int fatfs_ismounted(const void *cfg); // initialize the filesystem
@@ -75,6 +399,14 @@ int fatfs_readdir_r(
   void *handle,
   int loc,
   struct dirent *entry);
+// reads up to count entries starting at loc; returns the number read (0: end
+// of directory)
+int fatfs_readdir_batch(
+  const void *cfg,
+  void *handle,
+  int loc,
+  fatfs_dirent_t *entries,
+  int count);
 int fatfs_rewinddir(const void *cfg, void *handle);
 int fatfs_closedir(const void *cfg, void **handle);
 
@@ -105,6 +437,8 @@ int fatfs_write(
   const void *buf,
   int nbyte);
 int fatfs_fsync(const void *cfg, void *handle);
+int fatfs_ioctl(const void *cfg, void *handle, int request, void *ctl);
+int fatfs_aio(const void *cfg, void *handle, struct aiocb *aio);
 int fatfs_close(const void *cfg, void **handle);
 int fatfs_remove(const void *cfg, const char *path);
 int fatfs_unlink(const void *cfg, const char *path);
@@ -118,9 +452,9 @@ int fatfs_stat(const void *cfg, const char *path, struct stat *stat);
     .mount_path = mount_loc_name, .permissions = permissions_value,            \
     .owner = owner_value, .mount = fatfs_mount, .unmount = fatfs_unmount,      \
     .ismounted = fatfs_ismounted, .startup = SYSFS_NOTSUP, .mkfs = fatfs_mkfs, \
-    .open = fatfs_open, .aio = SYSFS_NOTSUP, .fsync = fatfs_fsync,             \
+    .open = fatfs_open, .aio = fatfs_aio, .fsync = fatfs_fsync,                \
     .read = fatfs_read, .write = fatfs_write, .close = fatfs_close,            \
-    .ioctl = SYSFS_NOTSUP, .rename = fatfs_rename, .unlink = fatfs_unlink,     \
+    .ioctl = fatfs_ioctl, .rename = fatfs_rename, .unlink = fatfs_unlink,      \
     .mkdir = fatfs_mkdir, .rmdir = fatfs_rmdir, .remove = fatfs_remove,        \
     .opendir = fatfs_opendir, .closedir = fatfs_closedir,                      \
     .readdir_r = fatfs_readdir_r, .link = SYSFS_NOTSUP,                        \
@@ -73,6 +73,44 @@ typedef char TCHAR;
 
 
 
+/* Directory entry cache slot (DCENT) */
+
+#if _FS_DCACHE
+typedef struct {
+	DWORD	pclust;			/* Start cluster of the parent directory (0:root) */
+	DWORD	sect;			/* Sector containing the SFN entry (0:empty slot, 0xFFFFFFFF:name does not exist) */
+	DWORD	clust;			/* Directory cluster containing sect (0:static root directory) */
+	DWORD	sclust;			/* Start cluster of the object */
+	DWORD	age;			/* Last use stamp */
+	WORD	index;			/* Index of the SFN entry in the parent directory */
+	WORD	lfn_idx;		/* Index of the top LFN entry (0xFFFF:No LFN) */
+	BYTE	attr;			/* Attribute of the object */
+	BYTE	sfn[11];		/* SFN of the entry, checked when the entry is loaded */
+#if _USE_LFN
+	WCHAR	name[_FS_DCNAME];	/* Up-cased name, zero padded */
+#endif
+} DCENT;
+#endif
+
+
+
+/* Directory index (DIRIX) */
+
+#if _FS_DIRINDEX
+typedef struct {
+	DWORD	sclust;			/* Start cluster of the directory (0:root) */
+	DWORD	age;			/* Last use stamp */
+	DWORD*	map;			/* Hash slots, free entry bitmap and clusters of the table (in FATFS.dixbuf) */
+	UINT	nslot;			/* Number of hash slots */
+	UINT	nent;			/* Number of entries in the directory table */
+	UINT	cap;			/* Number of entries the bitmap can hold */
+	UINT	nclst;			/* Number of clusters of the table (0:Static root directory) */
+	BYTE	flag;			/* 0:Not in use, 1:Indexed, 2:Directory cannot be indexed */
+} DIRIX;
+#endif
+
+
+
 /* File system object structure (FATFS) */
 
 typedef struct {
@@ -104,6 +142,56 @@ typedef struct {
 	DWORD	dirbase;		/* Root directory start sector (FAT32:Cluster#) */
 	DWORD	database;		/* Data start sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
+#if _FS_WINCACHE
+	BYTE*	wcbuf;			/* Sector cache arena (_FS_WINCACHE * _MAX_SS bytes, NULL:disabled) */
+	DWORD	wcsect[_FS_WINCACHE];	/* Sector held in each cache entry (0xFFFFFFFF:empty) */
+	DWORD	wcage[_FS_WINCACHE];	/* Last use stamp of each cache entry */
+	BYTE	wcflag[_FS_WINCACHE];	/* Cache entry flags (b0:dirty) */
+	DWORD	wcclk;			/* Use stamp counter */
+#endif
+#if _FS_FATCACHE
+	BYTE*	fcbuf;			/* FAT cache arena (_FS_FATCACHE * _MAX_SS bytes, NULL:use win[]) */
+	DWORD	fcsect[_FS_FATCACHE];	/* FAT sector held in each cache entry (0xFFFFFFFF:empty) */
+	DWORD	fcage[_FS_FATCACHE];	/* Last use stamp of each cache entry */
+	BYTE	fcflag[_FS_FATCACHE];	/* Cache entry flags (b0:dirty) */
+	DWORD	fcclk;			/* Use stamp counter */
+#endif
+#if _FS_FATMIRROR && !_FS_READONLY
+	BYTE	fmmode;			/* FAT copies 0:Written at sync, 1:Never written (single active FAT; set before mounting) */
+	BYTE	fmflag;			/* b0:The boot sector marks a single active FAT (FAT32) */
+	UINT	fmcnt;			/* Number of sectors in fmset[] */
+	DWORD	fmset[_FS_FATMIRROR];	/* FAT sectors (offset from fatbase) whose copies are out of date */
+#endif
+#if _FS_BOUNCE
+	BYTE*	bbuf;			/* Aligned staging arena for unaligned file buffers (_FS_BOUNCE * _MAX_SS bytes, NULL:one sector at a time) */
+#endif
+	DWORD	n_winhit;		/* move_window() calls served without a disk read */
+	DWORD	n_winmiss;		/* move_window() calls that read the disk */
+	DWORD	n_fathit;		/* FAT sector accesses served by the FAT cache */
+	DWORD	n_fatmiss;		/* FAT sector accesses that read the disk */
+#if _FS_DCACHE
+	DCENT*	dcache;			/* Directory entry cache table (_FS_DCACHE slots, NULL:disabled) */
+	DWORD	dcclk;			/* Use stamp counter */
+	DWORD	n_dchit;		/* Name lookups served by the directory entry cache (found or not) */
+	DWORD	n_dcmiss;		/* Name lookups that scanned the directory */
+#endif
+#if _FS_DIRINDEX
+	DWORD*	dixbuf;			/* Directory index arena (_FS_DIRINDEX * _FS_DIRIXMAX bytes, NULL:disabled) */
+	DIRIX	dix[_FS_DIRINDEX];	/* Indexes of large directories */
+	DWORD	dixclk;			/* Use stamp counter */
+#endif
+#if _FS_REENTRANT
+	DWORD	n_lockwait;		/* Volume lock requests that had to wait */
+#endif
+#if _FS_FREEMAP
+	DWORD*	fmbuf;			/* Free cluster bitmap arena (_FS_FREEMAP bytes, NULL:disabled) */
+	DWORD*	fmap;			/* Free cluster bitmap (bit set:cluster in use, NULL:not complete) */
+	DWORD	fmclst;			/* Next cluster to be mapped (0:Not started) */
+#endif
+#if _FS_FREECOUNT && !_FS_READONLY
+	DWORD	fcnt_clst;		/* Next cluster to be counted by f_countfree() (0:Not counting) */
+	DWORD	fcnt_free;		/* Free clusters found below fcnt_clst */
+#endif
         BYTE win[_MAX_SS] FF_ALIGN_WINDOW; /* Disk access window for Directory,
                                               FAT (and file data at tiny cfg) */
 } FATFS;
@@ -132,6 +220,21 @@ typedef struct {
 #if _FS_LOCK
 	UINT	lockid;			/* File lock ID origin from 1 (index of file semaphore table Files[]) */
 #endif
+#if _FS_READAHEAD
+	BYTE*	rabuf;			/* Read-ahead buffer (Nulled on file open, word aligned) */
+	UINT	rasize;			/* Sectors rabuf[] can hold (0:read-ahead disabled) */
+	DWORD	rasect;			/* First sector held in rabuf[] */
+	UINT	racnt;			/* Number of valid sectors in rabuf[] */
+#endif
+#if _FS_WRITEBEHIND
+	BYTE*	wbbuf;			/* Write-behind buffer (Nulled on file open, word aligned) */
+	UINT	wbsize;			/* Sectors wbbuf[] can hold (0:write-behind disabled) */
+	DWORD	wbsect;			/* Sector of wbbuf[0] */
+	UINT	wbcnt;			/* Number of sectors held in wbbuf[] */
+#endif
+#if _FS_REENTRANT && _FS_FILELOCK && !_FS_TINY
+	_FSYNC_t	fsobj;		/* Sync object of the file (taken before the volume's) */
+#endif
 #if !_FS_TINY
 	BYTE	buf[_MAX_SS];	/* File private data read/write window */
 #endif
@@ -213,14 +316,21 @@ typedef enum {
 FRESULT f_open (FIL* fp, const TCHAR* path, BYTE mode);				/* Open or create a file */
 FRESULT f_close (FIL* fp);											/* Close an open file object */
 FRESULT f_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from a file */
+FRESULT f_readnb (FIL* fp, void* buff, UINT btr, UINT* br, BYTE nowait);	/* f_read(), failing with FR_TIMEOUT instead of waiting for a lock */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to a file */
+FRESULT f_writenb (FIL* fp, const void* buff, UINT btw, UINT* bw, BYTE nowait);	/* f_write(), failing with FR_TIMEOUT instead of waiting for a lock */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_lseek (FIL* fp, DWORD ofs);								/* Move file pointer of a file object */
+FRESULT f_lseeknb (FIL* fp, DWORD ofs, BYTE nowait);				/* f_lseek(), failing with FR_TIMEOUT instead of waiting for a lock */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
+FRESULT f_expand (FIL* fp, DWORD fsz, BYTE opt);					/* Allocate a contiguous block to the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
+FRESULT f_flush (FIL* fp);											/* Write the write-behind buffer of a file */
 FRESULT f_opendir (FDIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (FDIR* dp);										/* Close an open directory */
 FRESULT f_readdir (FDIR* dp, FILINFO* fno);							/* Read a directory item */
+FRESULT f_readdirn (FDIR* dp, FILINFO* fno, UINT n, UINT* nr);		/* Read directory items in one pass */
+FRESULT f_seekdir (FDIR* dp, UINT idx, DWORD clst);					/* Move to a directory item */
 FRESULT f_findfirst (FDIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (FDIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
@@ -233,6 +343,7 @@ FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT f_countfree (const TCHAR* path, UINT nsect, DWORD* nclst, DWORD* nleft);	/* Count free clusters a part at a time */
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
@@ -249,6 +360,7 @@ TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the fil
 #define f_size(fp) ((fp)->fsize)
 #define f_rewind(fp) f_lseek((fp), 0)
 #define f_rewinddir(dp) f_readdir((dp), 0)
+#define f_telldir(dp) ((dp)->index)
 
 #ifndef EOF
 #define EOF (-1)
@@ -269,18 +381,41 @@ DWORD get_fattime ();
 #if _USE_LFN							/* Unicode - OEM code conversion */
 WCHAR ff_convert (WCHAR chr, UINT dir);	/* OEM-Unicode bidirectional conversion */
 WCHAR ff_wtoupper (WCHAR chr);			/* Unicode upper-case conversion */
+#endif
 #if _USE_LFN == 3						/* Memory functions */
 void* ff_memalloc (UINT msize);			/* Allocate memory block */
 void ff_memfree (void* mblock);			/* Free memory block */
 #endif
-#endif
 
 /* Sync functions */
 #if _FS_REENTRANT
+#define FF_WAIT_BUCKETS	7
+
+/* Lock statistics of a volume */
+typedef struct {
+	DWORD	wait[FF_WAIT_BUCKETS];	/* Grants by wait: none, <100us, <1ms, <10ms, <100ms, <1s, longer */
+	DWORD	timeout;		/* Requests not granted (timed out or non-blocking) */
+	DWORD	hold_max;		/* Longest time a grant was held (us) */
+	DWORD	hold_task;		/* Thread that held it */
+} FFLOCKSTAT;
+
 int ff_cre_syncobj (BYTE vol, _SYNC_t* sobj);	/* Create a sync object */
-int ff_req_grant (_SYNC_t sobj);				/* Lock sync object */
+int ff_req_grant (_SYNC_t sobj, BYTE nowait);	/* Lock sync object */
 void ff_rel_grant (_SYNC_t sobj);				/* Unlock sync object */
 int ff_del_syncobj (_SYNC_t sobj);				/* Delete a sync object */
+void ff_set_timeout (_SYNC_t sobj, UINT ms);	/* Set the longest wait for a grant */
+void ff_get_lockstat (_SYNC_t sobj, FFLOCKSTAT* st, BYTE clear);	/* Get lock statistics */
+#if _FS_SHARED
+int ff_req_grant_shared (_SYNC_t sobj, BYTE nowait);	/* Lock sync object for reading */
+void ff_req_cache (_SYNC_t sobj);				/* Lock the shared buffers */
+void ff_rel_cache (_SYNC_t sobj);				/* Unlock the shared buffers */
+#endif
+#if _FS_FILELOCK
+int ff_cre_filesync (_FSYNC_t* fobj);			/* Create a file sync object */
+int ff_req_file (_FSYNC_t* fobj, _SYNC_t sobj, BYTE nowait);	/* Lock file sync object */
+void ff_rel_file (_FSYNC_t* fobj);				/* Unlock file sync object */
+void ff_del_filesync (_FSYNC_t* fobj);			/* Delete a file sync object */
+#endif
 #endif
 
 
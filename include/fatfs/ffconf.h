@@ -22,6 +22,123 @@
 /  the file system object (FATFS) instead of private sector buffer eliminated
 /  from the file object (FIL). */
 
+/* The caches and tables below live in memory supplied with each volume
+/  (fatfs_state_t). Their defaults keep that memory to about 2.5 KB per volume with
+/  512-byte sectors; a board sets larger sizes on the compiler command line. */
+
+#if !defined _FS_WINCACHE
+#define _FS_WINCACHE	2	/* 0:Disable or 1-16:Number of cached sectors */
+#endif
+/* When _FS_WINCACHE is set to 1 or greater, FAT and directory sectors evicted
+/  from the disk access window (FATFS.win[]) are kept in an LRU sector cache and
+/  written back only when they are evicted from the cache or the volume is synced.
+/  The cache arena of _FS_WINCACHE * _MAX_SS bytes is supplied by the caller in
+/  FATFS.wcbuf before the volume is mounted. A null arena disables the cache. */
+
+#if !defined _FS_FATCACHE
+#define _FS_FATCACHE	1	/* 0:Disable or 1-16:Number of cached FAT sectors */
+#endif
+/* When _FS_FATCACHE is set to 1 or greater, FAT entries are accessed through a
+/  dedicated write-back FAT sector cache instead of the disk access window, so
+/  FAT and directory traffic do not evict each other. Dirty FAT sectors are
+/  written to all FAT copies when they are evicted or the volume is synced.
+/  The arena of _FS_FATCACHE * _MAX_SS bytes is supplied by the caller in
+/  FATFS.fcbuf. A null arena routes FAT access through the window. */
+
+#define _FS_FATMIRROR	32	/* 0:Disable or >0:Number of FAT sectors tracked for the copies */
+/* When _FS_FATMIRROR is set to non-zero, a FAT sector written to the first FAT
+/  is only recorded in a set of up to _FS_FATMIRROR sectors and the other FAT
+/  copies are brought up to date when the volume is synced: the recorded sectors
+/  are sorted, read back from the first FAT in runs and each run is written to
+/  every copy with one disk_write() (runs of up to _FS_BOUNCE sectors through
+/  FATFS.bbuf, otherwise one sector at a time through the window). A full set is
+/  written out the same way, or the copies of the new sector are written at once
+/  when there is no staging arena.
+/  Setting FATFS.fmmode to 1 before mounting makes a single FAT active: the
+/  copies are never written. A FAT32 volume is then marked as such in its boot
+/  sector (BPB_ExtFlags) on the first sync, and a volume so marked gets its FAT
+/  copied in full and the mark cleared on the first sync with FATFS.fmmode 0.
+/  FAT12/16 have no such mark and keep stale copies. */
+
+#if !defined _FS_BOUNCE
+#define _FS_BOUNCE	0	/* 0:Disable or >0:Sectors in the aligned staging buffer */
+#endif
+/* f_read() and f_write() hand the caller's buffer to disk_read()/disk_write()
+/  only when it is word aligned (DMA requirement of the drivers). When _FS_BOUNCE
+/  is set to 1 or greater, data for other buffers is staged in multi-sector
+/  chunks through an aligned arena of _FS_BOUNCE * _MAX_SS bytes supplied by the
+/  caller in FATFS.bbuf. A null arena (or 0) stages one sector at a time. */
+
+#define _FS_READAHEAD	1	/* 0:Disable or 1:Enable */
+/* When _FS_READAHEAD is set to 1, a file object can be given a read-ahead
+/  buffer (FIL.rabuf of FIL.rasize sectors). Reads of partial sectors then fetch
+/  up to FIL.rasize sectors in one disk_read() and later partial reads are
+/  served from memory. The buffer is emptied by f_write() and f_truncate().
+/  Not available with _FS_TINY. */
+
+#define _FS_WRITEBEHIND	1	/* 0:Disable or 1:Enable */
+/* When _FS_WRITEBEHIND is set to 1, a file object can be given a write-behind
+/  buffer (FIL.wbbuf of FIL.wbsize sectors). Dirty file sectors written back
+/  one after another are then collected and written in one disk_write() when the
+/  buffer is full, the run of consecutive sectors breaks, or on f_flush(),
+/  f_sync(), f_read(), f_lseek() and f_truncate(). Not available with _FS_TINY. */
+
+#if !defined _FS_FREEMAP
+#define _FS_FREEMAP	0	/* 0:Disable or >0:Size of the free cluster bitmap arena in bytes */
+#endif
+/* When _FS_FREEMAP is set to non-zero, a bitmap with one bit per cluster is
+/  kept up to date by put_fat(), so that finding a free cluster scans 32
+/  clusters per word instead of reading FAT entries one by one. The arena of
+/  _FS_FREEMAP bytes (a multiple of 4) is supplied by the caller in FATFS.fmbuf
+/  before the volume is mounted. The bitmap is filled in by f_countfree() and
+/  by each cluster allocation (a few FAT sectors at a time), never with the
+/  whole FAT scanned at once; the FAT scan is used until it is complete. It
+/  needs (number of clusters + 2) / 8 bytes: 16384 bytes cover 131070 clusters
+/  (a 4 GB volume with 32 KB clusters), 131072 bytes about 1M clusters (32 GB).
+/  A volume with more clusters than the arena covers, or a null arena, always
+/  uses the FAT scan. */
+
+#define _FS_FREECOUNT	8	/* 0:Disable or >0:Number of FAT sectors counted per step */
+/* When _FS_FREECOUNT is set to non-zero, an unknown free cluster count (FAT12/16
+/  or FAT32 without a valid FSINFO; a valid FSINFO count is trusted as it is) is
+/  counted with f_countfree() _FS_FREECOUNT FAT sectors per call, so that the
+/  volume is unlocked between the steps and a background task can do the count
+/  while other requests are served. Clusters allocated or freed in the part
+/  already counted are accounted for by put_fat(). f_getfree() also counts in
+/  steps instead of scanning the whole FAT with the volume locked. */
+
+#if !defined _FS_DCACHE
+#define _FS_DCACHE	8	/* 0:Disable or >0:Number of directory entry cache slots */
+#endif
+#define _FS_DCNAME	32	/* Longest name (in characters) held by the directory entry cache */
+/* When _FS_DCACHE is set to non-zero, the result of each name lookup in a
+/  directory is kept in a hash table of _FS_DCACHE slots keyed by the start
+/  cluster of the directory and the up-cased name. A repeated lookup then goes
+/  straight to the entry instead of scanning the directory from the top, and
+/  cached sub-directories in the middle of a path are entered without any disk
+/  access. A name that was not found is remembered too, until any entry is
+/  added to that directory, so repeated probes for a missing file cost no disk
+/  access. Names longer than _FS_DCNAME characters are not cached. The table
+/  (FATFS.dcache) is supplied by the caller before the volume is mounted. A
+/  null table disables the cache. */
+
+#if !defined _FS_DIRINDEX
+#define _FS_DIRINDEX	0	/* 0:Disable or >0:Number of directories indexed at a time */
+#endif
+#if !defined _FS_DIRIXMAX
+#define _FS_DIRIXMAX	16384	/* Size of the arena of each directory index in bytes */
+#endif
+/* When _FS_DIRINDEX is set to non-zero, a directory found to hold 128 or more
+/  entries is indexed with one sequential scan: a hash table of its names and a
+/  bitmap of its free entries. Name lookups then read only the entries of the
+/  matching names, and new entries are allocated from the first block of free
+/  entries without scanning the directory. The arena of _FS_DIRINDEX *
+/  _FS_DIRIXMAX bytes (_FS_DIRIXMAX a multiple of 4) is supplied by the caller
+/  in FATFS.dixbuf before the volume is mounted. The index costs about 5 bytes
+/  per directory entry, so 16384 bytes index a directory of about 2800 entries;
+/  a larger directory, or a null arena, is searched without an index. The
+/  least recently used index is discarded for a new one. */
+
 #define _FS_READONLY 0 /* 0:Read/Write or 1:Read only */
 /* Setting _FS_READONLY to 1 defines read only configuration. This removes
 /  writing functions, f_write(), f_sync(), f_unlink(), f_mkdir(), f_chmod(),
@@ -46,8 +163,14 @@
 #define _USE_MKFS 1 /* 0:Disable or 1:Enable */
 /* To enable f_mkfs() function, set _USE_MKFS to 1 and set _FS_READONLY to 0 */
 
-#define _USE_FASTSEEK 0 /* 0:Disable or 1:Enable */
-/* To enable fast seek feature, set _USE_FASTSEEK to 1. */
+#define _USE_FASTSEEK 1 /* 0:Disable or 1:Enable */
+/* To enable fast seek feature, set _USE_FASTSEEK to 1. The fatfs glue builds
+/  the cluster link map table of each open file on demand (see fatfs_file_t). */
+
+#define _USE_EXPAND 1 /* 0:Disable or 1:Enable */
+/* To enable f_expand() function, set _USE_EXPAND to 1 and set _FS_READONLY to 0.
+/  f_expand() reserves a contiguous cluster block for an empty file so that it
+/  can be written with multi-sector transfers and no further FAT updates. */
 
 #define _USE_LABEL 0
 /* This option switches volume label functions, f_getlabel() and f_setlabel().
@@ -155,14 +278,21 @@ Unicode API is not enabled. */
 */
 
 
+#if !defined _MIN_SS
 #define	_MIN_SS		512
+#endif
+#if !defined _MAX_SS
 #define _MAX_SS 512
+#endif
 
 /* These options configure the sector size to be supported. (512, 1024, 2048 or 4096)
 /  Always set both 512 for most systems, all memory card and hard disk. But a larger
 /  value may be required for on-board flash memory and some type of optical media.
 /  When _MIN_SS != _MAX_SS, FatFs is configured to multiple sector size and
-/  GET_SECTOR_SIZE command must be implemented to the disk_ioctl() function. */
+/  GET_SECTOR_SIZE command must be implemented to the disk_ioctl() function.
+/  Both can be overridden from the build (e.g. -D_MAX_SS=4096 for NAND/eMMC pages);
+/  the glue reports the drive's write_block_size as the sector size and every
+/  FIL buffer and cache entry grows to _MAX_SS bytes. */
 
 
 #define	_USE_TRIM	0
@@ -215,8 +345,17 @@ Unicode API is not enabled. */
 
 #include <pthread.h>
 #define _FS_REENTRANT	1		/* 0:Disable or 1:Enable */
-#define _FS_TIMEOUT		1000	/* Timeout period in unit of time ticks */
-#define	_SYNC_t			pthread_mutex_t*	/* O/S dependent sync object type. e.g. HANDLE, OS_EVENT*, ID and etc.. */
+#define _FS_TIMEOUT		5000	/* Timeout period in unit of milliseconds */
+#define	_SYNC_t			struct ff_sync*	/* O/S dependent sync object type. e.g. HANDLE, OS_EVENT*, ID and etc.. */
+#define _FS_SHARED		1		/* 0:Disable or 1:Enable */
+#define _FS_FILELOCK	1		/* 0:Disable or 1:Enable */
+#define	_FSYNC_t		struct ff_filesync	/* O/S dependent sync object type held in each FIL */
+struct ff_filesync {			/* (syscall.c) */
+	pthread_mutex_t mutex;
+	struct ff_sync* sobj;		/* Volume it was last locked on */
+	struct ff_filesync* next;	/* Next file lock held on that volume */
+	int pid;					/* Process of the holder */
+};
 /*#include <windows.h>*/
 
 /* A header file that defines sync object types on the O/S, such as windows.h,
@@ -227,6 +366,22 @@ Unicode API is not enabled. */
 /   1: Enable re-entrancy. Also user provided synchronization handlers,
 /      ff_req_grant(), ff_rel_grant(), ff_del_syncobj() and ff_cre_syncobj()
 /      function must be added to the project.
+/
+/  _FS_TIMEOUT is how long a lock request waits before the function fails
+/  with FR_TIMEOUT, unless ff_set_timeout() sets another period for the volume.
+/
+/  When _FS_SHARED is 1, f_read() asks for the volume with ff_req_grant_shared()
+/  so reads of different files run in parallel, and takes ff_req_cache() and
+/  ff_rel_cache() around the FAT cache and the bounce buffer it shares with the
+/  other readers. Every other function keeps the volume exclusive. It has no
+/  effect at _FS_TINY = 1, where file data goes through the volume's window.
+/
+/  When _FS_FILELOCK is 1, each open file has its own sync object of type
+/  _FSYNC_t (ff_cre_filesync(), ff_req_file(), ff_rel_file() and
+/  ff_del_filesync()). File functions lock the file before the volume, and
+/  f_read() and f_write() release the volume while file data moves between
+/  the buffer and the disk, so the volume lock only covers FAT and directory
+/  work. It has no effect at _FS_TINY = 1.
 */
 
 #define _WORD_ACCESS	0	/* 0 or 1 */
@@ -11,6 +11,7 @@
 
 #include "diskio.h" /* FatFs lower layer API */
 #include <sos/debug.h>
+#include <string.h>
 //#include "usbdisk.h"	/* Example: USB drive control */
 //#include "atadrive.h"	/* Example: ATA drive control */
 //#include "sdcard.h"		/* Example: MMC/SDC contorl */
@@ -51,6 +52,112 @@ DSTATUS disk_status(BYTE pdrv /* Physical drive nmuber (0..) */
   return STA_NOINIT;
 }
 
+/*-----------------------------------------------------------------------*/
+/* Merge Adjacent Writes                                                 */
+/*-----------------------------------------------------------------------*/
+
+#if FATFS_MERGE_SIZE
+// A write that continues the pending run, or the last write sent to the
+// device, and fits in the merge buffer is copied there instead of going to the
+// device, so runs of small adjacent writes (a new directory cluster being
+// zeroed, FAT sectors, file sectors written back one by one) reach the device
+// as one transfer with one busy wait. A write that follows nothing is not held
+// back. The run is written before any other write, a read of one of its
+// sectors, CTRL_SYNC and sector erases.
+//
+// A run the device does not take is kept and tried again by the next flush.
+// The failure is reported by the next CTRL_SYNC even if that retry succeeds,
+// so the writes that were acknowledged from the buffer are accounted for.
+
+// merge->mutex is held
+static DRESULT merge_flush(BYTE pdrv, fatfs_merge_t *merge) {
+  if (merge->count == 0) {
+    return RES_OK;
+  }
+
+  const int nbyte = merge->count * fatfs_dev_sector_size(pdrv);
+  const int ret = fatfs_dev_write(pdrv, merge->sector, merge->buffer, nbyte);
+  if (ret == nbyte) {
+    merge->count = 0;
+    return RES_OK;
+  }
+
+  sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Failed to write disk");
+  merge->is_failed = 1;
+  return RES_ERROR;
+}
+
+// is_report: 1 for CTRL_SYNC, which also reports an earlier failure
+static DRESULT merge_sync(BYTE pdrv, int is_report) {
+  fatfs_merge_t *merge = fatfs_dev_merge(pdrv);
+  pthread_mutex_lock(&merge->mutex);
+  DRESULT result = merge_flush(pdrv, merge);
+  if (is_report && merge->is_failed) {
+    result = RES_ERROR;
+    // reported once the data has reached the device
+    merge->is_failed = merge->count != 0;
+  }
+  pthread_mutex_unlock(&merge->mutex);
+  return result;
+}
+
+// returns 1 when the write was taken (or failed) and result is set, 0 when it
+// goes to the device as it is
+static int merge_write(
+  BYTE pdrv,
+  const BYTE *buff,
+  DWORD sector,
+  UINT count,
+  DRESULT *result) {
+  fatfs_merge_t *merge = fatfs_dev_merge(pdrv);
+  const UINT sector_size = fatfs_dev_sector_size(pdrv);
+  int is_taken = 0;
+
+  pthread_mutex_lock(&merge->mutex);
+  fatfs_stats_t *stats = fatfs_dev_stats(pdrv);
+  stats->write_count++;
+  stats->write_sectors += count;
+  *result = RES_OK;
+  if (
+    merge->count
+    && ((sector != merge->sector + merge->count)
+        || ((merge->count + count) * sector_size > FATFS_MERGE_SIZE))) {
+    // keep the device order: the run goes out before this write
+    if (
+      (merge_flush(pdrv, merge) != RES_OK)
+      && (sector < merge->sector + merge->count)
+      && (merge->sector < sector + count)) {
+      // the kept run would overwrite this write when it is retried
+      *result = RES_ERROR;
+    }
+  }
+
+  // a write that fills the buffer on its own is not copied
+  const int is_adjacent = merge->count ? (sector == merge->sector + merge->count)
+                                       : (sector == merge->next_sector);
+  if (
+    (*result == RES_OK) && is_adjacent
+    && ((merge->count + count) * sector_size < FATFS_MERGE_SIZE
+        || (merge->count && (merge->count + count) * sector_size == FATFS_MERGE_SIZE))) {
+    if (merge->count == 0) {
+      merge->sector = sector;
+    } else {
+      stats->merged_writes++;
+    }
+    memcpy(merge->buffer + merge->count * sector_size, buff, count * sector_size);
+    merge->count += count;
+    is_taken = 1;
+    if (merge->count * sector_size == FATFS_MERGE_SIZE) {
+      // full: nothing more can join (a failure is reported by CTRL_SYNC)
+      merge_flush(pdrv, merge);
+    }
+  }
+  merge->next_sector = sector + count;
+  pthread_mutex_unlock(&merge->mutex);
+  return is_taken || (*result != RES_OK);
+}
+#endif
+
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
@@ -62,8 +169,33 @@ DRESULT disk_read(
   UINT count    /* Number of sectors to read (1..128) */
 ) {
   int ret;
-  ret = fatfs_dev_read(pdrv, sector, buff, count * 512);
-  if (ret == count * 512) {
+  fatfs_stats_t *stats = fatfs_dev_stats(pdrv);
+#if FATFS_MERGE_SIZE
+  // counted under the mutex the request takes anyway
+  fatfs_merge_t *merge = fatfs_dev_merge(pdrv);
+  pthread_mutex_lock(&merge->mutex);
+  stats->read_count++;
+  stats->read_sectors += count;
+  if (
+    merge->count && (sector < merge->sector + merge->count)
+    && (merge->sector < sector + count)) {
+    // the read needs the pending run on the device first
+    if (merge_flush(pdrv, merge) != RES_OK) {
+      pthread_mutex_unlock(&merge->mutex);
+      return RES_ERROR;
+    }
+  }
+  pthread_mutex_unlock(&merge->mutex);
+#else
+  pthread_mutex_t *mutex = fatfs_dev_mutex(pdrv);
+  pthread_mutex_lock(mutex);
+  stats->read_count++;
+  stats->read_sectors += count;
+  pthread_mutex_unlock(mutex);
+#endif
+  const int nbyte = count * fatfs_dev_sector_size(pdrv);
+  ret = fatfs_dev_read(pdrv, sector, buff, nbyte);
+  if (ret == nbyte) {
     return RES_OK;
   }
 
@@ -83,8 +215,23 @@ DRESULT disk_write(
   UINT count        /* Number of sectors to write (1..128) */
 ) {
   int ret;
-  ret = fatfs_dev_write(pdrv, sector, buff, count * 512);
-  if (ret == count * 512) {
+#if FATFS_MERGE_SIZE
+  // merge_write() counts the request
+  DRESULT result;
+  if (merge_write(pdrv, buff, sector, count, &result)) {
+    return result;
+  }
+#else
+  fatfs_stats_t *stats = fatfs_dev_stats(pdrv);
+  pthread_mutex_t *mutex = fatfs_dev_mutex(pdrv);
+  pthread_mutex_lock(mutex);
+  stats->write_count++;
+  stats->write_sectors += count;
+  pthread_mutex_unlock(mutex);
+#endif
+  const int nbyte = count * fatfs_dev_sector_size(pdrv);
+  ret = fatfs_dev_write(pdrv, sector, buff, nbyte);
+  if (ret == nbyte) {
     return RES_OK;
   }
 
@@ -111,6 +258,11 @@ DRESULT disk_ioctl(
 
   switch (cmd) {
   case CTRL_SYNC:
+#if FATFS_MERGE_SIZE
+    if (merge_sync(pdrv, 1) != RES_OK) {
+      return RES_ERROR;
+    }
+#endif
     // wait while the disk is busy
     fatfs_dev_waitbusy(pdrv);
 
@@ -124,6 +276,15 @@ DRESULT disk_ioctl(
 
     dp[0] = info.num_write_blocks;
 
+    return RES_OK;
+
+  case GET_SECTOR_SIZE: // one drive write block per sector
+    if (fatfs_dev_getinfo(pdrv, &info) < 0) {
+      return RES_ERROR;
+    }
+
+    *(WORD *)buff = info.write_block_size;
+
     return RES_OK;
   case GET_BLOCK_SIZE: // eraseable block size
 
@@ -138,6 +299,11 @@ DRESULT disk_ioctl(
     dp = buff;
     st = dp[0];
     end = dp[1];
+#if FATFS_MERGE_SIZE
+    if (merge_sync(pdrv, 0) != RES_OK) {
+      return RES_ERROR;
+    }
+#endif
     // erase sectors st to end
     fatfs_dev_eraseblocks(pdrv, st, end);
     return RES_OK;
@@ -1,14 +1,20 @@
 // Copyright 2011-2016 Tyler Gilbert; All Rights Reserved
 
+#include <aio.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sos/debug.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "diskio.h"
 #include "fatfs.h"
 #include "fatfs_dev.h"
 #include "ff.h"
@@ -60,11 +66,7 @@ static int decode_result(FRESULT r) {
 }
 
 extern int ff_force_unlock(int volume);
-
-void fatfs_unlock(const void *cfg) { // force unlock when a process exits
-  const fatfs_config_t *fcfg = (const fatfs_config_t *)cfg;
-  ff_force_unlock(fcfg->vol_id);
-}
+extern u32 scheduler_timing_get_realtime();
 
 static u8 flags_to_fat(int flags) {
   uint8_t f_mode = 0;
@@ -115,6 +117,300 @@ static int mode_to_posix(uint8_t f_mode) {
   return mode;
 }
 
+#if _MAX_SS == _MIN_SS
+#define FILE_SECTOR_SIZE(f) _MAX_SS
+#else
+#define FILE_SECTOR_SIZE(f) ((f)->fs->ssize)
+#endif
+
+#if _USE_FASTSEEK
+static DWORD file_clusters(const FIL *f) {
+  const DWORD cluster_size = (DWORD)f->fs->csize * FILE_SECTOR_SIZE(f);
+  return (f->fsize + cluster_size - 1) / cluster_size;
+}
+
+static void release_link_map(fatfs_file_t *h) {
+  h->file.cltbl = NULL;
+  free(h->link_map);
+  h->link_map = NULL;
+  h->link_map_size = 0;
+}
+
+// attaches the cluster link map to the file so f_lseek() costs O(fragments)
+// instead of following the FAT from the start cluster. The map is rebuilt
+// when the file has grown by a cluster since it was built.
+static void update_link_map(fatfs_file_t *h, BYTE nowait) {
+  FIL *f = &h->file;
+  const DWORD clusters = file_clusters(f);
+  FRESULT result;
+
+  if (clusters == h->link_map_clusters) {
+    // current (or known to be too large)
+    f->cltbl = h->link_map;
+    return;
+  }
+
+  f->cltbl = NULL;
+  h->link_map_clusters = clusters;
+  if (clusters == 0) {
+    return;
+  }
+
+  u16 size
+    = h->link_map_size ? h->link_map_size : FATFS_LINK_MAP_INITIAL_SIZE;
+  for (;;) {
+    if (size > h->link_map_size) {
+      DWORD *map = realloc(h->link_map, size * sizeof(DWORD));
+      if (map == NULL) {
+        release_link_map(h);
+        return;
+      }
+      h->link_map = map;
+      h->link_map_size = size;
+    }
+
+    h->link_map[0] = h->link_map_size;
+    f->cltbl = h->link_map;
+    result = f_lseeknb(f, CREATE_LINKMAP, nowait);
+    if (result == FR_OK) {
+      return;
+    }
+    if (result == FR_TIMEOUT) {
+      // the file or the volume is held; a later call builds the map
+      f->cltbl = NULL;
+      h->link_map_clusters = 0;
+      return;
+    }
+
+    // on FR_NOT_ENOUGH_CORE, link_map[0] holds the number of items required
+    if (
+      result != FR_NOT_ENOUGH_CORE
+      || h->link_map[0] > FATFS_LINK_MAP_MAX_SIZE) {
+      release_link_map(h);
+      return;
+    }
+    size = h->link_map[0];
+  }
+}
+#endif
+
+#if _FS_READAHEAD
+static void release_read_ahead(fatfs_file_t *h) {
+  h->file.rabuf = NULL;
+  h->file.rasize = h->file.racnt = 0;
+  free(h->read_ahead);
+  h->read_ahead = NULL;
+  h->read_ahead_size = 0;
+}
+
+// attaches a read-ahead buffer of at least one sector to the file
+static int set_read_ahead(fatfs_file_t *h, u32 size) {
+  FIL *f = &h->file;
+  const u32 sector_size = FILE_SECTOR_SIZE(f);
+
+  if (size < sector_size) {
+    size = sector_size;
+  }
+  size -= size % sector_size;
+
+  if (size > h->read_ahead_size) {
+    // malloc() memory is word aligned as disk_read() requires
+    BYTE *buffer = realloc(h->read_ahead, size);
+    if (buffer == NULL) {
+      release_read_ahead(h);
+      return -1;
+    }
+    h->read_ahead = buffer;
+    h->read_ahead_size = size;
+  }
+
+  f->rabuf = h->read_ahead;
+  f->rasize = size / sector_size;
+  f->racnt = 0;
+  return 0;
+}
+
+// turns read-ahead on after FATFS_READ_AHEAD_TRIGGER back-to-back reads and
+// off again (keeping the buffer) when the file is read out of order
+static void update_read_ahead(fatfs_file_t *h, int loc) {
+  if (h->is_read_ahead_fixed) {
+    return;
+  }
+
+  if ((u32)loc != h->next_loc) {
+    h->sequential_count = 0;
+    h->file.rasize = 0;
+    return;
+  }
+
+  if (h->sequential_count < FATFS_READ_AHEAD_TRIGGER) {
+    h->sequential_count++;
+    if (h->sequential_count == FATFS_READ_AHEAD_TRIGGER) {
+      set_read_ahead(h, FATFS_READ_AHEAD_SIZE);
+    }
+  }
+}
+#endif
+
+#if _FS_WRITEBEHIND
+// buffered sectors are written before the buffer changes; a buffer that cannot
+// be written is kept so nothing is lost and the next fsync or close fails
+static int release_write_behind(fatfs_file_t *h) {
+  FRESULT result = h->file.wbcnt ? f_flush(&h->file) : FR_OK;
+  if (result != FR_OK) {
+    h->is_write_behind_failed = 1;
+    return SYSFS_SET_RETURN(decode_result(result));
+  }
+  h->file.wbbuf = NULL;
+  h->file.wbsize = h->file.wbcnt = 0;
+  free(h->write_behind);
+  h->write_behind = NULL;
+  h->write_behind_size = 0;
+  return 0;
+}
+
+// a flush that failed without a caller to tell (the worker's, or one dropping
+// the buffer) is reported once the buffered sectors have reached the device
+static int report_write_behind(fatfs_file_t *h) {
+  if (h->is_write_behind_failed == 0) {
+    return 0;
+  }
+  h->is_write_behind_failed = h->file.wbcnt != 0;
+  return SYSFS_SET_RETURN(EIO);
+}
+
+static int set_write_behind(fatfs_file_t *h, u32 size) {
+  FIL *f = &h->file;
+  const u32 sector_size = FILE_SECTOR_SIZE(f);
+  FRESULT result;
+
+  if (size < 2 * sector_size) {
+    // a single sector would only add a copy
+    size = 2 * sector_size;
+  }
+  size -= size % sector_size;
+
+  if (f->wbcnt && (result = f_flush(f)) != FR_OK) {
+    return SYSFS_SET_RETURN(decode_result(result));
+  }
+
+  if (size > h->write_behind_size) {
+    // malloc() memory is word aligned as disk_write() requires
+    BYTE *buffer = realloc(h->write_behind, size);
+    if (buffer == NULL) {
+      release_write_behind(h);
+      return SYSFS_SET_RETURN(ENOMEM);
+    }
+    h->write_behind = buffer;
+    h->write_behind_size = size;
+  }
+
+  f->wbbuf = h->write_behind;
+  f->wbsize = size / sector_size;
+  return 0;
+}
+
+// turns write-behind on after FATFS_WRITE_BEHIND_TRIGGER back-to-back writes
+static void update_write_behind(fatfs_file_t *h, int loc) {
+  if (h->is_write_behind_fixed || h->file.wbsize) {
+    return;
+  }
+
+  if ((u32)loc != h->next_write_loc) {
+    h->sequential_writes = 0;
+    return;
+  }
+
+  if (++h->sequential_writes == FATFS_WRITE_BEHIND_TRIGGER) {
+    set_write_behind(h, FATFS_WRITE_BEHIND_SIZE);
+  }
+}
+
+// worker->mutex is held for the aged_list functions
+static void list_write_behind(fatfs_worker_state_t *state, fatfs_file_t *h) {
+  for (fatfs_file_t *item = state->aged_list; item; item = item->next_aged) {
+    if (item == h) {
+      return;
+    }
+  }
+  h->next_aged = state->aged_list;
+  state->aged_list = h;
+}
+
+static void unlist_write_behind(fatfs_worker_state_t *state, fatfs_file_t *h) {
+  for (fatfs_file_t **item = &state->aged_list; *item;
+       item = &(*item)->next_aged) {
+    if (*item == h) {
+      *item = h->next_aged;
+      return;
+    }
+  }
+}
+
+// takes a listed file whose buffer has waited FATFS_WRITE_BEHIND_MAX_AGE_MS;
+// wait_us is set to when the next one is due (0: none is listed)
+static fatfs_file_t *take_aged_file(
+  fatfs_worker_state_t *state,
+  u32 *wait_us) {
+  const u32 now = scheduler_timing_get_realtime();
+  const u32 max_age = FATFS_WRITE_BEHIND_MAX_AGE_MS * 1000UL;
+
+  *wait_us = 0;
+  for (fatfs_file_t **item = &state->aged_list; *item;) {
+    fatfs_file_t *h = *item;
+    const u32 age = now - h->write_behind_time;
+    if (h->file.wbcnt == 0 || h->write_behind_time == 0) {
+      // written in the meantime
+      *item = h->next_aged;
+    } else if (age >= max_age) {
+      *item = h->next_aged;
+      return h;
+    } else {
+      if (*wait_us == 0 || max_age - age < *wait_us) {
+        *wait_us = max_age - age;
+      }
+      item = &h->next_aged;
+    }
+  }
+  return NULL;
+}
+
+// writes buffered sectors that have waited FATFS_WRITE_BEHIND_MAX_AGE_MS; the
+// worker thread does it for a file that is no longer written
+static int age_write_behind(
+  const void *cfg,
+  fatfs_file_t *h,
+  UINT count_before) {
+  FIL *f = &h->file;
+  const u32 now = scheduler_timing_get_realtime();
+
+  if (f->wbcnt == 0) {
+    h->write_behind_time = 0;
+    return 0;
+  }
+
+  if (count_before == 0 || f->wbcnt < count_before) {
+    // the buffer was empty or has been written and refilled
+    h->write_behind_time = now;
+    fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+    pthread_mutex_lock(&state->mutex);
+    list_write_behind(state, h);
+    pthread_cond_signal(&state->request_cond);
+    pthread_mutex_unlock(&state->mutex);
+    return 0;
+  }
+
+  if (now - h->write_behind_time >= FATFS_WRITE_BEHIND_MAX_AGE_MS * 1000UL) {
+    FRESULT result = f_flush(f);
+    h->write_behind_time = 0;
+    if (result != FR_OK) {
+      return SYSFS_SET_RETURN(decode_result(result));
+    }
+  }
+  return 0;
+}
+#endif
+
 static void build_ff_drive(const void *cfg, char drive[3]) {
   const fatfs_config_t *fcfg = (const fatfs_config_t *)cfg;
   drive[0] = '0' + fcfg->vol_id;
@@ -134,6 +430,269 @@ static void build_ff_path(const void *cfg, char *p, const char *path) {
   }
 }
 
+#if _FS_FREECOUNT && !_FS_READONLY
+static void *free_count_worker(void *args) {
+  const void *cfg = args;
+  FRESULT result;
+  DWORD free_clusters;
+  DWORD left;
+  char p[3];
+
+  build_ff_drive(cfg, p);
+  do {
+    // the volume is unlocked between steps so other requests get through
+    result = f_countfree(p, _FS_FREECOUNT, &free_clusters, &left);
+    sched_yield();
+  } while (result == FR_OK && left
+           && FATFS_STATE(cfg)->is_free_count_stopping == 0);
+
+  FATFS_STATE(cfg)->is_free_count_running = 0;
+  return NULL;
+}
+
+// the volume's sync object is deleted by the unmount, so the count must not be
+// in the middle of a step; returns -1 if the step does not end in
+// FATFS_FREE_COUNT_STOP_TIMEOUT_MS
+static int stop_free_count(const void *cfg) {
+  fatfs_state_t *state = FATFS_STATE(cfg);
+  u32 waited_ms = 0;
+  state->is_free_count_stopping = 1;
+  while (state->is_free_count_running) {
+    if (waited_ms++ == FATFS_FREE_COUNT_STOP_TIMEOUT_MS) {
+      // the count goes on with the volume still mounted
+      state->is_free_count_stopping = 0;
+      sos_debug_log_warning(SOS_DEBUG_FILESYSTEM, "free count did not stop");
+      return -1;
+    }
+    // the worker runs at the lowest priority; sleep rather than yield
+    usleep(1000);
+  }
+  state->is_free_count_stopping = 0;
+  return 0;
+}
+
+// the thread is gone once its process exits, in any state
+static void cancel_free_count(const void *cfg, int pid) {
+  fatfs_state_t *state = FATFS_STATE(cfg);
+  if (state->is_free_count_running && state->free_count_pid == pid) {
+    state->is_free_count_running = 0;
+  }
+}
+
+// counts the free clusters at low priority when the volume does not record a
+// valid count (FAT12/16 or FAT32 without FSINFO)
+static void start_free_count(const void *cfg) {
+  fatfs_state_t *state = FATFS_STATE(cfg);
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct sched_param param;
+  size_t stack_size = FATFS_FREE_COUNT_STACK_SIZE;
+
+  if (
+    state->fs.free_clust <= state->fs.n_fatent - 2
+    || state->is_free_count_running) {
+    return;
+  }
+
+#if defined PTHREAD_STACK_MIN
+  if (stack_size < PTHREAD_STACK_MIN) {
+    stack_size = PTHREAD_STACK_MIN;
+  }
+#endif
+
+  if (pthread_attr_init(&attr) != 0) {
+    return;
+  }
+  pthread_attr_setstacksize(&attr, stack_size);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  param.sched_priority = sched_get_priority_min(SCHED_OTHER);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+  state->is_free_count_running = 1;
+  state->free_count_pid = getpid();
+  if (pthread_create(&thread, &attr, free_count_worker, (void *)cfg) != 0) {
+    // f_getfree() still counts in steps
+    state->is_free_count_running = 0;
+  }
+  pthread_attr_destroy(&attr);
+}
+#endif
+
+#if _FS_REENTRANT
+static void set_lock_timeout(const void *cfg) {
+  const u32 timeout = FATFS_CONFIG(cfg)->lock_timeout_microseconds;
+  ff_set_timeout(FATFS_STATE(cfg)->fs.sobj, (timeout + 999) / 1000);
+}
+#endif
+
+#if _FS_WRITEBEHIND
+// waits for a listed file, or until the next listed file is due (wait_us)
+static void wait_worker_request(fatfs_worker_state_t *state, u32 wait_us) {
+  struct timespec abs_time;
+
+  if (wait_us == 0) {
+    pthread_cond_wait(&state->request_cond, &state->mutex);
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &abs_time);
+  abs_time.tv_sec += wait_us / 1000000UL;
+  abs_time.tv_nsec += (wait_us % 1000000UL) * 1000L;
+  if (abs_time.tv_nsec >= 1000000000L) {
+    abs_time.tv_sec++;
+    abs_time.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(&state->request_cond, &state->mutex, &abs_time);
+}
+
+// only writes buffers out; nothing on this path allocates or frees the
+// per-file buffers, which belong to the heap of the process that opened the
+// file
+static void *write_behind_worker(void *args) {
+  const void *cfg = args;
+  fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+
+  pthread_mutex_lock(&state->mutex);
+  for (;;) {
+    fatfs_file_t *aged = NULL;
+    while (state->is_stopping == 0) {
+      u32 wait_us;
+      aged = take_aged_file(state, &wait_us);
+      if (aged) {
+        break;
+      }
+      wait_worker_request(state, wait_us);
+    }
+    if (state->is_stopping) {
+      break;
+    }
+
+    // fatfs_close() waits for this before the file goes away
+    state->active_file = aged;
+    pthread_mutex_unlock(&state->mutex);
+    const FRESULT result = f_flush(&aged->file);
+    pthread_mutex_lock(&state->mutex);
+    if (result == FR_OK) {
+      aged->write_behind_time = 0;
+    } else {
+      // try again after another FATFS_WRITE_BEHIND_MAX_AGE_MS
+      aged->is_write_behind_failed = 1;
+      aged->write_behind_time = scheduler_timing_get_realtime();
+      list_write_behind(state, aged);
+    }
+    state->active_file = NULL;
+    pthread_cond_broadcast(&state->complete_cond);
+  }
+
+  // stop_worker() waits for this
+  state->is_running = 0;
+  pthread_cond_broadcast(&state->complete_cond);
+  pthread_mutex_unlock(&state->mutex);
+  return NULL;
+}
+
+// the worker is started with the mount rather than by the first file so it
+// does not belong to (and exit with) the application that wrote it
+static void start_worker(const void *cfg) {
+  fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+  pthread_attr_t attr;
+  pthread_t thread;
+  size_t stack_size = FATFS_WORKER_STACK_SIZE;
+
+  if (state->is_running) {
+    return;
+  }
+
+#if defined PTHREAD_STACK_MIN
+  if (stack_size < PTHREAD_STACK_MIN) {
+    stack_size = PTHREAD_STACK_MIN;
+  }
+#endif
+
+  if (pthread_attr_init(&attr) != 0) {
+    return;
+  }
+  pthread_attr_setstacksize(&attr, stack_size);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_mutex_lock(&state->mutex);
+  state->is_running = 1;
+  if (pthread_create(&thread, &attr, write_behind_worker, (void *)cfg) != 0) {
+    // buffers are still written by fatfs_write(), fsync and close
+    sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "failed to start fatfs worker");
+    state->is_running = 0;
+  }
+  pthread_mutex_unlock(&state->mutex);
+  pthread_attr_destroy(&attr);
+}
+
+// waits for the worker to finish the active flush and exit
+static void stop_worker(const void *cfg) {
+  fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+
+  pthread_mutex_lock(&state->mutex);
+  if (state->is_running == 0) {
+    pthread_mutex_unlock(&state->mutex);
+    return;
+  }
+  state->is_stopping = 1;
+  // the files cannot be written once the volume is gone
+  state->aged_list = NULL;
+  pthread_cond_signal(&state->request_cond);
+  while (state->is_running) {
+    pthread_cond_wait(&state->complete_cond, &state->mutex);
+  }
+  state->is_stopping = 0;
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// blocks until the worker is done with the file and will not pick it up again
+static void wait_worker_idle(const void *cfg, fatfs_file_t *h) {
+  fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+  if (state->is_initialized == 0) {
+    return;
+  }
+  pthread_mutex_lock(&state->mutex);
+  unlist_write_behind(state, h);
+  while (state->active_file == h) {
+    pthread_cond_wait(&state->complete_cond, &state->mutex);
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// drops the process's files from the worker's list and waits until the worker
+// is done with them (their buffers go away with the process)
+static void cancel_write_behind(const void *cfg, int pid) {
+  fatfs_worker_state_t *state = &FATFS_STATE(cfg)->worker;
+  if (state->is_initialized == 0) {
+    return;
+  }
+  pthread_mutex_lock(&state->mutex);
+  for (fatfs_file_t **item = &state->aged_list; *item;) {
+    if ((*item)->pid == pid) {
+      *item = (*item)->next_aged;
+    } else {
+      item = &(*item)->next_aged;
+    }
+  }
+  while (state->active_file != NULL && state->active_file->pid == pid) {
+    pthread_cond_wait(&state->complete_cond, &state->mutex);
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+#endif
+
+void fatfs_unlock(const void *cfg) { // force unlock when a process exits
+  const fatfs_config_t *fcfg = (const fatfs_config_t *)cfg;
+  // first, so the worker can finish writing a file of the process
+  ff_force_unlock(fcfg->vol_id);
+#if _FS_WRITEBEHIND
+  cancel_write_behind(cfg, getpid());
+#endif
+#if _FS_FREECOUNT && !_FS_READONLY
+  cancel_free_count(cfg, getpid());
+#endif
+}
+
 int fatfs_mount(const void *cfg) {
   FRESULT result;
   char p[3];
@@ -153,9 +712,57 @@ int fatfs_mount(const void *cfg) {
   // tell the device driver which volume ID is associated with which cfg
   fatfs_dev_cfg_volume(cfg);
 
+#if _FS_WINCACHE
+  FATFS_STATE(cfg)->fs.wcbuf = FATFS_STATE(cfg)->win_cache;
+#endif
+#if _FS_FATCACHE
+  FATFS_STATE(cfg)->fs.fcbuf = FATFS_STATE(cfg)->fat_cache;
+#endif
+#if _FS_BOUNCE
+  FATFS_STATE(cfg)->fs.bbuf = FATFS_STATE(cfg)->bounce_buffer;
+#endif
+#if _FS_DCACHE
+  FATFS_STATE(cfg)->fs.dcache = FATFS_STATE(cfg)->dentry_cache;
+#endif
+#if _FS_FREEMAP
+  FATFS_STATE(cfg)->fs.fmbuf = FATFS_STATE(cfg)->free_map;
+#endif
+#if _FS_DIRINDEX
+  FATFS_STATE(cfg)->fs.dixbuf = FATFS_STATE(cfg)->dir_index;
+#endif
+#if _FS_FATMIRROR && !_FS_READONLY
+  FATFS_STATE(cfg)->fs.fmmode = FATFS_CONFIG(cfg)->is_single_fat ? 1 : 0;
+#endif
+
+#if _FS_WRITEBEHIND
+  fatfs_worker_state_t *worker = &FATFS_STATE(cfg)->worker;
+  if (worker->is_initialized == 0) {
+    // kept across unmount/mount because the worker may be waiting on them;
+    // shared because any process writing or closing a file uses them
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, 1);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, 1);
+    pthread_mutex_init(&worker->mutex, &mutex_attr);
+    pthread_cond_init(&worker->request_cond, &cond_attr);
+    pthread_cond_init(&worker->complete_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    worker->is_initialized = 1;
+  }
+#endif
+
   build_ff_drive(cfg, p);
   // mount this volume
   result = f_mount(&FATFS_STATE(cfg)->fs, p, 1);
+#if _FS_REENTRANT
+  if (FATFS_STATE(cfg)->fs.sobj) {
+    // f_mount() creates the sync object with _FS_TIMEOUT
+    set_lock_timeout(cfg);
+  }
+#endif
   if (result != FR_OK) {
     sos_debug_log_error(
       SOS_DEBUG_FILESYSTEM,
@@ -165,6 +772,15 @@ int fatfs_mount(const void *cfg) {
     return SYSFS_SET_RETURN(decode_result(result));
   }
 
+#if _FS_FREECOUNT && !_FS_READONLY
+  // a valid FSINFO count is used as is; otherwise count without holding up
+  // the mount or the first free space query
+  start_free_count(cfg);
+#endif
+#if _FS_WRITEBEHIND
+  start_worker(cfg);
+#endif
+
   return 0;
 }
 
@@ -183,14 +799,39 @@ int fatfs_unmount(const void *cfg) {
     return 0; // not mounted
   }
 
+#if _FS_FREECOUNT && !_FS_READONLY
+  // first, so a count that does not stop leaves the volume as it was
+  if (stop_free_count(cfg) < 0) {
+    return SYSFS_SET_RETURN(EBUSY);
+  }
+#endif
+#if _FS_WRITEBEHIND
+  // no buffer may be written once the volume is gone
+  stop_worker(cfg);
+#endif
+
+#if FATFS_MERGE_SIZE
+  // writes not followed by a sync may still wait in the merge buffer; a run
+  // the device did not take stays there for the drive's next flush
+  const DRESULT sync_result = disk_ioctl(FATFS_STATE(cfg)->fs.drv, CTRL_SYNC, 0);
+#endif
+
   // unmount this volume
   build_ff_drive(cfg, p);
   result = f_mount(&FATFS_STATE(cfg)->fs, p, 0);
   if (result != FR_OK) {
     return SYSFS_SET_RETURN(decode_result(result));
   }
+#if _FS_REENTRANT
+  set_lock_timeout(cfg);
+#endif
   FATFS_STATE(cfg)->fs.fs_type = 0;
 
+#if FATFS_MERGE_SIZE
+  if (sync_result != RES_OK) {
+    return SYSFS_SET_RETURN(EIO);
+  }
+#endif
   return 0;
 }
 
@@ -246,17 +887,18 @@ int fatfs_rename(const void *cfg, const char *path_old, const char *path_new) {
 }
 
 int fatfs_opendir(const void *cfg, void **handle, const char *path) {
-  FDIR *h;
+  fatfs_dir_t *h;
   FRESULT result;
   char p[PATH_MAX + 1];
   build_ff_path(cfg, p, path);
 
-  h = malloc(sizeof(FDIR));
+  h = malloc(sizeof(fatfs_dir_t));
   if (h == 0) {
     return SYSFS_SET_RETURN(ENOMEM);
   }
+  *h = (fatfs_dir_t){};
 
-  result = f_opendir(h, p);
+  result = f_opendir(&h->dir, p);
 
   if (result != FR_OK) {
     free(h);
@@ -292,6 +934,93 @@ int fatfs_chmod(const void *cfg, const char *path, int mode) {
   return 0;
 }
 
+// remembers where h->loc starts when it begins a mark interval
+static void record_dir_mark(fatfs_dir_t *h) {
+  if (
+    h->loc == 0 || h->loc % FATFS_DIR_MARK_INTERVAL || h->dir.sect == 0
+    || h->loc / FATFS_DIR_MARK_INTERVAL - 1 != h->mark_count) {
+    return;
+  }
+
+  if (h->mark_count == h->mark_size) {
+    // without room later seeks skip forward from the last mark
+    fatfs_dir_mark_t *marks = realloc(
+      h->marks,
+      (h->mark_size + FATFS_DIR_MARK_INTERVAL) * sizeof(fatfs_dir_mark_t));
+    if (marks == NULL) {
+      return;
+    }
+    h->marks = marks;
+    h->mark_size += FATFS_DIR_MARK_INTERVAL;
+  }
+  h->marks[h->mark_count].cluster = h->dir.clust;
+  h->marks[h->mark_count].index = f_telldir(&h->dir);
+  h->mark_count++;
+}
+
+// reads up to count entries (NULL info: skips them) without crossing a mark
+static FRESULT read_dir(fatfs_dir_t *h, FILINFO *info, UINT count, UINT *nr) {
+  const UINT to_mark
+    = FATFS_DIR_MARK_INTERVAL - h->loc % FATFS_DIR_MARK_INTERVAL;
+  FRESULT result
+    = f_readdirn(&h->dir, info, count < to_mark ? count : to_mark, nr);
+  h->loc += *nr;
+  record_dir_mark(h);
+  return result;
+}
+
+// positions the handle so that the next read returns entry loc
+static FRESULT seek_dir(fatfs_dir_t *h, int loc) {
+  FRESULT result;
+  UINT count;
+  u32 mark;
+
+  if (loc < 0) {
+    return FR_INVALID_PARAMETER;
+  }
+
+  if (loc == 0) {
+    // rewinding drops the marks so entries added since opening are seen
+    h->mark_count = 0;
+  } else if (h->dir.sect == 0 && h->loc <= loc) {
+    // already at the end of the directory
+    return FR_OK;
+  }
+
+  mark = loc / FATFS_DIR_MARK_INTERVAL;
+  if (mark > h->mark_count) {
+    mark = h->mark_count;
+  }
+
+  if (
+    loc == 0 || h->dir.sect == 0 || h->loc > loc
+    || h->loc < (int)(mark * FATFS_DIR_MARK_INTERVAL)) {
+    // start over from the nearest mark unless reading on gets there sooner
+    if (mark) {
+      result = f_seekdir(
+        &h->dir,
+        h->marks[mark - 1].index,
+        h->marks[mark - 1].cluster);
+    } else {
+      result = f_seekdir(&h->dir, 0, 0);
+    }
+    if (result != FR_OK) {
+      return result;
+    }
+    h->loc = mark * FATFS_DIR_MARK_INTERVAL;
+  }
+
+  while (h->loc < loc) {
+    result = read_dir(h, NULL, loc - h->loc, &count);
+    if (result != FR_OK || count == 0) {
+      // loc is past the end: the next read returns nothing
+      return result;
+    }
+  }
+
+  return FR_OK;
+}
+
 int fatfs_readdir_r(
   const void *cfg,
   void *handle,
@@ -300,46 +1029,84 @@ int fatfs_readdir_r(
   MCU_UNUSED_ARGUMENT(cfg);
   FRESULT result;
   FILINFO file_info;
-  FDIR *dp = handle;
-  char lfn[NAME_MAX + 1];
+  fatfs_dir_t *h = handle;
+  UINT count;
 
-  memset(lfn, 0, NAME_MAX);
-  file_info.lfname = lfn;
-  file_info.lfsize = NAME_MAX;
+  // the long name goes straight to the entry
+  file_info.lfname = entry->d_name;
+  file_info.lfsize = sizeof(entry->d_name);
 
-  if (loc == 0) {
-    // rewind the directory
-    f_readdir(handle, 0);
+  result = seek_dir(h, loc);
+  if (result == FR_OK) {
+    result = read_dir(h, &file_info, 1, &count);
   }
 
-  result = f_readdir(handle, &file_info);
-
   if (result != FR_OK) {
     return SYSFS_SET_RETURN(decode_result(result));
   }
 
-  if (file_info.fattrib & 0x08) { // this is the system Drive name
-    result = f_readdir(handle, &file_info);
-    if (result != FR_OK) {
-      return SYSFS_SET_RETURN(decode_result(result));
-    }
+  if (count == 0) {
+    // no more files
+    return -1; // EOF
   }
 
   entry->d_ino = file_info.fattrib;
-  if (lfn[0] != 0) {
-    strncpy(entry->d_name, lfn, NAME_MAX - 1); // only gets the short file name
-  } else {
-    strncpy(entry->d_name, file_info.fname, 13); // only gets the short file
-                                                 // name
+  if (entry->d_name[0] == 0) {
+    // no long name: use the short file name
+    strncpy(entry->d_name, file_info.fname, 13);
   }
 
-  if (dp->sect == 0) {
-    // no more files
-    return -1; // EOF
+  return 0;
+}
+
+int fatfs_readdir_batch(
+  const void *cfg,
+  void *handle,
+  int loc,
+  fatfs_dirent_t *entries,
+  int count) {
+  MCU_UNUSED_ARGUMENT(cfg);
+  FRESULT result;
+  FILINFO file_info[FATFS_DIR_MARK_INTERVAL];
+  fatfs_dir_t *h = handle;
+  UINT read_count;
+  int total = 0;
+
+  result = seek_dir(h, loc);
+
+  // each f_readdirn() call fills entries up to the next mark in one pass
+  while (result == FR_OK && total < count) {
+    for (int i = 0; i < FATFS_DIR_MARK_INTERVAL && total + i < count; i++) {
+      file_info[i].lfname = entries[total + i].name;
+      file_info[i].lfsize = sizeof(entries[total + i].name);
+    }
+
+    result = read_dir(h, file_info, count - total, &read_count);
+
+    for (UINT i = 0; i < read_count; i++) {
+      fatfs_dirent_t *entry = entries + total + i;
+      entry->size = file_info[i].fsize;
+      entry->date = file_info[i].fdate;
+      entry->time = file_info[i].ftime;
+      entry->attributes = file_info[i].fattrib;
+      if (entry->name[0] == 0) {
+        strncpy(entry->name, file_info[i].fname, 13);
+      }
+    }
+    total += read_count;
+
+    if (read_count == 0) {
+      break;
+    }
   }
 
-  return 0;
+  if (result != FR_OK) {
+    return SYSFS_SET_RETURN(decode_result(result));
+  }
+
+  return total;
 }
+
 int fatfs_closedir(const void *cfg, void **handle) {
   MCU_UNUSED_ARGUMENT(cfg);
   FRESULT result;
@@ -347,7 +1114,8 @@ int fatfs_closedir(const void *cfg, void **handle) {
 
   if (*handle != NULL) {
 
-    result = f_closedir(*handle);
+    fatfs_dir_t *h = *handle;
+    result = f_closedir(&h->dir);
 
     if (result != FR_OK) {
       return SYSFS_SET_RETURN(decode_result(result));
@@ -355,7 +1123,8 @@ int fatfs_closedir(const void *cfg, void **handle) {
       ret = 0;
     }
 
-    free(*handle);
+    free(h->marks);
+    free(h);
   }
   *handle = NULL;
 
@@ -369,6 +1138,11 @@ int fatfs_fstat(const void *cfg, void *handle, struct stat *stat) {
 
   *stat = (struct stat){};
 
+  if (((fatfs_file_t *)h)->dir) {
+    stat->st_mode = S_IFDIR;
+    return 0;
+  }
+
   stat->st_mode = S_IFREG;
   stat->st_size = h->fsize;
   return 0;
@@ -385,15 +1159,72 @@ int fatfs_open(
   char p[PATH_MAX + 1];
   build_ff_path(cfg, p, path);
 
-  FIL *h = malloc(sizeof(FIL));
+  fatfs_file_t *h = malloc(sizeof(fatfs_file_t));
   if (h == NULL) {
     sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Open ENOMEM");
     return SYSFS_SET_RETURN(ENOMEM);
   }
+  h->dir = NULL;
+
+  if (flags & O_DIRECTORY) {
+    // the handle only serves I_FATFS_READDIR_BATCH; FatFs calls on the zeroed
+    // file fail as for a closed file
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+      free(h);
+      return SYSFS_SET_RETURN(EISDIR);
+    }
+    h->file = (FIL){};
+    int result = fatfs_opendir(cfg, (void **)&h->dir, path);
+    if (result < 0) {
+      free(h);
+      return result;
+    }
+    *handle = h;
+    return 0;
+  }
+#if _USE_FASTSEEK
+  h->link_map = NULL;
+  h->link_map_clusters = 0;
+  h->link_map_size = 0;
+#endif
+#if _FS_READAHEAD
+  h->read_ahead = NULL;
+  h->read_ahead_size = 0;
+  h->next_loc = 0;
+  h->sequential_count = 0;
+  h->is_read_ahead_fixed = 0;
+#endif
+#if _FS_WRITEBEHIND
+  h->write_behind = NULL;
+  h->write_behind_size = 0;
+  h->write_behind_time = 0;
+  h->next_write_loc = 0;
+  h->sequential_writes = 0;
+  h->is_write_behind_fixed = 0;
+  h->is_write_behind_failed = 0;
+  h->next_aged = NULL;
+  h->pid = getpid();
+#endif
 
   int f_mode = flags_to_fat(flags);
 
-  FRESULT result = f_open(h, p, f_mode);
+#if _FS_REENTRANT
+  // f_open() takes the volume again (the grant nests) without waiting
+  _SYNC_t sobj = FATFS_STATE(cfg)->fs.sobj;
+  const int is_nonblock = (flags & O_NONBLOCK) && sobj;
+  if (is_nonblock && ff_req_grant(sobj, 1) == 0) {
+    free(h);
+    return SYSFS_SET_RETURN(EAGAIN);
+  }
+#endif
+
+  FRESULT result = f_open(&h->file, p, f_mode);
+
+#if _FS_REENTRANT
+  if (is_nonblock) {
+    ff_rel_grant(sobj);
+  }
+#endif
 
   if (result != FR_OK) {
     free(h);
@@ -405,87 +1236,404 @@ int fatfs_open(
   return 0;
 }
 
-int fatfs_read(
-  const void *cfg,
+// nowait: fail with EAGAIN instead of waiting for the file or the volume
+static int read_file(
   void *handle,
-  int flags,
   int loc,
   void *buf,
-  int nbyte) {
-  MCU_UNUSED_ARGUMENT(cfg);
-  MCU_UNUSED_ARGUMENT(flags);
+  int nbyte,
+  BYTE nowait) {
   FRESULT result;
   UINT bytes;
   FIL *f = handle;
 
   // need to see to loc first
   if (loc != f->fptr) {
-    result = f_lseek(handle, loc);
+#if _USE_FASTSEEK
+    update_link_map(handle, nowait);
+#endif
+    result = f_lseeknb(handle, loc, nowait);
     if (result != FR_OK) {
       sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Read Seek Result:%d", result);
       return SYSFS_SET_RETURN(decode_result(result));
     }
   }
 
-  result = f_read(handle, buf, nbyte, &bytes);
+#if _FS_READAHEAD
+  update_read_ahead(handle, loc);
+#endif
+
+  result = f_readnb(handle, buf, nbyte, &bytes, nowait);
 
   if (result != FR_OK) {
     sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Read Result:%d", result);
     return SYSFS_SET_RETURN(decode_result(result));
   }
 
+#if _FS_READAHEAD
+  ((fatfs_file_t *)handle)->next_loc = loc + bytes;
+#endif
+
   return bytes;
 }
 
-int fatfs_write(
+int fatfs_read(
   const void *cfg,
   void *handle,
   int flags,
   int loc,
-  const void *buf,
+  void *buf,
   int nbyte) {
+  MCU_UNUSED_ARGUMENT(cfg);
+  if (((fatfs_file_t *)handle)->dir) {
+    return SYSFS_SET_RETURN(EISDIR);
+  }
+  // the flag is passed down rather than kept on the file, which other threads
+  // and fsync, close or aio on the same handle use at the same time
+  return read_file(handle, loc, buf, nbyte, (flags & O_NONBLOCK) != 0);
+}
+
+static int write_file(
+  const void *cfg,
+  void *handle,
+  int loc,
+  const void *buf,
+  int nbyte,
+  BYTE nowait) {
   FRESULT result;
   UINT bytes;
   FIL *f = handle;
 
+#if _USE_FASTSEEK
+  if ((DWORD)loc + nbyte > f->fsize) {
+    // fast seek mode cannot grow the file; the map is rebuilt on a later seek
+    f->cltbl = NULL;
+  } else if (loc != f->fptr) {
+    update_link_map(handle, nowait);
+  }
+#endif
+
   if (loc != f->fptr) {
     sos_debug_log_info(SOS_DEBUG_FILESYSTEM, "Loc: %ld Ptr: %ld", loc, f->fptr);
-    result = f_lseek(handle, loc);
+    result = f_lseeknb(handle, loc, nowait);
     if (result != FR_OK) {
       sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Write Seek Result:%d", result);
       return SYSFS_SET_RETURN(decode_result(result));
     }
   }
 
-  result = f_write(handle, buf, nbyte, &bytes);
+#if _FS_WRITEBEHIND
+  fatfs_file_t *h = handle;
+  update_write_behind(h, loc);
+  const UINT buffered = f->wbcnt;
+#endif
+
+  result = f_writenb(handle, buf, nbyte, &bytes, nowait);
 
   if (result != FR_OK) {
     sos_debug_log_error(SOS_DEBUG_FILESYSTEM, "Write Result:%d", result);
     return SYSFS_SET_RETURN(decode_result(result));
   }
 
+#if _FS_WRITEBEHIND
+  h->next_write_loc = loc + bytes;
+  if (nowait) {
+    // the data is accepted; a flush for age could only wait or fail with
+    // EAGAIN, so it is left to a later call
+    return bytes;
+  }
+  int age_result = age_write_behind(cfg, h, buffered);
+  if (age_result < 0) {
+    return age_result;
+  }
+#endif
+
   return bytes;
 }
 
+int fatfs_write(
+  const void *cfg,
+  void *handle,
+  int flags,
+  int loc,
+  const void *buf,
+  int nbyte) {
+  if (((fatfs_file_t *)handle)->dir) {
+    return SYSFS_SET_RETURN(EISDIR);
+  }
+  // as fatfs_read(): no-wait applies to this call only
+  return write_file(cfg, handle, loc, buf, nbyte, (flags & O_NONBLOCK) != 0);
+}
+
 int fatfs_fsync(const void *cfg, void *handle) {
   FRESULT result;
   FIL *f = handle;
 
+  if (((fatfs_file_t *)handle)->dir) {
+    // nothing is buffered for a directory
+    return 0;
+  }
+
   result = f_sync(f);
 
   if (result != FR_OK) {
     return SYSFS_SET_RETURN(decode_result(result));
   }
 
+#if _FS_WRITEBEHIND
+  return report_write_behind((fatfs_file_t *)handle);
+#else
   return 0;
+#endif
+}
+
+int fatfs_ioctl(const void *cfg, void *handle, int request, void *ctl) {
+  FRESULT result;
+
+  switch (request) {
+#if _USE_EXPAND && !_FS_READONLY
+  case I_FATFS_EXPAND: {
+    FIL *f = handle;
+    const fatfs_expand_t *expand = ctl;
+    if (expand == NULL || expand->size == 0) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    if (!(f->flag & FA_WRITE)) {
+      return SYSFS_SET_RETURN(EBADF);
+    }
+    if (f->fsize != 0) {
+      // only an empty file can get a contiguous block
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+
+    result = f_expand(
+      f,
+      expand->size,
+      (expand->o_flags & FATFS_EXPAND_FLAG_ALLOCATE) ? 1 : 0);
+    if (result == FR_DENIED) {
+      // no free block is large enough
+      return SYSFS_SET_RETURN(ENOSPC);
+    }
+    if (result != FR_OK) {
+      return SYSFS_SET_RETURN(decode_result(result));
+    }
+    return 0;
+  }
+#endif
+
+#if _FS_READAHEAD
+  case I_FATFS_READAHEAD: {
+    const fatfs_read_ahead_t *read_ahead = ctl;
+    fatfs_file_t *h = handle;
+    if (read_ahead == NULL || h == NULL) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    if (h->dir) {
+      return SYSFS_SET_RETURN(EISDIR);
+    }
+    if (read_ahead->o_flags & FATFS_READ_AHEAD_FLAG_AUTO) {
+      h->is_read_ahead_fixed = 0;
+      h->sequential_count = 0;
+      h->file.rasize = 0;
+      return 0;
+    }
+    h->is_read_ahead_fixed = 1;
+    if (read_ahead->size == 0) {
+      release_read_ahead(h);
+      return 0;
+    }
+    if (set_read_ahead(h, read_ahead->size) < 0) {
+      return SYSFS_SET_RETURN(ENOMEM);
+    }
+    return 0;
+  }
+#endif
+
+#if _FS_WRITEBEHIND
+  case I_FATFS_WRITEBEHIND: {
+    const fatfs_write_behind_t *write_behind = ctl;
+    fatfs_file_t *h = handle;
+    if (write_behind == NULL || h == NULL) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    if (!(h->file.flag & FA_WRITE)) {
+      return SYSFS_SET_RETURN(EBADF);
+    }
+    if (write_behind->o_flags & FATFS_WRITE_BEHIND_FLAG_AUTO) {
+      h->is_write_behind_fixed = 0;
+      h->sequential_writes = 0;
+      return 0;
+    }
+    h->is_write_behind_fixed = 1;
+    if (write_behind->size == 0) {
+      return release_write_behind(h);
+    }
+    return set_write_behind(h, write_behind->size);
+  }
+#endif
+
+  case I_FATFS_READDIR_BATCH: {
+    fatfs_readdir_batch_t *batch = ctl;
+    const fatfs_file_t *h = handle;
+    if (batch == NULL || batch->entries == NULL || batch->count < 0) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    if (h == NULL || h->dir == NULL) {
+      // the file was not opened with O_DIRECTORY
+      return SYSFS_SET_RETURN(ENOTDIR);
+    }
+    return fatfs_readdir_batch(
+      cfg,
+      h->dir,
+      batch->loc,
+      batch->entries,
+      batch->count);
+  }
+
+#if !_FS_READONLY
+  case I_FATFS_GETFREE: {
+    fatfs_free_t *info = ctl;
+    FATFS *fs;
+    DWORD free_clusters;
+    char p[3];
+    if (info == NULL) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    build_ff_drive(cfg, p);
+    info->o_flags = 0;
+#if _FS_FREECOUNT && !_FS_READONLY
+    DWORD left = 0;
+    if (FATFS_STATE(cfg)->is_free_count_running) {
+      // report the progress instead of waiting for the count
+      result = f_countfree(p, 0, &free_clusters, &left);
+      if (result != FR_OK) {
+        return SYSFS_SET_RETURN(decode_result(result));
+      }
+    }
+    if (left) {
+      info->o_flags |= FATFS_FREE_FLAG_COUNTING;
+    } else
+#endif
+    {
+      result = f_getfree(p, &free_clusters, &fs);
+      if (result != FR_OK) {
+        return SYSFS_SET_RETURN(decode_result(result));
+      }
+    }
+    info->free_clusters = free_clusters;
+    info->total_clusters = FATFS_STATE(cfg)->fs.n_fatent - 2;
+    info->cluster_size = FATFS_STATE(cfg)->fs.csize
+                         * fatfs_dev_sector_size(FATFS_CONFIG(cfg)->vol_id);
+    return 0;
+  }
+#endif
+
+  case I_FATFS_GETSTATS: {
+    fatfs_stats_t *stats = ctl;
+    const FATFS *fs = &FATFS_STATE(cfg)->fs;
+    if (stats == NULL) {
+      return SYSFS_SET_RETURN(EINVAL);
+    }
+    *stats = FATFS_STATE(cfg)->stats;
+    stats->window_hits = fs->n_winhit;
+    stats->window_misses = fs->n_winmiss;
+    stats->fat_hits = fs->n_fathit;
+    stats->fat_misses = fs->n_fatmiss;
+#if _FS_REENTRANT
+    stats->lock_waits = fs->n_lockwait;
+    if (fs->sobj) {
+      FFLOCKSTAT lock;
+      ff_get_lockstat(fs->sobj, &lock, 0);
+      for (int i = 0; i < FATFS_LOCK_WAIT_BUCKETS && i < FF_WAIT_BUCKETS; i++) {
+        stats->lock_wait_histogram[i] = lock.wait[i];
+      }
+      stats->lock_timeouts = lock.timeout;
+      stats->lock_hold_max_microseconds = lock.hold_max;
+      stats->lock_hold_max_thread = lock.hold_task;
+    }
+#endif
+#if _FS_DCACHE
+    stats->dentry_hits = fs->n_dchit;
+    stats->dentry_misses = fs->n_dcmiss;
+#endif
+    return 0;
+  }
+
+  case I_FATFS_RESETSTATS: {
+    FATFS *fs = &FATFS_STATE(cfg)->fs;
+    FATFS_STATE(cfg)->stats = (fatfs_stats_t){};
+    fs->n_winhit = fs->n_winmiss = 0;
+    fs->n_fathit = fs->n_fatmiss = 0;
+#if _FS_REENTRANT
+    fs->n_lockwait = 0;
+    if (fs->sobj) {
+      ff_get_lockstat(fs->sobj, NULL, 1);
+    }
+#endif
+#if _FS_DCACHE
+    fs->n_dchit = fs->n_dcmiss = 0;
+#endif
+    return 0;
+  }
+  }
+
+  return SYSFS_SET_RETURN(EINVAL);
+}
+
+// completes the request before it returns, the way a driver does with a
+// transfer it finishes inside the call: the return value and async.nbyte hold
+// the byte count or the negative errno and the handler is not called. The
+// transfer runs in the requesting thread, so the per-file buffers it may
+// (re)allocate stay in the heap of the process that owns the file.
+int fatfs_aio(const void *cfg, void *handle, struct aiocb *aio) {
+  int result;
+
+  if (((fatfs_file_t *)handle)->dir) {
+    result = SYSFS_SET_RETURN(EISDIR);
+  } else if (aio->aio_lio_opcode == LIO_READ) {
+    result = fatfs_read(
+      cfg,
+      handle,
+      0,
+      aio->aio_offset,
+      (void *)aio->aio_buf,
+      aio->aio_nbytes);
+  } else if (aio->aio_lio_opcode == LIO_WRITE) {
+    result = fatfs_write(
+      cfg,
+      handle,
+      0,
+      aio->aio_offset,
+      (const void *)aio->aio_buf,
+      aio->aio_nbytes);
+  } else {
+    result = SYSFS_SET_RETURN(EINVAL);
+  }
+
+  aio->async.nbyte = result;
+  return result;
 }
 
 int fatfs_close(const void *cfg, void **handle) {
-  MCU_UNUSED_ARGUMENT(cfg);
   FRESULT result;
   FIL *h;
   h = *handle;
 
+  if (((fatfs_file_t *)h)->dir) {
+    int close_result = fatfs_closedir(cfg, (void **)&((fatfs_file_t *)h)->dir);
+    if (close_result < 0) {
+      return close_result;
+    }
+    *handle = 0;
+    free(h);
+    return 0;
+  }
+
+#if _FS_WRITEBEHIND
+  // the worker must be done with the file before it is freed
+  wait_worker_idle(cfg, (fatfs_file_t *)h);
+#endif
+
   result = f_close(h);
 
   if (result != FR_OK) {
@@ -494,8 +1642,22 @@ int fatfs_close(const void *cfg, void **handle) {
   }
   *handle = 0;
 
+#if _USE_FASTSEEK
+  release_link_map((fatfs_file_t *)h);
+#endif
+#if _FS_READAHEAD
+  release_read_ahead((fatfs_file_t *)h);
+#endif
+#if _FS_WRITEBEHIND
+  // f_close() has written the buffer
+  const int write_behind_result = report_write_behind((fatfs_file_t *)h);
+  free(((fatfs_file_t *)h)->write_behind);
+  free(h);
+  return write_behind_result;
+#else
   free(h);
   return 0;
+#endif
 }
 
 int fatfs_remove(const void *cfg, const char *path) {
@@ -32,6 +32,7 @@ DWORD get_fattime() { return time(0); }
 static const void *cfg_table[_VOLUMES];
 
 static int reinitalize_drive(BYTE pdrv);
+static int wait_busy(BYTE pdrv);
 
 /*
 static void set_delay_mutex(void * args){
@@ -51,6 +52,21 @@ int fatfs_dev_cfg_volume(const void *cfg) {
   return err;
 }
 
+fatfs_stats_t *fatfs_dev_stats(BYTE pdrv) {
+  return &FATFS_STATE(cfg_table[pdrv])->stats;
+}
+
+// the stats counters are updated with it held (or the merge mutex)
+pthread_mutex_t *fatfs_dev_mutex(BYTE pdrv) {
+  return &FATFS_STATE(cfg_table[pdrv])->device_mutex;
+}
+
+#if FATFS_MERGE_SIZE
+fatfs_merge_t *fatfs_dev_merge(BYTE pdrv) {
+  return &FATFS_STATE(cfg_table[pdrv])->merge;
+}
+#endif
+
 void fatfs_dev_setdelay_mutex(pthread_mutex_t *mutex) {
   // cortexm_svcall_t(set_delay_mutex, mutex);
 }
@@ -60,7 +76,7 @@ int reinitalize_drive(BYTE pdrv) {
   drive_attr_t attr;
   attr.o_flags = DRIVE_FLAG_RESET;
   sysfs_shared_ioctl(FATFS_DRIVE(cfg), I_DRIVE_SETATTR, &attr);
-  fatfs_dev_waitbusy(pdrv);
+  wait_busy(pdrv);
   return 0;
 }
 
@@ -74,6 +90,34 @@ int fatfs_dev_open(BYTE pdrv) {
     return 1;
   }
 
+  if (FATFS_STATE(cfg)->is_device_initialized == 0) {
+    // kept across unmount/mount like the drive handle; shared because any
+    // process reading or writing the volume takes it
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, 1);
+    pthread_mutex_init(&FATFS_STATE(cfg)->device_mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    FATFS_STATE(cfg)->is_device_initialized = 1;
+  }
+
+#if FATFS_MERGE_SIZE
+  fatfs_merge_t *merge = &FATFS_STATE(cfg)->merge;
+  if (merge->is_initialized == 0) {
+    // kept across unmount/mount like the drive handle; shared like the device
+    // mutex
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, 1);
+    pthread_mutex_init(&merge->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    merge->count = 0;
+    merge->next_sector = 0;
+    merge->is_failed = 0;
+    merge->is_initialized = 1;
+  }
+#endif
+
   if (FATFS_STATE(cfg)->drive.file.handle != 0) {
     // already initialized
     return SYSFS_RETURN_SUCCESS;
@@ -119,10 +163,13 @@ int fatfs_dev_write(BYTE pdrv, int loc, const void *buf, int nbyte) {
   const char *bufp = buf;
   int retries;
   const fatfs_config_t *cfgp = cfg_table[pdrv];
+  pthread_mutex_t *mutex = &FATFS_STATE(cfgp)->device_mutex;
 
+  pthread_mutex_lock(mutex);
   retries = 0;
   do {
-    if (fatfs_dev_waitbusy(pdrv) < 0) {
+    if (wait_busy(pdrv) < 0) {
+      pthread_mutex_unlock(mutex);
       return -1;
     }
 
@@ -140,6 +187,7 @@ int fatfs_dev_write(BYTE pdrv, int loc, const void *buf, int nbyte) {
   loc++;
 
   if (retries > 1) {
+    FATFS_STATE(cfgp)->stats.write_retries += retries - 1;
     sos_debug_log_warning(
       SOS_DEBUG_FILESYSTEM,
       "FATFS: Write retries: %d (%d, %d) 0x%X (%d)",
@@ -149,6 +197,7 @@ int fatfs_dev_write(BYTE pdrv, int loc, const void *buf, int nbyte) {
       ret,
       loc);
   }
+  pthread_mutex_unlock(mutex);
 
   if (retries == MAX_RETRIES) {
     return -1;
@@ -161,13 +210,16 @@ int fatfs_dev_read(BYTE pdrv, int loc, void *buf, int nbyte) {
   int ret;
   char *bufp = (char *)buf;
   const fatfs_config_t *cfgp = cfg_table[pdrv];
+  pthread_mutex_t *mutex = &FATFS_STATE(cfgp)->device_mutex;
   int retries;
 
+  pthread_mutex_lock(mutex);
   // set the location to the location of the blocks
   retries = 0;
   do {
 
-    if (fatfs_dev_waitbusy(pdrv) < 0) {
+    if (wait_busy(pdrv) < 0) {
+      pthread_mutex_unlock(mutex);
       return -1;
     }
 
@@ -180,7 +232,8 @@ int fatfs_dev_read(BYTE pdrv, int loc, void *buf, int nbyte) {
     if (ret != nbyte) {
       sos_debug_log_warning(SOS_DEBUG_FILESYSTEM, "FATFS: reinit drive");
       reinitalize_drive(pdrv);
-      if (fatfs_dev_waitbusy(pdrv) < 0) {
+      if (wait_busy(pdrv) < 0) {
+        pthread_mutex_unlock(mutex);
         return -1;
       }
     }
@@ -189,11 +242,13 @@ int fatfs_dev_read(BYTE pdrv, int loc, void *buf, int nbyte) {
   loc++;
 
   if (retries > 1) {
+    FATFS_STATE(cfgp)->stats.read_retries += retries - 1;
     sos_debug_log_warning(
       SOS_DEBUG_FILESYSTEM,
       "FATFS: Read retries: %d",
       retries);
   }
+  pthread_mutex_unlock(mutex);
 
   if (retries == MAX_RETRIES) {
     sos_debug_log_error(
@@ -221,15 +276,48 @@ int fatfs_dev_getinfo(BYTE pdrv, drive_info_t *info) {
   return 0;
 }
 
-int fatfs_dev_waitbusy(BYTE pdrv) {
+UINT fatfs_dev_sector_size(BYTE pdrv) {
+#if _MAX_SS == _MIN_SS
+  MCU_UNUSED_ARGUMENT(pdrv);
+  return _MAX_SS;
+#else
+  // find_volume() and f_mkfs() store GET_SECTOR_SIZE here before any transfer
+  return FATFS_STATE(cfg_table[pdrv])->fs.ssize;
+#endif
+}
+
+// lets the drive signal readiness instead of sleeping between polls
+static int wait_ready(const fatfs_config_t *cfgp) {
+  int result = sysfs_shared_ioctl(FATFS_DRIVE(cfgp), I_DRIVE_ISBUSY, 0);
+  if (result <= 0) {
+    // idle (or ISBUSY unsupported): no need to block
+    return 0;
+  }
+
+  FATFS_STATE(cfgp)->stats.busy_polls++;
+  if (cfgp->wait_ready(cfgp, cfgp->wait_ready_timeout_microseconds) < 0) {
+    FATFS_STATE(cfgp)->stats.busy_timeouts++;
+    sos_debug_log_warning(SOS_DEBUG_FILESYSTEM, "wait ready failed");
+    return -1;
+  }
+  return 0;
+}
+
+// the device mutex is held
+static int wait_busy(BYTE pdrv) {
   const fatfs_config_t *cfgp = cfg_table[pdrv];
   int result;
   int count = 0;
   int exponential_wait = cfgp->wait_busy_microseconds;
 
+  if (cfgp->wait_ready) {
+    return wait_ready(cfgp);
+  }
+
   while (
     (result = sysfs_shared_ioctl(FATFS_DRIVE(cfgp), I_DRIVE_ISBUSY, 0) > 0)
     && ((count < cfgp->wait_busy_timeout_count) || (cfgp->wait_busy_timeout_count == 0))) {
+    FATFS_STATE(cfgp)->stats.busy_polls++;
     if (exponential_wait) {
       usleep(exponential_wait);
     }
@@ -245,6 +333,7 @@ int fatfs_dev_waitbusy(BYTE pdrv) {
   }
 
   if (cfgp->wait_busy_timeout_count && count >= cfgp->wait_busy_timeout_count) {
+    FATFS_STATE(cfgp)->stats.busy_timeouts++;
     sos_debug_log_warning(SOS_DEBUG_FILESYSTEM, "wait timed out");
     return -1;
   }
@@ -257,6 +346,15 @@ int fatfs_dev_waitbusy(BYTE pdrv) {
   return 0;
 }
 
+// for a wait outside a transfer (CTRL_SYNC)
+int fatfs_dev_waitbusy(BYTE pdrv) {
+  pthread_mutex_t *mutex = fatfs_dev_mutex(pdrv);
+  pthread_mutex_lock(mutex);
+  const int result = wait_busy(pdrv);
+  pthread_mutex_unlock(mutex);
+  return result;
+}
+
 int fatfs_dev_eraseblocks(BYTE pdrv, int start, int end) {
   const fatfs_config_t *cfgp = cfg_table[pdrv];
   drive_attr_t attr;
@@ -266,8 +364,12 @@ int fatfs_dev_eraseblocks(BYTE pdrv, int start, int end) {
   attr.start = PARTITION_LOCATION(cfgp, start);
   attr.end = PARTITION_LOCATION(cfgp, end);
 
-  fatfs_dev_waitbusy(pdrv);
-  if (sysfs_shared_ioctl(FATFS_DRIVE(cfgp), I_DRIVE_SETATTR, &attr) < 0) {
+  pthread_mutex_lock(&FATFS_STATE(cfgp)->device_mutex);
+  wait_busy(pdrv);
+  const int result
+    = sysfs_shared_ioctl(FATFS_DRIVE(cfgp), I_DRIVE_SETATTR, &attr);
+  pthread_mutex_unlock(&FATFS_STATE(cfgp)->device_mutex);
+  if (result < 0) {
     sos_debug_log_error(
       SOS_DEBUG_FILESYSTEM,
       "Failed to erase block %d to %d",
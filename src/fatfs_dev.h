@@ -10,6 +10,7 @@
 #include <pthread.h>
 #include <sos/dev/drive.h>
 #include "integer.h"
+#include "fatfs.h"
 
 
 #define FATFS_CONFIG(cfg) ((fatfs_config_t*)cfg)
@@ -18,6 +19,11 @@
 #define FATFS_DRIVE_MUTEX(cfg) &(((fatfs_config_t*)cfg)->drive.state->mutex)
 
 int fatfs_dev_cfg_volume(const void * cfg);
+fatfs_stats_t * fatfs_dev_stats(BYTE pdrv);
+pthread_mutex_t * fatfs_dev_mutex(BYTE pdrv);
+#if FATFS_MERGE_SIZE
+fatfs_merge_t * fatfs_dev_merge(BYTE pdrv);
+#endif
 
 int fatfs_dev_open(BYTE pdrv);
 int fatfs_dev_write(BYTE pdrv, int loc, const void * buf, int nbyte);
@@ -28,6 +34,7 @@ int fatfs_dev_status(BYTE pdrv);
 
 int fatfs_dev_ioctl(BYTE pdrv, int request, void * ctl);
 int fatfs_dev_getinfo(BYTE pdrv, drive_info_t * info);
+UINT fatfs_dev_sector_size(BYTE pdrv);
 
 int fatfs_dev_waitbusy(BYTE pdrv);
 int fatfs_dev_eraseblocks(BYTE pdrv, int start, int end);
@@ -38,20 +38,49 @@
 #if _USE_LFN == 1
 #error Static LFN work area cannot be used at thread-safe configuration
 #endif
-#define	ENTER_FF(fs)		{ if (!lock_fs(fs)) return FR_TIMEOUT; }
+#define	ENTER_FF(fs)		{ if (!lock_fs(fs, 0)) return FR_TIMEOUT; }
 #define	LEAVE_FF(fs, res)	{ unlock_fs(fs, res); return res; }
+#if _FS_SHARED && !_FS_TINY
+#define	SHARED_READ			1	/* f_read() holds the volume shared with other readers */
+#define	LOCK_CACHE(fs)		ff_req_cache((fs)->sobj)
+#define	UNLOCK_CACHE(fs)	ff_rel_cache((fs)->sobj)
+#endif
+#if _FS_FILELOCK && !_FS_TINY
+#define	FILE_LOCK			1	/* File functions lock the file, file data moves with the volume released */
+#define	UNLOCK_FIL(fp, res)	unlock_fil(fp, res)
+#define	UNLOCK_VOL(fp)		unlock_fs((fp)->fs, FR_OK)
+#define	RELOCK_VOL(fp, sh)	{ FRESULT rl = relock_fs(fp, sh); if (rl != FR_OK) { ff_rel_file(&(fp)->fsobj); return rl; } }
+#define	ABORT_XFER(fp, res)	{ if ((res) == FR_DISK_ERR) ABORT((fp)->fs, res); ff_rel_file(&(fp)->fsobj); return res; }
+#endif
 #else
 #define	ENTER_FF(fs)
 #define LEAVE_FF(fs, res)	return res
 #endif
 
-#define	ABORT(fs, res)		{ fp->err = (BYTE)(res); LEAVE_FF(fs, res); }
+#ifndef SHARED_READ
+#define	SHARED_READ			0
+#define	LOCK_CACHE(fs)
+#define	UNLOCK_CACHE(fs)
+#endif
+#ifndef FILE_LOCK
+#define	FILE_LOCK			0
+#define	UNLOCK_FIL(fp, res)
+#define	UNLOCK_VOL(fp)
+#define	RELOCK_VOL(fp, sh)
+#define	ABORT_XFER(fp, res)	ABORT((fp)->fs, res)
+#endif
+
+#define	ABORT(fs, res)		{ fp->err = (BYTE)(res); UNLOCK_FIL(fp, res); LEAVE_FF(fs, res); }
+#define	LEAVE_FIL(fp, res)	{ UNLOCK_FIL(fp, res); LEAVE_FF((fp)->fs, res); }
 
 
 /* Definitions of sector size */
 #if (_MAX_SS < _MIN_SS) || (_MAX_SS != 512 && _MAX_SS != 1024 && _MAX_SS != 2048 && _MAX_SS != 4096) || (_MIN_SS != 512 && _MIN_SS != 1024 && _MIN_SS != 2048 && _MIN_SS != 4096)
 #error Wrong sector size configuration
 #endif
+#if (_FS_READAHEAD || _FS_WRITEBEHIND) && _FS_TINY
+#error _FS_READAHEAD and _FS_WRITEBEHIND need the file sector buffer (_FS_TINY 0)
+#endif
 #if _MAX_SS == _MIN_SS
 #define	SS(fs)	((UINT)_MAX_SS)	/* Fixed sector size */
 #else
@@ -511,11 +540,40 @@ int chk_chr (const char* str, int chr) {
 #if _FS_REENTRANT
 static
 int lock_fs (
-		FATFS* fs		/* File system object */
+		FATFS* fs,		/* File system object */
+		BYTE nowait		/* 1:Do not wait for another task */
+		)
+{
+	int ret;
+
+
+	ret = ff_req_grant(fs->sobj, nowait);
+	if (ret == 2) fs->n_lockwait++;	/* Granted after waiting for another task */
+	return ret;
+}
+
+
+#if SHARED_READ
+static
+int lock_fs_shared (	/* Lock the volume for reading file data */
+		FATFS* fs,		/* File system object */
+		BYTE nowait		/* 1:Do not wait for another task */
 		)
 {
-	return ff_req_grant(fs->sobj);
+	int ret;
+
+
+	ret = ff_req_grant_shared(fs->sobj, nowait);
+	if (ret == 2) {
+		LOCK_CACHE(fs);			/* Other readers may be counting too */
+		fs->n_lockwait++;
+		UNLOCK_CACHE(fs);
+	}
+	return ret;
 }
+#else
+#define	lock_fs_shared(fs, nowait)	lock_fs(fs, nowait)
+#endif
 
 
 static
@@ -532,6 +590,37 @@ void unlock_fs (
 		ff_rel_grant(fs->sobj);
 	}
 }
+
+
+#if FILE_LOCK
+static
+void unlock_fil (
+		FIL* fp,		/* File object */
+		FRESULT res		/* Result code to be returned */
+		)
+{
+	if (res != FR_INVALID_OBJECT && res != FR_TIMEOUT)	/* The file is not locked on these */
+		ff_rel_file(&fp->fsobj);
+}
+
+
+static
+FRESULT relock_fs (	/* Get the volume back after moving file data under the file lock alone */
+		FIL* fp,		/* File object */
+		int shared		/* 1:Shared grant (f_read) */
+		)
+{
+	FATFS *fs = fp->fs;
+
+
+	if (!(shared ? lock_fs_shared(fs, 0) : lock_fs(fs, 0))) return FR_TIMEOUT;
+	if (!fs->fs_type || fs->id != fp->id) {	/* Unmounted meanwhile */
+		unlock_fs(fs, FR_OK);
+		return FR_INVALID_OBJECT;
+	}
+	return FR_OK;
+}
+#endif
 #endif
 
 
@@ -650,756 +739,2260 @@ void clear_lock (	/* Clear lock entries of the volume */
 
 
 /*-----------------------------------------------------------------------*/
-/* Move/Flush disk access window in the file system object               */
+/* Deferred update of the FAT copies                                     */
 /*-----------------------------------------------------------------------*/
-#if !_FS_READONLY
+#if _FS_FATMIRROR && !_FS_READONLY
 static
-FRESULT sync_window (
-		FATFS* fs		/* File system object */
+FRESULT fm_copy (	/* FR_OK: successful, FR_DISK_ERR: failed */
+		FATFS* fs,		/* File system object */
+		BYTE* buf,		/* Buffer for n sectors */
+		DWORD ofs,		/* First sector offset in the FAT */
+		UINT n			/* Number of sectors */
 		)
 {
-	DWORD wsect;
 	UINT nf;
-	FRESULT res = FR_OK;
 
 
-	if (fs->wflag) {	/* Write back the sector if it is dirty */
-		wsect = fs->winsect;	/* Current sector number */
-		if (disk_write(fs->drv, fs->win, wsect, 1) != RES_OK) {
-			res = FR_DISK_ERR;
-		} else {
-			fs->wflag = 0;
-			if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
-				for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
-					wsect += fs->fsize;
-					disk_write(fs->drv, fs->win, wsect, 1);
-				}
-			}
-		}
+	if (disk_read(fs->drv, buf, fs->fatbase + ofs, n) != RES_OK)	/* Read them back from the first FAT */
+		return FR_DISK_ERR;
+	for (nf = 1; nf < fs->n_fats; nf++) {	/* Write them to the other copies in one transfer each */
+		if (disk_write(fs->drv, buf, fs->fatbase + nf * fs->fsize + ofs, n) != RES_OK)
+			return FR_DISK_ERR;
 	}
-	return res;
+	return FR_OK;
 }
-#endif
 
 
 static
-FRESULT move_window (
-		FATFS* fs,		/* File system object */
-		DWORD sector	/* Sector number to make appearance in the fs->win[] */
+void fm_sort (
+		FATFS* fs		/* File system object */
 		)
 {
-	FRESULT res = FR_OK;
+	UINT i, j;
+	DWORD ofs;
 
 
-	if (sector != fs->winsect) {	/* Window offset changed? */
-#if !_FS_READONLY
-		res = sync_window(fs);		/* Write-back changes */
-#endif
-		if (res == FR_OK) {			/* Fill sector window with new data */
-			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
-				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
-				res = FR_DISK_ERR;
-			}
-			fs->winsect = sector;
-		}
+	for (i = 1; i < fs->fmcnt; i++) {		/* Sort the recorded sectors (insertion sort, the set is small) */
+		ofs = fs->fmset[i];
+		for (j = i; j && fs->fmset[j - 1] > ofs; j--) fs->fmset[j] = fs->fmset[j - 1];
+		fs->fmset[j] = ofs;
 	}
-	return res;
 }
 
 
-
-
-/*-----------------------------------------------------------------------*/
-/* Synchronize file system and strage device                             */
-/*-----------------------------------------------------------------------*/
-#if !_FS_READONLY
 static
-FRESULT sync_fs (	/* FR_OK: successful, FR_DISK_ERR: failed */
-						FATFS* fs		/* File system object */
-						)
+FRESULT fm_flush (	/* FR_OK: successful, FR_DISK_ERR: failed */
+		FATFS* fs,		/* File system object */
+		BYTE* buf,		/* Buffer for a run of sectors */
+		UINT nmax		/* Number of sectors the buffer holds */
+		)
 {
-	FRESULT res;
+	UINT i, j;
+	DWORD ofs;
 
 
-	res = sync_window(fs);
-	if (res == FR_OK) {
-		/* Update FSINFO sector if needed */
-		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
-			/* Create FSINFO structure */
-			mem_set(fs->win, 0, SS(fs));
-			ST_WORD(fs->win + BS_55AA, 0xAA55);
-			ST_DWORD(fs->win + FSI_LeadSig, 0x41615252);
-			ST_DWORD(fs->win + FSI_StrucSig, 0x61417272);
-			ST_DWORD(fs->win + FSI_Free_Count, fs->free_clust);
-			ST_DWORD(fs->win + FSI_Nxt_Free, fs->last_clust);
-			/* Write it into the FSINFO sector */
-			fs->winsect = fs->volbase + 1;
-			disk_write(fs->drv, fs->win, fs->winsect, 1);
-			fs->fsi_flag = 0;
-		}
-		/* Make sure that no pending write process in the physical drive */
-		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK)
-			res = FR_DISK_ERR;
+	fm_sort(fs);
+	for (i = 0; i < fs->fmcnt; i = j) {		/* Copy them in runs, taking in gaps of up to 2 sectors */
+		ofs = fs->fmset[i];					/* (sectors not recorded are equal in all copies) */
+		for (j = i + 1; j < fs->fmcnt && fs->fmset[j] - ofs < nmax && fs->fmset[j] - fs->fmset[j - 1] <= 3; j++) ;
+		if (fm_copy(fs, buf, ofs, fs->fmset[j - 1] - ofs + 1) != FR_OK)
+			return FR_DISK_ERR;
 	}
-
-	return res;
+	fs->fmcnt = 0;
+	return FR_OK;
 }
-#endif
-
 
 
+static
+int fm_add (	/* 1:Copies are written later (or never), 0:Write them now */
+		FATFS* fs,		/* File system object */
+		DWORD ofs		/* Sector offset in the FAT of a sector written to the first FAT */
+		)
+{
+	UINT i;
 
-/*-----------------------------------------------------------------------*/
-/* Get sector# from cluster#                                             */
-/*-----------------------------------------------------------------------*/
-/* Hidden API for hacks and disk tools */
 
-DWORD clust2sect (	/* !=0: Sector number, 0: Failed - invalid cluster# */
-							FATFS* fs,		/* File system object */
-							DWORD clst		/* Cluster# to be converted */
-							)
-{
-	clst -= 2;
-	if (clst >= fs->n_fatent - 2) return 0;		/* Invalid cluster# */
-	return clst * fs->csize + fs->database;
+	if (fs->fmmode || fs->n_fats < 2) return 1;	/* Single active FAT or nothing to mirror */
+	for (i = 0; i < fs->fmcnt; i++) {
+		if (fs->fmset[i] == ofs) return 1;	/* Already recorded */
+	}
+	if (fs->fmcnt == _FS_FATMIRROR) {		/* Make room by writing out the set (needs the staging arena, */
+#if _FS_BOUNCE								/* the window may be the sector being written) */
+		if (!fs->bbuf || fm_flush(fs, fs->bbuf, _FS_BOUNCE * _MAX_SS / SS(fs)) != FR_OK)
+			return 0;
+#else
+		return 0;
+#endif
+	}
+	fs->fmset[fs->fmcnt++] = ofs;
+	return 1;
 }
+#endif
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* FAT access - Read value of a FAT entry                                */
+/* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
-/* Hidden API for hacks and disk tools */
-
-DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x0FFFFFFF:Cluster status */
-						FATFS* fs,	/* File system object */
-						DWORD clst	/* FAT index number (cluster number) to get the value */
-						)
+#if !_FS_READONLY
+static
+FRESULT write_sect (	/* FR_OK: successful, FR_DISK_ERR: failed */
+		FATFS* fs,		/* File system object */
+		const BYTE* buff,	/* Sector data to be written */
+		DWORD sect		/* Sector number to be written */
+		)
 {
-	UINT wc, bc;
-	BYTE *p;
-	DWORD val;
-
+	UINT nf;
 
-	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
-		val = 1;	/* Internal error */
 
-	} else {
-		val = 0xFFFFFFFF;	/* Default value falls on disk error */
+	if (disk_write(fs->drv, buff, sect, 1) != RES_OK)
+		return FR_DISK_ERR;
+	if (sect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+#if _FS_FATMIRROR
+		if (fm_add(fs, sect - fs->fatbase)) return FR_OK;	/* The copies are written at sync */
+#endif
+		for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
+			sect += fs->fsize;
+			disk_write(fs->drv, buff, sect, 1);
+		}
+	}
+	return FR_OK;
+}
 
-		switch (fs->fs_type) {
-			case FS_FAT12 :
-				bc = (UINT)clst; bc += bc / 2;
-				if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-				wc = fs->win[bc++ % SS(fs)];
-				if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-				wc |= fs->win[bc % SS(fs)] << 8;
-				val = clst & 1 ? wc >> 4 : (wc & 0xFFF);
-				break;
 
-			case FS_FAT16 :
-				if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2))) != FR_OK) break;
-				p = &fs->win[clst * 2 % SS(fs)];
-				val = LD_WORD(p);
-				break;
+static
+FRESULT sync_window (
+		FATFS* fs		/* File system object */
+		)
+{
+	FRESULT res = FR_OK;
 
-			case FS_FAT32 :
-				if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-				p = &fs->win[clst * 4 % SS(fs)];
-				val = LD_DWORD(p) & 0x0FFFFFFF;
-				break;
 
-			default:
-				val = 1;	/* Internal error */
-		}
+	if (fs->wflag) {	/* Write back the sector if it is dirty */
+		res = write_sect(fs, fs->win, fs->winsect);
+		if (res == FR_OK) fs->wflag = 0;
 	}
-
-	return val;
+	return res;
 }
+#endif
 
 
+#if _FS_WINCACHE
+#if _FS_WINCACHE > 16
+#error Wrong _FS_WINCACHE setting
+#endif
+#define WC_BUF(fs, i)	((fs)->wcbuf + (UINT)(i) * _MAX_SS)	/* Data of a cache entry */
 
-
-/*-----------------------------------------------------------------------*/
-/* FAT access - Change value of a FAT entry                              */
-/*-----------------------------------------------------------------------*/
-/* Hidden API for hacks and disk tools */
-
-#if !_FS_READONLY
-FRESULT put_fat (
-		FATFS* fs,	/* File system object */
-		DWORD clst,	/* FAT index number (cluster number) to be changed */
-		DWORD val	/* New value to be set to the entry */
+static
+void wc_reset (	/* Discard all cache entries */
+		FATFS* fs		/* File system object */
 		)
 {
-	UINT bc;
-	BYTE *p;
-	FRESULT res;
+	UINT i;
 
 
-	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
-		res = FR_INT_ERR;
+	for (i = 0; i < _FS_WINCACHE; i++) {
+		fs->wcsect[i] = 0xFFFFFFFF;
+		fs->wcflag[i] = 0;
+	}
+}
 
-	} else {
-		switch (fs->fs_type) {
-			case FS_FAT12 :
-				bc = (UINT)clst; bc += bc / 2;
-				res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-				if (res != FR_OK) break;
-				p = &fs->win[bc++ % SS(fs)];
-				*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;
-				fs->wflag = 1;
-				res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-				if (res != FR_OK) break;
-				p = &fs->win[bc % SS(fs)];
-				*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
-				fs->wflag = 1;
-				break;
 
-			case FS_FAT16 :
-				res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-				if (res != FR_OK) break;
-				p = &fs->win[clst * 2 % SS(fs)];
-				ST_WORD(p, (WORD)val);
-				fs->wflag = 1;
-				break;
+static
+void wc_drop (	/* Discard cache entries of a sector range without write-back */
+		FATFS* fs,		/* File system object */
+		DWORD sect,		/* Start sector */
+		UINT cnt		/* Number of sectors */
+		)
+{
+	UINT i;
 
-			case FS_FAT32 :
-				res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-				if (res != FR_OK) break;
-				p = &fs->win[clst * 4 % SS(fs)];
-				val |= LD_DWORD(p) & 0xF0000000;
-				ST_DWORD(p, val);
-				fs->wflag = 1;
-				break;
 
-			default :
-				res = FR_INT_ERR;
+	if (!fs->wcbuf) return;
+	for (i = 0; i < _FS_WINCACHE; i++) {
+		if (fs->wcsect[i] - sect < cnt) {
+			fs->wcsect[i] = 0xFFFFFFFF;
+			fs->wcflag[i] = 0;
 		}
 	}
-
-	return res;
 }
-#endif /* !_FS_READONLY */
-
 
 
-
-/*-----------------------------------------------------------------------*/
-/* FAT handling - Remove a cluster chain                                 */
-/*-----------------------------------------------------------------------*/
 #if !_FS_READONLY
 static
-FRESULT remove_chain (
-		FATFS* fs,			/* File system object */
-		DWORD clst			/* Cluster# to remove a chain from */
+FRESULT wc_flush (	/* Write back all dirty cache entries */
+		FATFS* fs		/* File system object */
 		)
 {
-	FRESULT res;
-	DWORD nxt;
-#if _USE_TRIM
-	DWORD scl = clst, ecl = clst, rt[2];
-#endif
+	UINT i;
 
-	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
-		res = FR_INT_ERR;
 
+	if (!fs->wcbuf) return FR_OK;
+	for (i = 0; i < _FS_WINCACHE; i++) {
+		if (fs->wcflag[i] & 1) {
+			if (write_sect(fs, WC_BUF(fs, i), fs->wcsect[i]) != FR_OK)
+				return FR_DISK_ERR;
+			fs->wcflag[i] = 0;
+		}
+	}
+	return FR_OK;
+}
+#endif
+
+
+static
+FRESULT wc_swap (	/* Replace the window with a sector, keeping the old one in the cache */
+		FATFS* fs,		/* File system object */
+		DWORD sector	/* Sector number to make appearance in the fs->win[] */
+		)
+{
+	UINT i, v;
+	BYTE *s, *d, c;
+	DWORD age;
+
+
+	fs->wcclk++;
+	for (i = 0; i < _FS_WINCACHE && fs->wcsect[i] != sector; i++) ;
+	if (i < _FS_WINCACHE) {		/* Cache hit: exchange the window and the entry */
+		fs->n_winhit++;
+		s = fs->win; d = WC_BUF(fs, i);
+		for (v = 0; v < SS(fs); v++) {
+			c = s[v]; s[v] = d[v]; d[v] = c;
+		}
+		fs->wcsect[i] = fs->winsect;
+		fs->winsect = sector;
+		c = fs->wcflag[i];
+		fs->wcflag[i] = fs->wflag;
+		fs->wflag = c;
+		fs->wcage[i] = fs->wcclk;
+		return FR_OK;
+	}
+
+	if (fs->winsect != 0xFFFFFFFF) {	/* Cache miss: keep current window in a free or the least recently used entry */
+		v = 0; age = 0;
+		for (i = 0; i < _FS_WINCACHE; i++) {
+			if (fs->wcsect[i] == 0xFFFFFFFF) { v = i; break; }
+			if (fs->wcclk - fs->wcage[i] >= age) {
+				v = i; age = fs->wcclk - fs->wcage[i];
+			}
+		}
+#if !_FS_READONLY
+		if ((fs->wcflag[v] & 1) && write_sect(fs, WC_BUF(fs, v), fs->wcsect[v]) != FR_OK)
+			return FR_DISK_ERR;
+#endif
+		mem_cpy(WC_BUF(fs, v), fs->win, SS(fs));
+		fs->wcsect[v] = fs->winsect;
+		fs->wcflag[v] = fs->wflag;
+		fs->wcage[v] = fs->wcclk;
+		fs->wflag = 0;
+	}
+	fs->n_winmiss++;
+	if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
+		fs->winsect = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
+		return FR_DISK_ERR;
+	}
+	fs->winsect = sector;
+	return FR_OK;
+}
+#endif /* _FS_WINCACHE */
+
+
+static
+FRESULT move_window (
+		FATFS* fs,		/* File system object */
+		DWORD sector	/* Sector number to make appearance in the fs->win[] */
+		)
+{
+	FRESULT res = FR_OK;
+
+
+	if (sector != fs->winsect) {	/* Window offset changed? */
+#if _FS_WINCACHE
+		if (fs->wcbuf) return wc_swap(fs, sector);
+#endif
+#if !_FS_READONLY
+		res = sync_window(fs);		/* Write-back changes */
+#endif
+		if (res == FR_OK) {			/* Fill sector window with new data */
+			fs->n_winmiss++;
+			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {
+				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
+				res = FR_DISK_ERR;
+			}
+			fs->winsect = sector;
+		}
+	} else {
+		fs->n_winhit++;
+	}
+	return res;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Load a FAT sector into the FAT cache (or the window)                  */
+/*-----------------------------------------------------------------------*/
+#if _FS_FATCACHE
+#if _FS_FATCACHE > 16
+#error Wrong _FS_FATCACHE setting
+#endif
+#define FC_BUF(fs, i)	((fs)->fcbuf + (UINT)(i) * _MAX_SS)	/* Data of a FAT cache entry */
+
+static
+void fc_reset (	/* Discard all FAT cache entries */
+		FATFS* fs		/* File system object */
+		)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_FATCACHE; i++) {
+		fs->fcsect[i] = 0xFFFFFFFF;
+		fs->fcflag[i] = 0;
+	}
+}
+
+
+#if !_FS_READONLY
+static
+FRESULT fc_flush (	/* Write back all dirty FAT cache entries to every FAT copy */
+		FATFS* fs		/* File system object */
+		)
+{
+	UINT i;
+
+
+	if (!fs->fcbuf) return FR_OK;
+	for (i = 0; i < _FS_FATCACHE; i++) {
+		if (fs->fcflag[i] & 1) {
+			if (write_sect(fs, FC_BUF(fs, i), fs->fcsect[i]) != FR_OK)
+				return FR_DISK_ERR;
+			fs->fcflag[i] = 0;
+		}
+	}
+	return FR_OK;
+}
+#endif
+#endif /* _FS_FATCACHE */
+
+
+static
+BYTE* fat_window (	/* Pointer to the FAT sector data, 0:Disk error */
+		FATFS* fs,		/* File system object */
+		DWORD sect,		/* FAT sector number to be accessed */
+		BYTE wr			/* 1:The sector is going to be modified */
+		)
+{
+#if _FS_FATCACHE
+	UINT i, v;
+	DWORD age;
+
+
+	if (fs->fcbuf) {	/* FAT traffic goes to its own cache and never disturbs the window */
+		fs->fcclk++;
+		v = 0; age = 0;
+		for (i = 0; i < _FS_FATCACHE && fs->fcsect[i] != sect; i++) {
+			if (fs->fcsect[i] == 0xFFFFFFFF) {		/* Prefer a free entry */
+				v = i; age = 0xFFFFFFFF;
+			} else if (fs->fcclk - fs->fcage[i] >= age) {	/* or the least recently used one */
+				v = i; age = fs->fcclk - fs->fcage[i];
+			}
+		}
+		if (i == _FS_FATCACHE) {	/* Cache miss: replace the victim entry */
+			fs->n_fatmiss++;
+#if !_FS_READONLY
+			if ((fs->fcflag[v] & 1) && write_sect(fs, FC_BUF(fs, v), fs->fcsect[v]) != FR_OK)
+				return 0;
+#endif
+			fs->fcflag[v] = 0;
+			if (disk_read(fs->drv, FC_BUF(fs, v), sect, 1) != RES_OK) {
+				fs->fcsect[v] = 0xFFFFFFFF;
+				return 0;
+			}
+			fs->fcsect[v] = sect;
+			i = v;
+		} else {
+			fs->n_fathit++;
+		}
+		fs->fcage[i] = fs->fcclk;
+		fs->fcflag[i] |= wr;
+		return FC_BUF(fs, i);
+	}
+#endif
+	if (move_window(fs, sect) != FR_OK) return 0;
+#if !_FS_READONLY
+	if (wr) fs->wflag = 1;
+#endif
+	return fs->win;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Bring the FAT copies up to date (or mark the single active FAT)       */
+/*-----------------------------------------------------------------------*/
+#if _FS_FATMIRROR && !_FS_READONLY
+static
+FRESULT fm_mark (	/* FR_OK: successful, FR_DISK_ERR: failed */
+		FATFS* fs,		/* File system object */
+		BYTE* buf,		/* Sector buffer */
+		BYTE flags		/* BPB_ExtFlags (0x80:Only FAT 0 is active, 0:FATs are mirrored) */
+		)
+{
+	UINT bk;
+
+
+	if (buf == fs->win) fs->winsect = 0xFFFFFFFF;	/* Borrow the window (it is clean when this is called) */
+	if (disk_read(fs->drv, buf, fs->volbase, 1) != RES_OK)
+		return FR_DISK_ERR;
+	buf[BPB_ExtFlags] = (buf[BPB_ExtFlags] & 0x70) | flags;
+	bk = LD_WORD(buf + BPB_BkBootSec);		/* Backup boot sector (FAT32) */
+	if (bk >= fs->fatbase - fs->volbase) bk = 0;
+	if (fs->winsect == fs->volbase || (bk && fs->winsect == fs->volbase + bk))
+		fs->winsect = 0xFFFFFFFF;			/* The boot sector changes under the window */
+#if _FS_WINCACHE
+	wc_drop(fs, fs->volbase, 1);
+	if (bk) wc_drop(fs, fs->volbase + bk, 1);
+#endif
+	if (disk_write(fs->drv, buf, fs->volbase, 1) != RES_OK)
+		return FR_DISK_ERR;
+	if (bk && disk_write(fs->drv, buf, fs->volbase + bk, 1) != RES_OK)
+		return FR_DISK_ERR;
+	return FR_OK;
+}
+
+
+static
+const BYTE* fm_held (	/* Clean copy of a sector in memory, 0:not held */
+		FATFS* fs,		/* File system object */
+		DWORD sect		/* Sector number */
+		)
+{
+#if _FS_FATCACHE || _FS_WINCACHE
+	UINT i;
+#endif
+
+
+	if (fs->winsect == sect && !fs->wflag) return fs->win;
+#if _FS_FATCACHE
+	for (i = 0; fs->fcbuf && i < _FS_FATCACHE; i++) {
+		if (fs->fcsect[i] == sect && !(fs->fcflag[i] & 1)) return FC_BUF(fs, i);
+	}
+#endif
+#if _FS_WINCACHE
+	for (i = 0; fs->wcbuf && i < _FS_WINCACHE; i++) {
+		if (fs->wcsect[i] == sect && !(fs->wcflag[i] & 1)) return WC_BUF(fs, i);
+	}
+#endif
+	return 0;
+}
+
+
+static
+FRESULT fm_sync (	/* FR_OK: successful, FR_DISK_ERR: failed */
+		FATFS* fs		/* File system object (the first FAT and the window are flushed) */
+		)
+{
+	BYTE *buf = fs->win;
+	const BYTE *mem;
+	UINT i, j, nf, nmax = 1;
+	DWORD ofs;
+	FRESULT res = FR_OK;
+
+
+	if (fs->n_fats < 2) return FR_OK;
+	if (fs->fmmode) {						/* Single active FAT */
+		fs->fmcnt = 0;
+		if (fs->fs_type != FS_FAT32 || (fs->fmflag & 1)) return FR_OK;
+		res = fm_mark(fs, buf, 0x80);		/* Tell other systems to use only the first FAT */
+		if (res == FR_OK) fs->fmflag |= 1;
+		return res;
+	}
+	if (!(fs->fmflag & 1)) {				/* Copy the sectors still in memory that no run would take in */
+		fm_sort(fs);
+		for (i = j = 0; i < fs->fmcnt; i++) {
+			ofs = fs->fmset[i];
+			mem = 0;
+			if ((!i || ofs - fs->fmset[i - 1] > 3) && (i + 1 == fs->fmcnt || fs->fmset[i + 1] - ofs > 3))
+				mem = fm_held(fs, fs->fatbase + ofs);
+			for (nf = 1; mem && nf < fs->n_fats; nf++) {
+				if (disk_write(fs->drv, mem, fs->fatbase + nf * fs->fsize + ofs, 1) != RES_OK)
+					return FR_DISK_ERR;
+			}
+			if (!mem) fs->fmset[j++] = ofs;	/* Keep it for fm_flush() */
+		}
+		fs->fmcnt = j;
+		if (!j) return FR_OK;
+	}
+#if _FS_BOUNCE
+	if (fs->bbuf) {
+		buf = fs->bbuf;
+		nmax = _FS_BOUNCE * _MAX_SS / SS(fs);
+	}
+#endif
+	if (buf == fs->win) fs->winsect = 0xFFFFFFFF;	/* Borrow the window */
+	if (fs->fmflag & 1) {					/* The volume was used with a single active FAT */
+		for (ofs = 0; res == FR_OK && ofs < fs->fsize; ofs += nmax)	/* Copy the whole FAT */
+			res = fm_copy(fs, buf, ofs, fs->fsize - ofs < nmax ? fs->fsize - ofs : nmax);
+		if (res == FR_OK) res = fm_mark(fs, fs->win, 0);	/* The FATs are mirrored again */
+		if (res == FR_OK) {
+			fs->fmflag &= ~1;
+			fs->fmcnt = 0;
+		}
+		return res;
+	}
+	return fm_flush(fs, buf, nmax);
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize file system and strage device                             */
+/*-----------------------------------------------------------------------*/
+#if !_FS_READONLY
+static
+FRESULT sync_fs (	/* FR_OK: successful, FR_DISK_ERR: failed */
+						FATFS* fs		/* File system object */
+						)
+{
+	FRESULT res;
+
+
+#if _FS_FATCACHE
+	res = fc_flush(fs);
+	if (res == FR_OK) res = sync_window(fs);
+#else
+	res = sync_window(fs);
+#endif
+#if _FS_WINCACHE
+	if (res == FR_OK) res = wc_flush(fs);
+#endif
+#if _FS_FATMIRROR
+	if (res == FR_OK) res = fm_sync(fs);
+#endif
+	if (res == FR_OK) {
+		/* Update FSINFO sector if needed */
+		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
+			/* Create FSINFO structure */
+			mem_set(fs->win, 0, SS(fs));
+			ST_WORD(fs->win + BS_55AA, 0xAA55);
+			ST_DWORD(fs->win + FSI_LeadSig, 0x41615252);
+			ST_DWORD(fs->win + FSI_StrucSig, 0x61417272);
+			ST_DWORD(fs->win + FSI_Free_Count, fs->free_clust);
+			ST_DWORD(fs->win + FSI_Nxt_Free, fs->last_clust);
+			/* Write it into the FSINFO sector */
+			fs->winsect = fs->volbase + 1;
+#if _FS_WINCACHE
+			wc_drop(fs, fs->winsect, 1);
+#endif
+			disk_write(fs->drv, fs->win, fs->winsect, 1);
+			fs->fsi_flag = 0;
+		}
+		/* Make sure that no pending write process in the physical drive */
+		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK)
+			res = FR_DISK_ERR;
+	}
+
+	return res;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get sector# from cluster#                                             */
+/*-----------------------------------------------------------------------*/
+/* Hidden API for hacks and disk tools */
+
+DWORD clust2sect (	/* !=0: Sector number, 0: Failed - invalid cluster# */
+							FATFS* fs,		/* File system object */
+							DWORD clst		/* Cluster# to be converted */
+							)
+{
+	clst -= 2;
+	if (clst >= fs->n_fatent - 2) return 0;		/* Invalid cluster# */
+	return clst * fs->csize + fs->database;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Read value of a FAT entry                                */
+/*-----------------------------------------------------------------------*/
+/* Hidden API for hacks and disk tools */
+
+DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x0FFFFFFF:Cluster status */
+						FATFS* fs,	/* File system object */
+						DWORD clst	/* FAT index number (cluster number) to get the value */
+						)
+{
+	UINT wc, bc;
+	BYTE *p;
+	DWORD val;
+
+
+	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
+		val = 1;	/* Internal error */
+
+	} else {
+		val = 0xFFFFFFFF;	/* Default value falls on disk error */
+
+		switch (fs->fs_type) {
+			case FS_FAT12 :
+				bc = (UINT)clst; bc += bc / 2;
+				if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0)) == 0) break;
+				wc = p[bc++ % SS(fs)];
+				if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0)) == 0) break;
+				wc |= p[bc % SS(fs)] << 8;
+				val = clst & 1 ? wc >> 4 : (wc & 0xFFF);
+				break;
+
+			case FS_FAT16 :
+				if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 0)) == 0) break;
+				p += clst * 2 % SS(fs);
+				val = LD_WORD(p);
+				break;
+
+			case FS_FAT32 :
+				if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 0)) == 0) break;
+				p += clst * 4 % SS(fs);
+				val = LD_DWORD(p) & 0x0FFFFFFF;
+				break;
+
+			default:
+				val = 1;	/* Internal error */
+		}
+	}
+
+	return val;
+}
+
+
+#if SHARED_READ
+static
+DWORD get_fat_shared (	/* get_fat() for a holder of a shared grant */
+		FATFS* fs,	/* File system object */
+		DWORD clst	/* FAT index number (cluster number) to get the value */
+		)
+{
+	DWORD val;
+
+
+	LOCK_CACHE(fs);			/* The FAT cache and the window are the volume's */
+	val = get_fat(fs, clst);
+	UNLOCK_CACHE(fs);
+	return val;
+}
+#else
+#define	get_fat_shared(fs, clst)	get_fat(fs, clst)
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Change value of a FAT entry                              */
+/*-----------------------------------------------------------------------*/
+/* Hidden API for hacks and disk tools */
+
+#if !_FS_READONLY
+FRESULT put_fat (
+		FATFS* fs,	/* File system object */
+		DWORD clst,	/* FAT index number (cluster number) to be changed */
+		DWORD val	/* New value to be set to the entry */
+		)
+{
+	UINT bc;
+	BYTE *p;
+	FRESULT res;
+#if _FS_FREECOUNT
+	DWORD old;
+	int dn = 0;
+#endif
+
+
+	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
+		res = FR_INT_ERR;
+
+	} else {
+#if _FS_FREECOUNT
+		if (clst < fs->fcnt_clst) {		/* The cluster has been counted by f_countfree() */
+			old = get_fat(fs, clst);
+			if (old == 0 && val != 0) dn = -1;	/* Free -> in use */
+			if (old >= 2 && old != 0xFFFFFFFF && val == 0) dn = 1;	/* In use -> free */
+		}
+#endif
+		res = FR_DISK_ERR;
+		switch (fs->fs_type) {
+			case FS_FAT12 :
+				bc = (UINT)clst; bc += bc / 2;
+				if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1)) == 0) break;
+				p += bc++ % SS(fs);
+				*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;
+				if ((p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1)) == 0) break;
+				p += bc % SS(fs);
+				*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
+				res = FR_OK;
+				break;
+
+			case FS_FAT16 :
+				if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 1)) == 0) break;
+				p += clst * 2 % SS(fs);
+				ST_WORD(p, (WORD)val);
+				res = FR_OK;
+				break;
+
+			case FS_FAT32 :
+				if ((p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 1)) == 0) break;
+				p += clst * 4 % SS(fs);
+				val |= LD_DWORD(p) & 0xF0000000;
+				ST_DWORD(p, val);
+				res = FR_OK;
+				break;
+
+			default :
+				res = FR_INT_ERR;
+		}
+	}
+#if _FS_FREECOUNT
+	if (res == FR_OK) fs->fcnt_free += dn;	/* Keep the count in progress in sync */
+#endif
+#if _FS_FREEMAP
+	if (res == FR_OK && clst < fs->fmclst) {	/* Keep the mapped part of the bitmap in sync */
+		if (val)
+			fs->fmbuf[clst / 32] |= (DWORD)1 << (clst % 32);
+		else
+			fs->fmbuf[clst / 32] &= ~((DWORD)1 << (clst % 32));
+	}
+#endif
+
+	return res;
+}
+#endif /* !_FS_READONLY */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Scan the FAT for free clusters                           */
+/*-----------------------------------------------------------------------*/
+/* Counts the free clusters and, when map is given, sets the bit of each
+/  cluster in use (map must be cleared by the caller). */
+
+#if !_FS_READONLY
+static
+FRESULT scan_fat (
+		FATFS* fs,		/* File system object */
+		DWORD* map,		/* Bitmap to fill in (can be NULL) */
+		DWORD clst,		/* First cluster to scan (>=2) */
+		DWORD ecl,		/* Cluster next to the last one to scan (<=n_fatent) */
+		DWORD* nfree	/* Pointer to return the number of free clusters */
+		)
+{
+	DWORD n, sect, stat;
+	UINT i, ent;
+	BYTE fat, *p;
+
+
+	fat = fs->fs_type;
+	n = 0;
+	if (fat == FS_FAT12) {
+		for ( ; clst < ecl; clst++) {
+			stat = get_fat(fs, clst);
+			if (stat == 0xFFFFFFFF) return FR_DISK_ERR;
+			if (stat == 1) return FR_INT_ERR;
+			if (stat == 0) n++;
+			else if (map) map[clst / 32] |= (DWORD)1 << (clst % 32);
+		}
+	} else {
+		ent = SS(fs) / (fat == FS_FAT16 ? 2 : 4);	/* FAT entries per sector */
+		sect = fs->fatbase + clst / ent;
+		i = 0; p = 0;
+		for ( ; clst < ecl; clst++) {
+			if (!i) {
+				p = fat_window(fs, sect++, 0);
+				if (!p) return FR_DISK_ERR;
+				i = (UINT)(clst % ent) * (SS(fs) / ent);	/* Offset of the first entry */
+				p += i; i = SS(fs) - i;
+			}
+			if (fat == FS_FAT16) {
+				stat = LD_WORD(p);
+				p += 2; i -= 2;
+			} else {
+				stat = LD_DWORD(p) & 0x0FFFFFFF;
+				p += 4; i -= 4;
+			}
+			if (stat == 0) n++;
+			else if (map) map[clst / 32] |= (DWORD)1 << (clst % 32);
+		}
+	}
+	*nfree = n;
+	return FR_OK;
+}
+#endif /* !_FS_READONLY */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster bitmap                                                   */
+/*-----------------------------------------------------------------------*/
+/* The bitmap is filled in a part at a time in the arena FATFS.fmbuf: by
+/  f_countfree() along with the count and by each allocation that finds it
+/  incomplete. fs->fmclst is the next cluster to be mapped (0:Not started) and
+/  put_fat() keeps the bits below it up to date. fs->fmap is set when the whole
+/  FAT has been mapped; until then clusters are found with the FAT scan. */
+#if _FS_FREEMAP
+#define FM_STEP		4		/* FAT sectors mapped by an allocation while the bitmap is incomplete */
+
+static
+void fm_reset (
+		FATFS* fs	/* File system object */
+		)
+{
+	fs->fmap = 0;
+	fs->fmclst = 0;
+}
+
+
+#if !_FS_READONLY
+static
+int fm_start (	/* 1:The bitmap is being built, 0:No bitmap for this volume */
+		FATFS* fs	/* File system object */
+		)
+{
+	UINT nw;
+
+
+	nw = (UINT)((fs->n_fatent + 31) / 32);
+	if (!fs->fmbuf || (DWORD)nw * 4 > _FS_FREEMAP) return 0;	/* No arena or too large for it */
+	if (fs->fmclst < 2) {
+		mem_set(fs->fmbuf, 0, nw * sizeof(DWORD));
+		fs->fmclst = 2;
+	}
+	return 1;
+}
+
+
+static
+void fm_done (	/* Record that the clusters below ecl have been mapped */
+		FATFS* fs,	/* File system object */
+		DWORD ecl	/* Cluster next to the last one mapped */
+		)
+{
+	DWORD clst;
+
+
+	fs->fmclst = ecl;
+	if (ecl >= fs->n_fatent) {			/* The whole FAT is mapped */
+		fs->fmbuf[0] |= 3;				/* Cluster 0 and 1 are never allocatable */
+		for (clst = fs->n_fatent; clst % 32; clst++)	/* Nor are the bits past the last cluster */
+			fs->fmbuf[clst / 32] |= (DWORD)1 << (clst % 32);
+		fs->fmap = fs->fmbuf;
+	}
+}
+
+
+static
+void fm_step (	/* Map the next nsect FAT sectors */
+		FATFS* fs,	/* File system object */
+		UINT nsect	/* Number of FAT sectors */
+		)
+{
+	DWORD n, ecl;
+
+
+	if (fs->fmap || !fm_start(fs)) return;
+	ecl = fs->n_fatent;
+	n = (fs->fs_type == FS_FAT12) ? SS(fs) * 2 / 3 : SS(fs) / (fs->fs_type == FS_FAT16 ? 2 : 4);
+	if ((ecl - fs->fmclst) / n > nsect) ecl = fs->fmclst + n * nsect;
+	if (scan_fat(fs, fs->fmbuf, fs->fmclst, ecl, &n) == FR_OK)
+		fm_done(fs, ecl);
+	else
+		fs->fmclst = 0;					/* Start over on the next step */
+}
+
+
+static
+DWORD fm_find (	/* 0:No free cluster, >=2:Free cluster# */
+		FATFS* fs,	/* File system object */
+		DWORD scl	/* The search starts next to this cluster and wraps around to it */
+		)
+{
+	DWORD ncl, end, w;
+	UINT pass;
+
+
+	ncl = scl + 1; end = fs->n_fatent;
+	for (pass = 0; pass < 2; pass++) {
+		while (ncl < end) {
+			w = fs->fmap[ncl / 32] | (((DWORD)1 << (ncl % 32)) - 1);	/* Ignore the bits below ncl */
+			if ((w & 0xFFFFFFFF) != 0xFFFFFFFF) {	/* This word has a free cluster */
+				ncl &= ~(DWORD)31;
+				while (w & 1) { w >>= 1; ncl++; }
+				return (ncl < end) ? ncl : 0;
+			}
+			ncl = (ncl | 31) + 1;		/* Next word */
+		}
+		ncl = 2; end = scl + 1;			/* Wrap around */
+	}
+	return 0;
+}
+#endif /* !_FS_READONLY */
+#endif /* _FS_FREEMAP */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Remove a cluster chain                                 */
+/*-----------------------------------------------------------------------*/
+#if !_FS_READONLY
+static
+FRESULT remove_chain (
+		FATFS* fs,			/* File system object */
+		DWORD clst			/* Cluster# to remove a chain from */
+		)
+{
+	FRESULT res;
+	DWORD nxt;
+#if _USE_TRIM
+	DWORD scl = clst, ecl = clst, rt[2];
+#endif
+
+	if (clst < 2 || clst >= fs->n_fatent) {	/* Check range */
+		res = FR_INT_ERR;
+
+	} else {
+		res = FR_OK;
+		while (clst < fs->n_fatent) {			/* Not a last link? */
+			nxt = get_fat(fs, clst);			/* Get cluster status */
+			if (nxt == 0) break;				/* Empty cluster? */
+			if (nxt == 1) { res = FR_INT_ERR; break; }	/* Internal error? */
+			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }	/* Disk error? */
+			res = put_fat(fs, clst, 0);			/* Mark the cluster "empty" */
+			if (res != FR_OK) break;
+#if _FS_WINCACHE
+			wc_drop(fs, clust2sect(fs, clst), fs->csize);	/* Discard cached sectors of the cluster */
+#endif
+			if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
+				fs->free_clust++;
+				fs->fsi_flag |= 1;
+			}
+#if _USE_TRIM
+			if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
+				ecl = nxt;
+			} else {				/* End of contiguous clusters */
+				rt[0] = clust2sect(fs, scl);					/* Start sector */
+				rt[1] = clust2sect(fs, ecl) + fs->csize - 1;	/* End sector */
+				disk_ioctl(fs->drv, CTRL_TRIM, rt);				/* Erase the block */
+				scl = ecl = nxt;
+			}
+#endif
+			clst = nxt;	/* Next cluster */
+		}
+	}
+
+	return res;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch or Create a cluster chain                      */
+/*-----------------------------------------------------------------------*/
+#if !_FS_READONLY
+static
+DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
+							FATFS* fs,			/* File system object */
+							DWORD clst			/* Cluster# to stretch. 0 means create a new chain. */
+							)
+{
+	DWORD cs, ncl, scl;
+	FRESULT res;
+
+
+	if (clst == 0) {		/* Create a new chain */
+		scl = fs->last_clust;			/* Get suggested start point */
+		if (!scl || scl >= fs->n_fatent) scl = 1;
+	}
+	else {					/* Stretch the current chain */
+		cs = get_fat(fs, clst);			/* Check the cluster status */
+		if (cs < 2) return 1;			/* Invalid value */
+		if (cs == 0xFFFFFFFF) return cs;	/* A disk error occurred */
+		if (cs < fs->n_fatent) return cs;	/* It is already followed by next cluster */
+		scl = clst;
+	}
+
+#if _FS_FREEMAP
+	if (!fs->fmap) fm_step(fs, FM_STEP);	/* Build the free cluster bitmap a part at a time */
+	if (fs->fmap) {
+		ncl = fm_find(fs, scl);			/* Find a free cluster in the bitmap */
+		if (!ncl) return 0;				/* No free cluster */
+	} else
+#endif
+	{
+		ncl = scl;						/* Start cluster */
+		for (;;) {
+			ncl++;							/* Next cluster */
+			if (ncl >= fs->n_fatent) {		/* Check wrap around */
+				ncl = 2;
+				if (ncl > scl) return 0;	/* No free cluster */
+			}
+			cs = get_fat(fs, ncl);			/* Get the cluster status */
+			if (cs == 0) break;				/* Found a free cluster */
+			if (cs == 0xFFFFFFFF || cs == 1)/* An error occurred */
+				return cs;
+			if (ncl == scl) return 0;		/* No free cluster */
+		}
+	}
+
+	res = put_fat(fs, ncl, 0x0FFFFFFF);	/* Mark the new cluster "last link" */
+	if (res == FR_OK && clst != 0) {
+		res = put_fat(fs, clst, ncl);	/* Link it to the previous one if needed */
+	}
+	if (res == FR_OK) {
+		fs->last_clust = ncl;			/* Update FSINFO */
+		if (fs->free_clust != 0xFFFFFFFF) {
+			fs->free_clust--;
+			fs->fsi_flag |= 1;
+		}
 	} else {
+		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
+	}
+
+	return ncl;		/* Return new cluster number or error code */
+}
+#endif /* !_FS_READONLY */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Convert offset into cluster with link map table        */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_FASTSEEK
+static
+DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
+							FIL* fp,		/* Pointer to the file object */
+							DWORD ofs		/* File offset to be converted to cluster# */
+							)
+{
+	DWORD cl, ncl, *tbl;
+
+
+	tbl = fp->cltbl + 1;	/* Top of CLMT */
+	cl = ofs / SS(fp->fs) / fp->fs->csize;	/* Cluster order from top of the file */
+	for (;;) {
+		ncl = *tbl++;			/* Number of cluters in the fragment */
+		if (!ncl) return 0;		/* End of table? (error) */
+		if (cl < ncl) break;	/* In this fragment? */
+		cl -= ncl; tbl++;		/* Next fragment */
+	}
+	return cl + *tbl;	/* Return the cluster number */
+}
+
+
+static
+DWORD clmt_run (	/* 0:Error, >=1:Number of consecutive clusters from the offset */
+							FIL* fp,		/* Pointer to the file object */
+							DWORD ofs		/* File offset in the first cluster */
+							)
+{
+	DWORD cl, ncl, *tbl;
+
+
+	tbl = fp->cltbl + 1;	/* Top of CLMT */
+	cl = ofs / SS(fp->fs) / fp->fs->csize;	/* Cluster order from top of the file */
+	for (;;) {
+		ncl = *tbl++;			/* Number of cluters in the fragment */
+		if (!ncl) return 0;		/* End of table? (error) */
+		if (cl < ncl) break;	/* In this fragment? */
+		cl -= ncl; tbl++;		/* Next fragment */
+	}
+	return ncl - cl;	/* Clusters left in the fragment */
+}
+#endif	/* _USE_FASTSEEK */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Extend a direct transfer over consecutive clusters     */
+/*-----------------------------------------------------------------------*/
+/* Returns the number of sectors (up to cc) that can be transferred in one
+/  request from sector csect of the current cluster, and moves fp->clust to
+/  the cluster holding the last of them. */
+
+static
+UINT clust_run (
+		FIL* fp,		/* Pointer to the file object */
+		UINT csect,		/* Sector offset in the current cluster */
+		UINT cc,		/* Number of sectors wanted */
+		int stretch		/* 0:Follow the chain, 1:Allocate clusters past its end (write) */
+		)
+{
+	FATFS *fs = fp->fs;
+	DWORD clst = fp->clust, nxt;
+	UINT n = fs->csize - csect;		/* Sectors left in the current cluster */
+#if _USE_FASTSEEK
+	DWORD ncl;
+#endif
+
+
+	if (n >= cc) return cc;
+#if _USE_FASTSEEK
+	if (fp->cltbl) {				/* The link map knows the length of the fragment */
+		nxt = clmt_run(fp, fp->fptr);
+		if (nxt > 1) {
+			ncl = (cc - n + fs->csize - 1) / fs->csize;	/* Clusters wanted after the current one */
+			if (ncl > nxt - 1) ncl = nxt - 1;
+			fp->clust = clst + ncl;
+			n += ncl * fs->csize;
+		}
+		return n < cc ? n : cc;
+	}
+#endif
+	while (n < cc) {				/* Peek the chain while the next cluster follows physically */
+#if !_FS_READONLY
+		if (stretch)
+			nxt = create_chain(fs, clst);	/* A cluster linked here but not consecutive is used by the next iteration */
+		else
+#endif
+			nxt = get_fat_shared(fs, clst);	/* f_read() peeks under a shared grant */
+		if (nxt != clst + 1) break;	/* Fragment end, end of chain or error (handled by the caller's next step) */
+		clst = nxt;
+		n += fs->csize;
+	}
+	fp->clust = clst;
+	return n < cc ? n : cc;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory index - Index table management                              */
+/*-----------------------------------------------------------------------*/
+/* An index of a large directory holds a hash table of its names and a bitmap
+/  of its free entries and its cluster list in its part of FATFS.dixbuf.
+/  A hash slot is a DWORD of {tag[11], distance from the top of the LFN entries
+/  to the SFN entry[5], SFN index[16]}, each object has a slot for its SFN and
+/  one for its LFN. */
+#if _FS_DIRINDEX
+#define DI_EMPTY	0xFFFFFFFF	/* Hash slot never used */
+#define DI_DELETED	0xFFFFFFFE	/* Hash slot of a removed name */
+#define DI_MIN		128			/* Directories found to be this many entries long are indexed */
+#define DI_FREE(ix)	((ix)->map + (ix)->nslot)	/* Free entry bitmap (bit set:free) */
+#define DI_CLST(ix)	(DI_FREE(ix) + ((ix)->cap + 31) / 32)	/* Clusters of the table */
+
+static
+void di_drop (	/* Discard the index of a directory */
+		FATFS* fs,		/* File system object */
+		DWORD sclust	/* Start cluster of the directory */
+		)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_DIRINDEX; i++) {
+		if (fs->dix[i].flag && fs->dix[i].sclust == sclust) {
+			fs->dix[i].map = 0;
+			fs->dix[i].flag = 0;
+		}
+	}
+}
+
+
+static
+void di_free (	/* Discard all indexes */
+		FATFS* fs		/* File system object */
+		)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_DIRINDEX; i++) {
+		if (fs->dix[i].flag) di_drop(fs, fs->dix[i].sclust);
+	}
+}
+
+
+static
+DIRIX* di_get (	/* Index of the directory, NULL:Not indexed */
+		FATFS* fs,		/* File system object */
+		DWORD sclust	/* Start cluster of the directory */
+		)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_DIRINDEX; i++) {
+		if (fs->dix[i].flag && fs->dix[i].sclust == sclust) {
+			fs->dix[i].age = ++fs->dixclk;
+			return &fs->dix[i];
+		}
+	}
+	return 0;
+}
+
+
+static
+void di_sdi (	/* Set directory index without following the cluster chain */
+		FDIR* dp,		/* Directory object */
+		DIRIX* ix,		/* Index of the directory */
+		UINT idx		/* Index of directory table (< ix->nent) */
+		)
+{
+	UINT ic = SS(dp->fs) / SZ_DIRE;	/* Entries per sector */
+
+
+	dp->index = (WORD)idx;
+	if (ix->nclst) {		/* Dynamic table */
+		dp->clust = DI_CLST(ix)[idx / (ic * dp->fs->csize)];
+		dp->sect = clust2sect(dp->fs, dp->clust) + idx / ic % dp->fs->csize;
+	} else {				/* Static table (root directory in FAT12/16) */
+		dp->clust = 0;
+		dp->sect = dp->fs->dirbase + idx / ic;
+	}
+	dp->dir = dp->fs->win + (idx % ic) * SZ_DIRE;
+}
+
+
+static
+int di_put (	/* 1:Slot stored, 0:Hash table is full */
+		DIRIX* ix,		/* Directory index */
+		DWORD hash,		/* Hash of the name */
+		UINT idx,		/* Index of the SFN entry */
+		UINT dist		/* Number of LFN entries in front of the SFN entry */
+		)
+{
+	UINT pos, n;
+
+
+	hash ^= hash >> 15; hash *= 0x2C1B3C6D; hash ^= hash >> 12;
+	pos = (UINT)(hash % ix->nslot);
+	for (n = 0; n < ix->nslot; n++) {
+		if (ix->map[pos] >= DI_DELETED) {
+			ix->map[pos] = (hash & 0xFFE00000) | ((DWORD)dist << 16) | idx;
+			return 1;
+		}
+		if (++pos == ix->nslot) pos = 0;
+	}
+	return 0;
+}
+
+
+static
+void di_set_free (	/* Mark a range of entries free or in use */
+		DIRIX* ix,		/* Directory index */
+		UINT idx,		/* First entry */
+		UINT cnt,		/* Number of entries */
+		int free		/* 1:Free, 0:In use */
+		)
+{
+	DWORD *bm = DI_FREE(ix);
+
+
+	for ( ; cnt; idx++, cnt--) {
+		if (idx >= ix->cap) break;
+		if (free) bm[idx / 32] |= (DWORD)1 << (idx % 32);
+		else bm[idx / 32] &= ~((DWORD)1 << (idx % 32));
+	}
+}
+
+
+#if !_FS_READONLY
+
+static
+UINT di_hint (	/* Index to start looking for free entries from */
+		DIRIX* ix,		/* Directory index */
+		UINT nent		/* Number of contiguous entries needed */
+		)
+{
+	const DWORD *bm = DI_FREE(ix);
+	UINT i, n = 0;
+
+
+	for (i = 0; i < ix->nent; i++) {	/* First block of free entries, the same as a scan from the top finds */
+		if (!(i % 32) && !bm[i / 32]) {	/* Skip a word of entries in use */
+			n = 0; i += 31; continue;
+		}
+		if (bm[i / 32] & ((DWORD)1 << (i % 32))) {
+			if (++n == nent) return i + 1 - n;
+		} else {
+			n = 0;
+		}
+	}
+	return n ? ix->nent - n : ix->nent - 1;	/* Free entries at the end, or the last entry, are followed by the stretched table */
+}
+#endif
+#endif	/* _FS_DIRINDEX */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Set directory index                              */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT dir_sdi (
+		FDIR* dp,		/* Pointer to directory object */
+		UINT idx		/* Index of directory table */
+		)
+{
+	DWORD clst, sect;
+	UINT ic;
+
+
+	dp->index = (WORD)idx;	/* Current index */
+	clst = dp->sclust;		/* Table start cluster (0:root) */
+	if (clst == 1 || clst >= dp->fs->n_fatent)	/* Check start cluster range */
+		return FR_INT_ERR;
+	if (!clst && dp->fs->fs_type == FS_FAT32)	/* Replace cluster# 0 with root cluster# if in FAT32 */
+		clst = dp->fs->dirbase;
+
+	if (clst == 0) {	/* Static table (root-directory in FAT12/16) */
+		if (idx >= dp->fs->n_rootdir)	/* Is index out of range? */
+			return FR_INT_ERR;
+		sect = dp->fs->dirbase;
+	}
+	else {				/* Dynamic table (root-directory in FAT32 or sub-directory) */
+		ic = SS(dp->fs) / SZ_DIRE * dp->fs->csize;	/* Entries per cluster */
+		while (idx >= ic) {	/* Follow cluster chain */
+			clst = get_fat(dp->fs, clst);				/* Get next cluster */
+			if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
+			if (clst < 2 || clst >= dp->fs->n_fatent)	/* Reached to end of table or internal error */
+				return FR_INT_ERR;
+			idx -= ic;
+		}
+		sect = clust2sect(dp->fs, clst);
+	}
+	dp->clust = clst;	/* Current cluster# */
+	if (!sect) return FR_INT_ERR;
+	dp->sect = sect + idx / (SS(dp->fs) / SZ_DIRE);					/* Sector# of the directory entry */
+	dp->dir = dp->fs->win + (idx % (SS(dp->fs) / SZ_DIRE)) * SZ_DIRE;	/* Ptr to the entry in the sector */
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Move directory table index next                  */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT dir_next (	/* FR_OK:Succeeded, FR_NO_FILE:End of table, FR_DENIED:Could not stretch */
+							FDIR* dp,		/* Pointer to the directory object */
+							int stretch		/* 0: Do not stretch table, 1: Stretch table if needed */
+							)
+{
+	DWORD clst;
+	UINT i;
+#if !_FS_READONLY
+	UINT c;
+#endif
+
+
+	i = dp->index + 1;
+	if (!(i & 0xFFFF) || !dp->sect)	/* Report EOT when index has reached 65535 */
+		return FR_NO_FILE;
+
+	if (!(i % (SS(dp->fs) / SZ_DIRE))) {	/* Sector changed? */
+		dp->sect++;					/* Next sector */
+
+		if (!dp->clust) {		/* Static table */
+			if (i >= dp->fs->n_rootdir)	/* Report EOT if it reached end of static table */
+				return FR_NO_FILE;
+		}
+		else {					/* Dynamic table */
+			if (((i / (SS(dp->fs) / SZ_DIRE)) & (dp->fs->csize - 1)) == 0) {	/* Cluster changed? */
+				clst = get_fat(dp->fs, dp->clust);				/* Get next cluster */
+				if (clst <= 1) return FR_INT_ERR;
+				if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
+				if (clst >= dp->fs->n_fatent) {					/* If it reached end of dynamic table, */
+#if !_FS_READONLY
+					if (!stretch) return FR_NO_FILE;			/* If do not stretch, report EOT */
+					clst = create_chain(dp->fs, dp->clust);		/* Stretch cluster chain */
+					if (clst == 0) return FR_DENIED;			/* No free cluster */
+					if (clst == 1) return FR_INT_ERR;
+					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
+					/* Clean-up stretched table */
+					if (sync_window(dp->fs)) return FR_DISK_ERR;/* Flush disk access window */
+					mem_set(dp->fs->win, 0, SS(dp->fs));		/* Clear window buffer */
+					dp->fs->winsect = clust2sect(dp->fs, clst);	/* Cluster start sector */
+#if _FS_WINCACHE
+					wc_drop(dp->fs, dp->fs->winsect, dp->fs->csize);
+#endif
+					for (c = 0; c < dp->fs->csize; c++) {		/* Fill the new cluster with 0 */
+						dp->fs->wflag = 1;
+						if (sync_window(dp->fs)) return FR_DISK_ERR;
+						dp->fs->winsect++;
+					}
+					dp->fs->winsect -= c;						/* Rewind window offset */
+#else
+					if (!stretch) return FR_NO_FILE;			/* If do not stretch, report EOT (this is to suppress warning) */
+					return FR_NO_FILE;							/* Report EOT */
+#endif
+				}
+				dp->clust = clst;				/* Initialize data for new cluster */
+				dp->sect = clust2sect(dp->fs, clst);
+			}
+		}
+	}
+
+	dp->index = (WORD)i;	/* Current index */
+	dp->dir = dp->fs->win + (i % (SS(dp->fs) / SZ_DIRE)) * SZ_DIRE;	/* Current entry in the window */
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Reserve directory entry                          */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY
+static
+FRESULT dir_alloc (
+		FDIR* dp,	/* Pointer to the directory object */
+		UINT nent	/* Number of contiguous entries to allocate (1-21) */
+		)
+{
+	FRESULT res;
+	UINT n;
+#if _FS_DIRINDEX
+	DIRIX *ix;
+#endif
+
+
+#if _FS_DIRINDEX
+	ix = di_get(dp->fs, dp->sclust);
+	if (ix && ix->flag != 1) ix = 0;
+	if (ix) {
+		di_sdi(dp, ix, di_hint(ix, nent));	/* Skip the entries known to be in use */
 		res = FR_OK;
-		while (clst < fs->n_fatent) {			/* Not a last link? */
-			nxt = get_fat(fs, clst);			/* Get cluster status */
-			if (nxt == 0) break;				/* Empty cluster? */
-			if (nxt == 1) { res = FR_INT_ERR; break; }	/* Internal error? */
-			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }	/* Disk error? */
-			res = put_fat(fs, clst, 0);			/* Mark the cluster "empty" */
+	} else {
+		res = dir_sdi(dp, 0);
+	}
+#else
+	res = dir_sdi(dp, 0);
+#endif
+	if (res == FR_OK) {
+		n = 0;
+		do {
+			res = move_window(dp->fs, dp->sect);
 			if (res != FR_OK) break;
-			if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
-				fs->free_clust++;
-				fs->fsi_flag |= 1;
-			}
-#if _USE_TRIM
-			if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
-				ecl = nxt;
-			} else {				/* End of contiguous clusters */
-				rt[0] = clust2sect(fs, scl);					/* Start sector */
-				rt[1] = clust2sect(fs, ecl) + fs->csize - 1;	/* End sector */
-				disk_ioctl(fs->drv, CTRL_TRIM, rt);				/* Erase the block */
-				scl = ecl = nxt;
+			if (dp->dir[0] == DDEM || dp->dir[0] == 0) {	/* Is it a free entry? */
+				if (++n == nent) break;	/* A block of contiguous free entries is found */
+			} else {
+				n = 0;					/* Not a blank entry. Restart to search */
 			}
+			res = dir_next(dp, 1);		/* Next entry with table stretch enabled */
+		} while (res == FR_OK);
+	}
+	if (res == FR_NO_FILE) res = FR_DENIED;	/* No directory entry to allocate */
+#if _FS_DIRINDEX
+	if (res == FR_OK && ix && dp->index >= ix->nent) {	/* The table has been stretched by a cluster */
+		n = SS(dp->fs) / SZ_DIRE * dp->fs->csize;
+		if (dp->index / n != ix->nclst || ix->nent + n > ix->cap) {
+			di_drop(dp->fs, dp->sclust);	/* Rebuilt on the next search */
+		} else {
+			DI_CLST(ix)[ix->nclst++] = dp->clust;
+			ix->nent += n;
+		}
+	}
 #endif
-			clst = nxt;	/* Next cluster */
+	return res;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Load/Store start cluster number                  */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD ld_clust (
+		FATFS* fs,	/* Pointer to the fs object */
+		BYTE* dir	/* Pointer to the directory entry */
+		)
+{
+	DWORD cl;
+
+	cl = LD_WORD(dir + DIR_FstClusLO);
+	if (fs->fs_type == FS_FAT32)
+		cl |= (DWORD)LD_WORD(dir + DIR_FstClusHI) << 16;
+
+	return cl;
+}
+
+
+#if !_FS_READONLY
+static
+void st_clust (
+		BYTE* dir,	/* Pointer to the directory entry */
+		DWORD cl	/* Value to be set */
+		)
+{
+	ST_WORD(dir + DIR_FstClusLO, cl);
+	ST_WORD(dir + DIR_FstClusHI, cl >> 16);
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* LFN handling - Test/Pick/Fit an LFN segment from/to directory entry   */
+/*-----------------------------------------------------------------------*/
+#if _USE_LFN
+static
+const BYTE LfnOfs[] = {1,3,5,7,9,14,16,18,20,22,24,28,30};	/* Offset of LFN characters in the directory entry */
+
+
+static
+int cmp_lfn (			/* 1:Matched, 0:Not matched */
+							WCHAR* lfnbuf,		/* Pointer to the LFN to be compared */
+							BYTE* dir			/* Pointer to the directory entry containing a part of LFN */
+							)
+{
+	UINT i, s;
+	WCHAR wc, uc;
+
+
+	i = ((dir[LDIR_Ord] & ~LLEF) - 1) * 13;	/* Get offset in the LFN buffer */
+	s = 0; wc = 1;
+	do {
+		uc = LD_WORD(dir + LfnOfs[s]);	/* Pick an LFN character from the entry */
+		if (wc) {	/* Last character has not been processed */
+			wc = ff_wtoupper(uc);		/* Convert it to upper case */
+			if (i >= _MAX_LFN || wc != ff_wtoupper(lfnbuf[i++]))	/* Compare it */
+				return 0;				/* Not matched */
+		} else {
+			if (uc != 0xFFFF) return 0;	/* Check filler */
+		}
+	} while (++s < 13);				/* Repeat until all characters in the entry are checked */
+
+	if ((dir[LDIR_Ord] & LLEF) && wc && lfnbuf[i])	/* Last segment matched but different length */
+		return 0;
+
+	return 1;						/* The part of LFN matched */
+}
+
+
+
+static
+int pick_lfn (			/* 1:Succeeded, 0:Buffer overflow */
+							WCHAR* lfnbuf,		/* Pointer to the Unicode-LFN buffer */
+							BYTE* dir			/* Pointer to the directory entry */
+							)
+{
+	UINT i, s;
+	WCHAR wc, uc;
+
+
+	i = ((dir[LDIR_Ord] & 0x3F) - 1) * 13;	/* Offset in the LFN buffer */
+
+	s = 0; wc = 1;
+	do {
+		uc = LD_WORD(dir + LfnOfs[s]);		/* Pick an LFN character from the entry */
+		if (wc) {	/* Last character has not been processed */
+			if (i >= _MAX_LFN) return 0;	/* Buffer overflow? */
+			lfnbuf[i++] = wc = uc;			/* Store it */
+		} else {
+			if (uc != 0xFFFF) return 0;		/* Check filler */
 		}
+	} while (++s < 13);						/* Read all character in the entry */
+
+	if (dir[LDIR_Ord] & LLEF) {				/* Put terminator if it is the last LFN part */
+		if (i >= _MAX_LFN) return 0;		/* Buffer overflow? */
+		lfnbuf[i] = 0;
 	}
 
-	return res;
+	return 1;
+}
+
+
+#if !_FS_READONLY
+static
+void fit_lfn (
+		const WCHAR* lfnbuf,	/* Pointer to the LFN buffer */
+		BYTE* dir,				/* Pointer to the directory entry */
+		BYTE ord,				/* LFN order (1-20) */
+		BYTE sum				/* SFN sum */
+		)
+{
+	UINT i, s;
+	WCHAR wc;
+
+
+	dir[LDIR_Chksum] = sum;			/* Set check sum */
+	dir[LDIR_Attr] = AM_LFN;		/* Set attribute. LFN entry */
+	dir[LDIR_Type] = 0;
+	ST_WORD(dir + LDIR_FstClusLO, 0);
+
+	i = (ord - 1) * 13;				/* Get offset in the LFN buffer */
+	s = wc = 0;
+	do {
+		if (wc != 0xFFFF) wc = lfnbuf[i++];	/* Get an effective character */
+		ST_WORD(dir+LfnOfs[s], wc);	/* Put it */
+		if (!wc) wc = 0xFFFF;		/* Padding characters following last character */
+	} while (++s < 13);
+	if (wc == 0xFFFF || !lfnbuf[i]) ord |= LLEF;	/* Bottom LFN part is the start of LFN sequence */
+	dir[LDIR_Ord] = ord;			/* Set the LFN order */
 }
+
+#endif
 #endif
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* FAT handling - Stretch or Create a cluster chain                      */
+/* Create numbered name                                                  */
 /*-----------------------------------------------------------------------*/
-#if !_FS_READONLY
+#if _USE_LFN
 static
-DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
-							FATFS* fs,			/* File system object */
-							DWORD clst			/* Cluster# to stretch. 0 means create a new chain. */
-							)
+void gen_numname (
+		BYTE* dst,			/* Pointer to the buffer to store numbered SFN */
+		const BYTE* src,	/* Pointer to SFN */
+		const WCHAR* lfn,	/* Pointer to LFN */
+		UINT seq			/* Sequence number */
+		)
 {
-	DWORD cs, ncl, scl;
-	FRESULT res;
+	BYTE ns[8], c;
+	UINT i, j;
+	WCHAR wc;
+	DWORD sr;
 
 
-	if (clst == 0) {		/* Create a new chain */
-		scl = fs->last_clust;			/* Get suggested start point */
-		if (!scl || scl >= fs->n_fatent) scl = 1;
-	}
-	else {					/* Stretch the current chain */
-		cs = get_fat(fs, clst);			/* Check the cluster status */
-		if (cs < 2) return 1;			/* Invalid value */
-		if (cs == 0xFFFFFFFF) return cs;	/* A disk error occurred */
-		if (cs < fs->n_fatent) return cs;	/* It is already followed by next cluster */
-		scl = clst;
-	}
+	mem_cpy(dst, src, 11);
 
-	ncl = scl;				/* Start cluster */
-	for (;;) {
-		ncl++;							/* Next cluster */
-		if (ncl >= fs->n_fatent) {		/* Check wrap around */
-			ncl = 2;
-			if (ncl > scl) return 0;	/* No free cluster */
+	if (seq > 5) {	/* On many collisions, generate a hash number instead of sequential number */
+		sr = seq;
+		while (*lfn) {	/* Create a CRC */
+			wc = *lfn++;
+			for (i = 0; i < 16; i++) {
+				sr = (sr << 1) + (wc & 1);
+				wc >>= 1;
+				if (sr & 0x10000) sr ^= 0x11021;
+			}
 		}
-		cs = get_fat(fs, ncl);			/* Get the cluster status */
-		if (cs == 0) break;				/* Found a free cluster */
-		if (cs == 0xFFFFFFFF || cs == 1)/* An error occurred */
-			return cs;
-		if (ncl == scl) return 0;		/* No free cluster */
+		seq = (UINT)sr;
 	}
 
-	res = put_fat(fs, ncl, 0x0FFFFFFF);	/* Mark the new cluster "last link" */
-	if (res == FR_OK && clst != 0) {
-		res = put_fat(fs, clst, ncl);	/* Link it to the previous one if needed */
-	}
-	if (res == FR_OK) {
-		fs->last_clust = ncl;			/* Update FSINFO */
-		if (fs->free_clust != 0xFFFFFFFF) {
-			fs->free_clust--;
-			fs->fsi_flag |= 1;
+	/* itoa (hexdecimal) */
+	i = 7;
+	do {
+		c = (seq % 16) + '0';
+		if (c > '9') c += 7;
+		ns[i--] = c;
+		seq /= 16;
+	} while (seq && i);		/* At most 7 digits so that ns[i] stays in the buffer */
+	ns[i] = '~';
+
+	/* Append the number */
+	for (j = 0; j < i && dst[j] != ' '; j++) {
+		if (IsDBCS1(dst[j])) {
+			if (j == i - 1) break;
+			j++;
 		}
-	} else {
-		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
 	}
-
-	return ncl;		/* Return new cluster number or error code */
+	do {
+		dst[j++] = (i < 8) ? ns[i++] : ' ';
+	} while (j < 8);
 }
-#endif /* !_FS_READONLY */
+#endif
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* FAT handling - Convert offset into cluster with link map table        */
+/* Calculate sum of an SFN                                               */
 /*-----------------------------------------------------------------------*/
-
-#if _USE_FASTSEEK
+#if _USE_LFN
 static
-DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
-							FIL* fp,		/* Pointer to the file object */
-							DWORD ofs		/* File offset to be converted to cluster# */
-							)
+BYTE sum_sfn (
+		const BYTE* dir		/* Pointer to the SFN entry */
+		)
 {
-	DWORD cl, ncl, *tbl;
-
+	BYTE sum = 0;
+	UINT n = 11;
 
-	tbl = fp->cltbl + 1;	/* Top of CLMT */
-	cl = ofs / SS(fp->fs) / fp->fs->csize;	/* Cluster order from top of the file */
-	for (;;) {
-		ncl = *tbl++;			/* Number of cluters in the fragment */
-		if (!ncl) return 0;		/* End of table? (error) */
-		if (cl < ncl) break;	/* In this fragment? */
-		cl -= ncl; tbl++;		/* Next fragment */
-	}
-	return cl + *tbl;	/* Return the cluster number */
+	do sum = (sum >> 1) + (sum << 7) + *dir++; while (--n);
+	return sum;
 }
-#endif	/* _USE_FASTSEEK */
+#endif
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* Directory handling - Set directory index                              */
+/* Directory handling - Directory entry cache                            */
 /*-----------------------------------------------------------------------*/
+/* A slot remembers where a name was found in a directory. A name can be held
+/  in any of DC_WAYS slots following its hash position, the least recently used
+/  one is replaced. Slots are dropped when their entry is removed (dir_remove(),
+/  also used by f_rename()), and are checked against the SFN of the entry
+/  whenever the entry itself is loaded. A name that was not found is remembered
+/  as well (DC_NOENT) until any name is registered in its directory
+/  (dir_register()), since the new entry may also carry an SFN alias matching
+/  it. Dot entries are never cached since f_rename() rewrites ".." in place. */
+#if _FS_DCACHE
+#if _USE_LFN && (_FS_DCNAME < 1 || _FS_DCNAME > _MAX_LFN)
+#error Wrong _FS_DCNAME setting
+#endif
+#define DC_WAYS	(_FS_DCACHE < 4 ? _FS_DCACHE : 4)	/* Slots a name can be held in */
+#define DC_NOENT	0xFFFFFFFF	/* DCENT.sect of a name that does not exist */
 
 static
-FRESULT dir_sdi (
-		FDIR* dp,		/* Pointer to directory object */
-		UINT idx		/* Index of directory table */
+void dc_reset (	/* Discard all cache slots */
+		FATFS* fs		/* File system object */
 		)
 {
-	DWORD clst, sect;
-	UINT ic;
-
-
-	dp->index = (WORD)idx;	/* Current index */
-	clst = dp->sclust;		/* Table start cluster (0:root) */
-	if (clst == 1 || clst >= dp->fs->n_fatent)	/* Check start cluster range */
-		return FR_INT_ERR;
-	if (!clst && dp->fs->fs_type == FS_FAT32)	/* Replace cluster# 0 with root cluster# if in FAT32 */
-		clst = dp->fs->dirbase;
+	UINT i;
 
-	if (clst == 0) {	/* Static table (root-directory in FAT12/16) */
-		if (idx >= dp->fs->n_rootdir)	/* Is index out of range? */
-			return FR_INT_ERR;
-		sect = dp->fs->dirbase;
-	}
-	else {				/* Dynamic table (root-directory in FAT32 or sub-directory) */
-		ic = SS(dp->fs) / SZ_DIRE * dp->fs->csize;	/* Entries per cluster */
-		while (idx >= ic) {	/* Follow cluster chain */
-			clst = get_fat(dp->fs, clst);				/* Get next cluster */
-			if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
-			if (clst < 2 || clst >= dp->fs->n_fatent)	/* Reached to end of table or internal error */
-				return FR_INT_ERR;
-			idx -= ic;
-		}
-		sect = clust2sect(dp->fs, clst);
-	}
-	dp->clust = clst;	/* Current cluster# */
-	if (!sect) return FR_INT_ERR;
-	dp->sect = sect + idx / (SS(dp->fs) / SZ_DIRE);					/* Sector# of the directory entry */
-	dp->dir = dp->fs->win + (idx % (SS(dp->fs) / SZ_DIRE)) * SZ_DIRE;	/* Ptr to the entry in the sector */
 
-	return FR_OK;
+	if (!fs->dcache) return;
+	for (i = 0; i < _FS_DCACHE; i++) fs->dcache[i].sect = 0;
 }
 
 
+static
+int dc_hash (	/* 1:Name can be cached, 0:It cannot */
+		FDIR* dp,		/* Directory object with the name created by create_name() */
+		UINT* pos		/* First slot to look at for the name */
+		)
+{
+	DWORD h;
+	UINT i;
+
 
+	if (!dp->fs->dcache || (dp->fn[NSFLAG] & NS_DOT)) return 0;
+	h = dp->sclust;
+#if _USE_LFN
+	if (!dp->lfn) return 0;					/* SFN only search (numbered name collision check) */
+	for (i = 0; dp->lfn[i]; i++) {
+		if (i >= _FS_DCNAME) return 0;		/* Too long to be cached */
+		h = h * 31 + ff_wtoupper(dp->lfn[i]);
+	}
+#else
+	for (i = 0; i < 11; i++) h = h * 31 + dp->fn[i];
+#endif
+	h ^= h >> 15; h *= 0x2C1B3C6D; h ^= h >> 12;	/* Mix all bits into the low ones */
+	*pos = (UINT)(h % _FS_DCACHE);
+	return 1;
+}
 
-/*-----------------------------------------------------------------------*/
-/* Directory handling - Move directory table index next                  */
-/*-----------------------------------------------------------------------*/
 
 static
-FRESULT dir_next (	/* FR_OK:Succeeded, FR_NO_FILE:End of table, FR_DENIED:Could not stretch */
-							FDIR* dp,		/* Pointer to the directory object */
-							int stretch		/* 0: Do not stretch table, 1: Stretch table if needed */
-							)
+DCENT* dc_lookup (	/* Slot holding the name, NULL:Not cached */
+		FDIR* dp,		/* Directory object with the name */
+		UINT pos		/* Position returned by dc_hash() */
+		)
 {
-	DWORD clst;
+	DCENT *dc;
+	UINT n;
+#if _USE_LFN
 	UINT i;
-#if !_FS_READONLY
-	UINT c;
+	WCHAR w;
 #endif
 
 
-	i = dp->index + 1;
-	if (!(i & 0xFFFF) || !dp->sect)	/* Report EOT when index has reached 65535 */
-		return FR_NO_FILE;
-
-	if (!(i % (SS(dp->fs) / SZ_DIRE))) {	/* Sector changed? */
-		dp->sect++;					/* Next sector */
-
-		if (!dp->clust) {		/* Static table */
-			if (i >= dp->fs->n_rootdir)	/* Report EOT if it reached end of static table */
-				return FR_NO_FILE;
+	for (n = 0; n < DC_WAYS; n++, pos = (pos + 1) % _FS_DCACHE) {
+		dc = &dp->fs->dcache[pos];
+		if (!dc->sect || dc->pclust != dp->sclust) continue;
+#if _USE_LFN
+		for (i = 0; i < _FS_DCNAME; i++) {	/* The name is not longer than _FS_DCNAME (see dc_hash()) */
+			w = ff_wtoupper(dp->lfn[i]);
+			if (dc->name[i] != w || !w) break;
 		}
-		else {					/* Dynamic table */
-			if (((i / (SS(dp->fs) / SZ_DIRE)) & (dp->fs->csize - 1)) == 0) {	/* Cluster changed? */
-				clst = get_fat(dp->fs, dp->clust);				/* Get next cluster */
-				if (clst <= 1) return FR_INT_ERR;
-				if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
-				if (clst >= dp->fs->n_fatent) {					/* If it reached end of dynamic table, */
-#if !_FS_READONLY
-					if (!stretch) return FR_NO_FILE;			/* If do not stretch, report EOT */
-					clst = create_chain(dp->fs, dp->clust);		/* Stretch cluster chain */
-					if (clst == 0) return FR_DENIED;			/* No free cluster */
-					if (clst == 1) return FR_INT_ERR;
-					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
-					/* Clean-up stretched table */
-					if (sync_window(dp->fs)) return FR_DISK_ERR;/* Flush disk access window */
-					mem_set(dp->fs->win, 0, SS(dp->fs));		/* Clear window buffer */
-					dp->fs->winsect = clust2sect(dp->fs, clst);	/* Cluster start sector */
-					for (c = 0; c < dp->fs->csize; c++) {		/* Fill the new cluster with 0 */
-						dp->fs->wflag = 1;
-						if (sync_window(dp->fs)) return FR_DISK_ERR;
-						dp->fs->winsect++;
-					}
-					dp->fs->winsect -= c;						/* Rewind window offset */
+		if (i < _FS_DCNAME && dc->name[i] != w) continue;
 #else
-					if (!stretch) return FR_NO_FILE;			/* If do not stretch, report EOT (this is to suppress warning) */
-					return FR_NO_FILE;							/* Report EOT */
+		if (mem_cmp(dc->sfn, dp->fn, 11)) continue;
 #endif
-				}
-				dp->clust = clst;				/* Initialize data for new cluster */
-				dp->sect = clust2sect(dp->fs, clst);
-			}
-		}
+		dc->age = ++dp->fs->dcclk;
+		return dc;
 	}
-
-	dp->index = (WORD)i;	/* Current index */
-	dp->dir = dp->fs->win + (i % (SS(dp->fs) / SZ_DIRE)) * SZ_DIRE;	/* Current entry in the window */
-
-	return FR_OK;
+	return 0;
 }
 
 
+static
+void dc_store (
+		FDIR* dp,		/* Directory object pointing the found entry */
+		UINT pos,		/* Position returned by dc_hash() */
+		int found		/* 1:Entry found, 0:Name does not exist in the directory */
+		)
+{
+	DCENT *dc, *lru;
+	UINT n;
+#if _USE_LFN
+	UINT i;
+	WCHAR w = 1;
+#endif
+
 
+	lru = &dp->fs->dcache[pos];
+	for (n = 0; n < DC_WAYS; n++, pos = (pos + 1) % _FS_DCACHE) {	/* Take a free or the least recently used slot */
+		dc = &dp->fs->dcache[pos];
+		if (!dc->sect) { lru = dc; break; }
+		if (dp->fs->dcclk - dc->age > dp->fs->dcclk - lru->age) lru = dc;
+	}
+	dc = lru;
+#if _USE_LFN
+	for (i = 0; i < _FS_DCNAME; i++) {	/* Up-cased name, zero padded */
+		if (w) w = ff_wtoupper(dp->lfn[i]);
+		dc->name[i] = w;
+	}
+	dc->lfn_idx = dp->lfn_idx;
+#else
+	dc->lfn_idx = 0xFFFF;
+#endif
+	dc->pclust = dp->sclust;
+	dc->age = ++dp->fs->dcclk;
+	if (!found) {
+		mem_cpy(dc->sfn, dp->fn, 11);	/* Name key of non-LFN configuration */
+		dc->index = 0xFFFF;		/* Not matched by dc_drop() */
+		dc->sect = DC_NOENT;
+		return;
+	}
+	mem_cpy(dc->sfn, dp->dir, 11);
+	dc->attr = dp->dir[DIR_Attr];
+	dc->sclust = ld_clust(dp->fs, dp->dir);
+	dc->clust = dp->clust;
+	dc->index = dp->index;
+	dc->sect = dp->sect;
+}
 
-/*-----------------------------------------------------------------------*/
-/* Directory handling - Reserve directory entry                          */
-/*-----------------------------------------------------------------------*/
 
-#if !_FS_READONLY
 static
-FRESULT dir_alloc (
-		FDIR* dp,	/* Pointer to the directory object */
-		UINT nent	/* Number of contiguous entries to allocate (1-21) */
+FRESULT dc_load (	/* FR_OK:Entry loaded, FR_NO_FILE:Stale slot (dropped), FR_DISK_ERR:Disk error */
+		DCENT* dc,		/* Slot found by dc_lookup() */
+		FDIR* dp		/* Directory object to be pointed to the entry */
 		)
 {
 	FRESULT res;
-	UINT n;
 
 
-	res = dir_sdi(dp, 0);
-	if (res == FR_OK) {
-		n = 0;
-		do {
-			res = move_window(dp->fs, dp->sect);
-			if (res != FR_OK) break;
-			if (dp->dir[0] == DDEM || dp->dir[0] == 0) {	/* Is it a free entry? */
-				if (++n == nent) break;	/* A block of contiguous free entries is found */
-			} else {
-				n = 0;					/* Not a blank entry. Restart to search */
-			}
-			res = dir_next(dp, 1);		/* Next entry with table stretch enabled */
-		} while (res == FR_OK);
+	res = move_window(dp->fs, dc->sect);
+	if (res != FR_OK) return res;
+	dp->index = dc->index;
+	dp->clust = dc->clust;
+	dp->sect = dc->sect;
+	dp->dir = dp->fs->win + (dc->index % (SS(dp->fs) / SZ_DIRE)) * SZ_DIRE;
+#if _USE_LFN
+	dp->lfn_idx = dc->lfn_idx;
+#endif
+	if (mem_cmp(dp->dir, dc->sfn, 11)) {	/* The entry has been changed behind the cache */
+		dc->sect = 0;
+		return FR_NO_FILE;
 	}
-	if (res == FR_NO_FILE) res = FR_DENIED;	/* No directory entry to allocate */
-	return res;
+	dp->fs->n_dchit++;
+	return FR_OK;
 }
-#endif
 
 
+static
+int dc_enter (	/* 1:Moved into the cached sub-directory, 0:Not cached (use dir_find()) */
+		FDIR* dp		/* Directory object with the name of a path segment */
+		)
+{
+	DCENT *dc;
+	UINT pos;
+
 
+	if (!dc_hash(dp, &pos)) return 0;
+	dc = dc_lookup(dp, pos);
+	if (!dc || dc->sect == DC_NOENT || !(dc->attr & AM_DIR)) return 0;
+	dp->sclust = dc->sclust;		/* The start cluster of a directory never changes */
+	dp->fs->n_dchit++;
+	return 1;
+}
 
-/*-----------------------------------------------------------------------*/
-/* Directory handling - Load/Store start cluster number                  */
-/*-----------------------------------------------------------------------*/
 
+#if !_FS_READONLY
 static
-DWORD ld_clust (
-		FATFS* fs,	/* Pointer to the fs object */
-		BYTE* dir	/* Pointer to the directory entry */
+void dc_added (	/* Drop the names remembered as not existing in a directory */
+		FATFS* fs,		/* File system object */
+		DWORD pclust	/* Start cluster of the directory an entry was registered in */
 		)
 {
-	DWORD cl;
+	UINT i;
 
-	cl = LD_WORD(dir + DIR_FstClusLO);
-	if (fs->fs_type == FS_FAT32)
-		cl |= (DWORD)LD_WORD(dir + DIR_FstClusHI) << 16;
 
-	return cl;
+	if (!fs->dcache) return;
+	for (i = 0; i < _FS_DCACHE; i++) {
+		if (fs->dcache[i].sect == DC_NOENT && fs->dcache[i].pclust == pclust)
+			fs->dcache[i].sect = 0;
+	}
 }
+#endif
 
 
-#if !_FS_READONLY
+#if !_FS_READONLY && !_FS_MINIMIZE
 static
-void st_clust (
-		BYTE* dir,	/* Pointer to the directory entry */
-		DWORD cl	/* Value to be set */
+void dc_drop (	/* Drop the slot of a removed entry */
+		FATFS* fs,		/* File system object */
+		DWORD pclust,	/* Start cluster of the parent directory */
+		UINT idx		/* Index of the SFN entry */
 		)
 {
-	ST_WORD(dir + DIR_FstClusLO, cl);
-	ST_WORD(dir + DIR_FstClusHI, cl >> 16);
+	UINT i;
+
+
+	if (!fs->dcache) return;
+	for (i = 0; i < _FS_DCACHE; i++) {
+		if (fs->dcache[i].pclust == pclust && fs->dcache[i].index == idx)
+			fs->dcache[i].sect = 0;
+	}
 }
 #endif
+#endif	/* _FS_DCACHE */
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* LFN handling - Test/Pick/Fit an LFN segment from/to directory entry   */
+/* Directory handling - Scan the directory for an object                 */
 /*-----------------------------------------------------------------------*/
-#if _USE_LFN
-static
-const BYTE LfnOfs[] = {1,3,5,7,9,14,16,18,20,22,24,28,30};	/* Offset of LFN characters in the directory entry */
-
 
 static
-int cmp_lfn (			/* 1:Matched, 0:Not matched */
-							WCHAR* lfnbuf,		/* Pointer to the LFN to be compared */
-							BYTE* dir			/* Pointer to the directory entry containing a part of LFN */
-							)
+FRESULT dir_scan (	/* FR_OK:Found, FR_NO_FILE:Not found in the range */
+		FDIR* dp,			/* Directory object with the name, set to the index to start from */
+		UINT end			/* Last index to look at (0xFFFF:End of the table) */
+		)
 {
-	UINT i, s;
-	WCHAR wc, uc;
-
+	FRESULT res;
+	BYTE c, *dir;
+#if _USE_LFN
+	BYTE a, ord, sum;
+#endif
 
-	i = ((dir[LDIR_Ord] & ~LLEF) - 1) * 13;	/* Get offset in the LFN buffer */
-	s = 0; wc = 1;
+#if _USE_LFN
+	ord = sum = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
+#endif
 	do {
-		uc = LD_WORD(dir + LfnOfs[s]);	/* Pick an LFN character from the entry */
-		if (wc) {	/* Last character has not been processed */
-			wc = ff_wtoupper(uc);		/* Convert it to upper case */
-			if (i >= _MAX_LFN || wc != ff_wtoupper(lfnbuf[i++]))	/* Compare it */
-				return 0;				/* Not matched */
+		res = move_window(dp->fs, dp->sect);
+		if (res != FR_OK) break;
+		dir = dp->dir;					/* Ptr to the directory entry of current index */
+		c = dir[DIR_Name];
+		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
+#if _USE_LFN	/* LFN configuration */
+		a = dir[DIR_Attr] & AM_MASK;
+		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
+			ord = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
 		} else {
-			if (uc != 0xFFFF) return 0;	/* Check filler */
+			if (a == AM_LFN) {			/* An LFN entry is found */
+				if (dp->lfn) {
+					if (c & LLEF) {		/* Is it start of LFN sequence? */
+						sum = dir[LDIR_Chksum];
+						c &= ~LLEF; ord = c;	/* LFN start order */
+						dp->lfn_idx = dp->index;	/* Start index of LFN */
+					}
+					/* Check validity of the LFN entry and compare it with given name */
+					ord = (c == ord && sum == dir[LDIR_Chksum] && cmp_lfn(dp->lfn, dir)) ? ord - 1 : 0xFF;
+				}
+			} else {					/* An SFN entry is found */
+				if (!ord && sum == sum_sfn(dir)) break;	/* LFN matched? */
+				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dir, dp->fn, 11)) break;	/* SFN matched? */
+				ord = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
+			}
 		}
-	} while (++s < 13);				/* Repeat until all characters in the entry are checked */
-
-	if ((dir[LDIR_Ord] & LLEF) && wc && lfnbuf[i])	/* Last segment matched but different length */
-		return 0;
+#else		/* Non LFN configuration */
+		if (!(dir[DIR_Attr] & AM_VOL) && !mem_cmp(dir, dp->fn, 11)) /* Is it a valid entry? */
+			break;
+#endif
+		if (dp->index >= end) { res = FR_NO_FILE; break; }	/* End of the range */
+		res = dir_next(dp, 0);		/* Next entry */
+	} while (res == FR_OK);
 
-	return 1;						/* The part of LFN matched */
+	return res;
 }
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Directory index - Build and search                                    */
+/*-----------------------------------------------------------------------*/
+#if _FS_DIRINDEX
+#define DI_P	0x01000193	/* Multiplier of the name hash */
+
 static
-int pick_lfn (			/* 1:Succeeded, 0:Buffer overflow */
-							WCHAR* lfnbuf,		/* Pointer to the Unicode-LFN buffer */
-							BYTE* dir			/* Pointer to the directory entry */
-							)
+DWORD di_hash_sfn (	/* Hash of an SFN */
+		const BYTE* fn		/* SFN {file[8],ext[3]} */
+		)
 {
-	UINT i, s;
-	WCHAR wc, uc;
+	DWORD h = 0x9E3779B9;	/* SFN hashes start apart from LFN hashes */
+	UINT i;
 
 
-	i = ((dir[LDIR_Ord] & 0x3F) - 1) * 13;	/* Offset in the LFN buffer */
+	for (i = 0; i < 11; i++) h = h * DI_P + fn[i];
+	return h;
+}
 
-	s = 0; wc = 1;
-	do {
-		uc = LD_WORD(dir + LfnOfs[s]);		/* Pick an LFN character from the entry */
-		if (wc) {	/* Last character has not been processed */
-			if (i >= _MAX_LFN) return 0;	/* Buffer overflow? */
-			lfnbuf[i++] = wc = uc;			/* Store it */
-		} else {
-			if (uc != 0xFFFF) return 0;		/* Check filler */
-		}
-	} while (++s < 13);						/* Read all character in the entry */
 
-	if (dir[LDIR_Ord] & LLEF) {				/* Put terminator if it is the last LFN part */
-		if (i >= _MAX_LFN) return 0;		/* Buffer overflow? */
-		lfnbuf[i] = 0;
-	}
+#if _USE_LFN
+static
+DWORD di_hash_lfn (	/* Hash of an LFN, sum of up-cased character * DI_P^position */
+		const WCHAR* lfn	/* LFN */
+		)
+{
+	DWORD h = 0, pw = 1;
+	UINT i;
 
-	return 1;
+
+	for (i = 0; lfn[i]; i++, pw *= DI_P) h += ff_wtoupper(lfn[i]) * pw;
+	return h;
 }
 
 
-#if !_FS_READONLY
 static
-void fit_lfn (
-		const WCHAR* lfnbuf,	/* Pointer to the LFN buffer */
-		BYTE* dir,				/* Pointer to the directory entry */
-		BYTE ord,				/* LFN order (1-20) */
-		BYTE sum				/* SFN sum */
+DWORD di_hash_part (	/* Part of di_hash_lfn() contributed by an LFN entry */
+		const BYTE* dir		/* LFN entry */
 		)
 {
-	UINT i, s;
-	WCHAR wc;
-
+	DWORD h = 0, pw = 1;
+	UINT i;
+	WCHAR uc;
 
-	dir[LDIR_Chksum] = sum;			/* Set check sum */
-	dir[LDIR_Attr] = AM_LFN;		/* Set attribute. LFN entry */
-	dir[LDIR_Type] = 0;
-	ST_WORD(dir + LDIR_FstClusLO, 0);
 
-	i = (ord - 1) * 13;				/* Get offset in the LFN buffer */
-	s = wc = 0;
-	do {
-		if (wc != 0xFFFF) wc = lfnbuf[i++];	/* Get an effective character */
-		ST_WORD(dir+LfnOfs[s], wc);	/* Put it */
-		if (!wc) wc = 0xFFFF;		/* Padding characters following last character */
-	} while (++s < 13);
-	if (wc == 0xFFFF || !lfnbuf[i]) ord |= LLEF;	/* Bottom LFN part is the start of LFN sequence */
-	dir[LDIR_Ord] = ord;			/* Set the LFN order */
+	for (i = ((dir[LDIR_Ord] & ~LLEF) - 1) * 13; i; i--) pw *= DI_P;	/* Position of the first character */
+	for (i = 0; i < 13; i++, pw *= DI_P) {
+		uc = LD_WORD(dir + LfnOfs[i]);
+		if (!uc) break;
+		h += ff_wtoupper(uc) * pw;
+	}
+	return h;
 }
-
-#endif
 #endif
 
 
-
-
-/*-----------------------------------------------------------------------*/
-/* Create numbered name                                                  */
-/*-----------------------------------------------------------------------*/
-#if _USE_LFN
 static
-void gen_numname (
-		BYTE* dst,			/* Pointer to the buffer to store numbered SFN */
-		const BYTE* src,	/* Pointer to SFN */
-		const WCHAR* lfn,	/* Pointer to LFN */
-		UINT seq			/* Sequence number */
+void di_build (	/* Build the index of a directory if it fits */
+		FDIR* dp		/* Directory object (sclust is the directory to be indexed) */
 		)
 {
-	BYTE ns[8], c;
-	UINT i, j;
-	WCHAR wc;
-	DWORD sr;
+	FATFS *fs = dp->fs;
+	FDIR dj;
+	DIRIX *ix;
+	DWORD clst, *map;
+	UINT i, n, nc, ic, cap, nslot, sz, top;
+	BYTE c, a, *dir;
+#if _USE_LFN
+	BYTE ord = 0xFF, sum = 0xFF;
+	DWORD h = 0;
+#endif
 
 
-	mem_cpy(dst, src, 11);
+	if (!fs->dixbuf) return;	/* No arena for the indexes */
+	ix = &fs->dix[0];			/* Take an unused or the least recently used index */
+	for (i = 0; i < _FS_DIRINDEX; i++) {
+		if (!fs->dix[i].flag) { ix = &fs->dix[i]; break; }
+		if (fs->dixclk - fs->dix[i].age > fs->dixclk - ix->age) ix = &fs->dix[i];
+	}
+	if (ix->flag) di_drop(fs, ix->sclust);
+	ix->sclust = dp->sclust;
+	ix->age = ++fs->dixclk;
+	ix->flag = 2;				/* Not indexable unless completed below */
+
+	ic = SS(fs) / SZ_DIRE * fs->csize;	/* Entries per cluster */
+	clst = dp->sclust;			/* Count the entries in the table */
+	if (!clst && fs->fs_type == FS_FAT32) clst = fs->dirbase;
+	nc = 0;
+	if (!clst) {
+		n = fs->n_rootdir;
+	} else {
+		do {
+			nc++;
+			clst = get_fat(fs, clst);
+			if (clst < 2 || clst == 0xFFFFFFFF) return;
+		} while (clst < fs->n_fatent && nc * ic < 0xFFFF);
+		n = nc * ic;
+	}
+	cap = n + n / 8 + ic;		/* Room for the table to grow */
+	if (cap > 0xFFFF) cap = 0xFFFF;
+	nslot = cap + cap / 4;		/* There are no more names than entries */
+	sz = (nslot + (cap + 31) / 32 + (nc ? (cap + ic - 1) / ic : 0)) * 4;
+	if (sz > _FS_DIRIXMAX) return;
+	map = fs->dixbuf + (UINT)(ix - fs->dix) * (_FS_DIRIXMAX / 4);	/* Arena of this index */
+	mem_set(map, 0xFF, sz);		/* All slots empty, all entries free */
+	ix->map = map; ix->nslot = nslot; ix->nent = n; ix->cap = cap; ix->nclst = nc;
+	clst = dp->sclust;			/* Record the clusters of the table */
+	if (!clst && fs->fs_type == FS_FAT32) clst = fs->dirbase;
+	for (i = 0; i < nc; i++) {
+		DI_CLST(ix)[i] = clst;
+		clst = get_fat(fs, clst);
+	}
 
-	if (seq > 5) {	/* On many collisions, generate a hash number instead of sequential number */
-		sr = seq;
-		while (*lfn) {	/* Create a CRC */
-			wc = *lfn++;
-			for (i = 0; i < 16; i++) {
-				sr = (sr << 1) + (wc & 1);
-				wc >>= 1;
-				if (sr & 0x10000) sr ^= 0x11021;
+	mem_cpy(&dj, dp, sizeof (FDIR));
+	di_sdi(&dj, ix, 0);
+	top = 0xFFFF;
+	for (;;) {
+		if (move_window(fs, dj.sect) != FR_OK) { c = 1; break; }
+		dir = dj.dir;
+		c = dir[DIR_Name];
+		if (c == 0) break;					/* End of table, the rest is free */
+		a = dir[DIR_Attr] & AM_MASK;
+		if (c != DDEM) di_set_free(ix, dj.index, 1, 0);
+		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without a name */
+			top = 0xFFFF;
+#if _USE_LFN
+			ord = 0xFF;
+#endif
+		} else if (a == AM_LFN) {			/* Follow the LFN sequence as dir_scan() does */
+#if _USE_LFN
+			if (c & LLEF) {
+				sum = dir[LDIR_Chksum];
+				c &= ~LLEF; ord = c; h = 0;
+				top = dj.index;
+			}
+			if (c == ord && sum == dir[LDIR_Chksum]) {
+				h += di_hash_part(dir);
+				ord--;
+			} else {
+				ord = 0xFF;
 			}
+#endif
+		} else {							/* An SFN entry */
+			n = (top == 0xFFFF) ? 0 : dj.index - top;	/* dir_scan() has to start at the top of the LFN */
+			if (n > 31 || !di_put(ix, di_hash_sfn(dir), dj.index, n)) break;
+#if _USE_LFN
+			if (!ord && sum == sum_sfn(dir) && !di_put(ix, h, dj.index, n)) break;
+			ord = 0xFF;
+#endif
+			top = 0xFFFF;
 		}
-		seq = (UINT)sr;
+		if (dir_next(&dj, 0) != FR_OK) {	/* End of table */
+			c = 0; break;
+		}
+	}
+	if (c) {					/* The scan failed, keep the directory from being indexed again */
+		ix->map = 0;
+	} else {
+		ix->flag = 1;
 	}
+}
 
-	/* itoa (hexdecimal) */
-	i = 7;
-	do {
-		c = (seq % 16) + '0';
-		if (c > '9') c += 7;
-		ns[i--] = c;
-		seq /= 16;
-	} while (seq);
-	ns[i] = '~';
 
-	/* Append the number */
-	for (j = 0; j < i && dst[j] != ' '; j++) {
-		if (IsDBCS1(dst[j])) {
-			if (j == i - 1) break;
-			j++;
+static
+FRESULT di_probe (	/* FR_OK:Found, FR_NO_FILE:No object with the hash */
+		FDIR* dp,		/* Directory object with the name */
+		DIRIX* ix,		/* Index of the directory */
+		DWORD hash		/* Hash of the name */
+		)
+{
+	FRESULT res;
+	DWORD v;
+	UINT pos, n, idx;
+
+
+	hash ^= hash >> 15; hash *= 0x2C1B3C6D; hash ^= hash >> 12;
+	pos = (UINT)(hash % ix->nslot);
+	for (n = 0; n < ix->nslot; n++) {
+		v = ix->map[pos];
+		if (v == DI_EMPTY) break;
+		if (v != DI_DELETED && (v & 0xFFE00000) == (hash & 0xFFE00000)) {	/* Candidate, check the entries */
+			idx = (UINT)(v & 0xFFFF);
+			di_sdi(dp, ix, idx - (UINT)((v >> 16) & 0x1F));	/* Top of the LFN entries of the object */
+			res = dir_scan(dp, idx);
+			if (res != FR_NO_FILE) return res;
 		}
+		if (++pos == ix->nslot) pos = 0;
 	}
-	do {
-		dst[j++] = (i < 8) ? ns[i++] : ' ';
-	} while (j < 8);
+	return FR_NO_FILE;
 }
+
+
+static
+FRESULT di_find (	/* FR_OK:Found, FR_NO_FILE:Not in the directory */
+		FDIR* dp,		/* Directory object with the name */
+		DIRIX* ix		/* Index of the directory */
+		)
+{
+	FRESULT res = FR_NO_FILE;
+
+
+#if _USE_LFN
+	if (dp->lfn) res = di_probe(dp, ix, di_hash_lfn(dp->lfn));
 #endif
+	if (res == FR_NO_FILE && !(dp->fn[NSFLAG] & NS_LOSS))
+		res = di_probe(dp, ix, di_hash_sfn(dp->fn));
+	return res;
+}
 
 
+#if !_FS_READONLY
+static
+void di_added (	/* Add a registered object to the index of its directory */
+		FDIR* dp		/* Directory object pointing the new SFN entry */
+		)
+{
+	DIRIX *ix;
+	UINT n = 0;
 
 
-/*-----------------------------------------------------------------------*/
-/* Calculate sum of an SFN                                               */
-/*-----------------------------------------------------------------------*/
+	ix = di_get(dp->fs, dp->sclust);
+	if (!ix || ix->flag != 1) return;
 #if _USE_LFN
+	if (dp->fn[NSFLAG] & NS_LFN) {		/* LFN entries in front of the SFN (see dir_register()) */
+		for (n = 0; dp->lfn[n]; n++) ;
+		n = (n + 12) / 13;
+	}
+#endif
+	di_set_free(ix, dp->index - n, n + 1, 0);
+	if (!di_put(ix, di_hash_sfn(dp->dir), dp->index, n)
+#if _USE_LFN
+		|| (n && !di_put(ix, di_hash_lfn(dp->lfn), dp->index, n))
+#endif
+		) {
+		di_drop(dp->fs, dp->sclust);
+	}
+}
+
+
+#if !_FS_MINIMIZE
 static
-BYTE sum_sfn (
-		const BYTE* dir		/* Pointer to the SFN entry */
+void di_removed (	/* Remove an object from the index of its directory */
+		FATFS* fs,		/* File system object */
+		DWORD sclust,	/* Start cluster of the directory */
+		UINT top,		/* Index of the first entry of the object */
+		UINT idx		/* Index of the SFN entry */
 		)
 {
-	BYTE sum = 0;
-	UINT n = 11;
+	DIRIX *ix;
+	UINT i;
 
-	do sum = (sum >> 1) + (sum << 7) + *dir++; while (--n);
-	return sum;
+
+	ix = di_get(fs, sclust);
+	if (!ix || ix->flag != 1) return;
+	di_set_free(ix, top, idx - top + 1, 1);
+	for (i = 0; i < ix->nslot; i++) {
+		if (ix->map[i] < DI_DELETED && (ix->map[i] & 0xFFFF) == idx) ix->map[i] = DI_DELETED;
+	}
 }
 #endif
+#endif
+#endif	/* _FS_DIRINDEX */
 
 
 
@@ -1414,51 +3007,51 @@ FRESULT dir_find (
 		)
 {
 	FRESULT res;
-	BYTE c, *dir;
-#if _USE_LFN
-	BYTE a, ord, sum;
+#if _FS_DCACHE
+	DCENT *dc;
+	UINT pos;
+	int cache;
+#endif
+#if _FS_DIRINDEX
+	DIRIX *ix;
+#endif
+
+#if _FS_DCACHE
+	cache = dc_hash(dp, &pos);
+	if (cache) {
+		dc = dc_lookup(dp, pos);
+		if (dc && dc->sect == DC_NOENT) {	/* Known not to exist */
+			dp->fs->n_dchit++;
+			return FR_NO_FILE;
+		}
+		if (dc) {					/* Go straight to the entry if the name is in the cache */
+			res = dc_load(dc, dp);
+			if (res != FR_NO_FILE) return res;
+		}
+		dp->fs->n_dcmiss++;
+	}
 #endif
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
-
-#if _USE_LFN
-	ord = sum = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
-#endif
-	do {
-		res = move_window(dp->fs, dp->sect);
-		if (res != FR_OK) break;
-		dir = dp->dir;					/* Ptr to the directory entry of current index */
-		c = dir[DIR_Name];
-		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
-#if _USE_LFN	/* LFN configuration */
-		a = dir[DIR_Attr] & AM_MASK;
-		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
-			ord = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
-		} else {
-			if (a == AM_LFN) {			/* An LFN entry is found */
-				if (dp->lfn) {
-					if (c & LLEF) {		/* Is it start of LFN sequence? */
-						sum = dir[LDIR_Chksum];
-						c &= ~LLEF; ord = c;	/* LFN start order */
-						dp->lfn_idx = dp->index;	/* Start index of LFN */
-					}
-					/* Check validity of the LFN entry and compare it with given name */
-					ord = (c == ord && sum == dir[LDIR_Chksum] && cmp_lfn(dp->lfn, dir)) ? ord - 1 : 0xFF;
-				}
-			} else {					/* An SFN entry is found */
-				if (!ord && sum == sum_sfn(dir)) break;	/* LFN matched? */
-				if (!(dp->fn[NSFLAG] & NS_LOSS) && !mem_cmp(dir, dp->fn, 11)) break;	/* SFN matched? */
-				ord = 0xFF; dp->lfn_idx = 0xFFFF;	/* Reset LFN sequence */
-			}
+#if _FS_DIRINDEX
+	ix = di_get(dp->fs, dp->sclust);
+	if (ix && ix->flag == 1) {		/* Look at the entries with the name hash only */
+		res = di_find(dp, ix);
+	} else {
+		res = dir_sdi(dp, 0);			/* Rewind directory object */
+		if (res == FR_OK) res = dir_scan(dp, 0xFFFF);
+		if (!ix && (res == FR_OK || res == FR_NO_FILE) && dp->index >= DI_MIN) {	/* A large directory */
+			di_build(dp);
+			if (res == FR_OK && move_window(dp->fs, dp->sect) != FR_OK) res = FR_DISK_ERR;	/* Bring the entry back to the window */
 		}
-#else		/* Non LFN configuration */
-		if (!(dir[DIR_Attr] & AM_VOL) && !mem_cmp(dir, dp->fn, 11)) /* Is it a valid entry? */
-			break;
+	}
+#else
+	res = dir_sdi(dp, 0);				/* Rewind directory object */
+	if (res == FR_OK) res = dir_scan(dp, 0xFFFF);
 #endif
-		res = dir_next(dp, 0);		/* Next entry */
-	} while (res == FR_OK);
 
+#if _FS_DCACHE
+	if ((res == FR_OK || res == FR_NO_FILE) && cache) dc_store(dp, pos, res == FR_OK);
+#endif
 	return res;
 }
 
@@ -1594,6 +3187,13 @@ FRESULT dir_register (	/* FR_OK:Successful, FR_DENIED:No free entry or too many
 			dp->fs->wflag = 1;
 		}
 	}
+#if _FS_DCACHE
+	if (res == FR_OK) dc_added(dp->fs, dp->sclust);
+#endif
+#if _FS_DIRINDEX
+	if (res == FR_OK) di_added(dp);
+	else di_drop(dp->fs, dp->sclust);	/* Some entries may have been written */
+#endif
 
 	return res;
 }
@@ -1614,7 +3214,21 @@ FRESULT dir_remove (	/* FR_OK: Successful, FR_DISK_ERR: A disk error */
 	FRESULT res;
 #if _USE_LFN	/* LFN configuration */
 	UINT i;
+#endif
+#if _FS_DIRINDEX
+	UINT top, idx;
+#endif
 
+#if _FS_DIRINDEX
+	top = idx = dp->index;	/* Entries of the object, for the index */
+#if _USE_LFN
+	if (dp->lfn_idx != 0xFFFF) top = dp->lfn_idx;
+#endif
+#endif
+#if _FS_DCACHE
+	dc_drop(dp->fs, dp->sclust, dp->index);
+#endif
+#if _USE_LFN
 	i = dp->index;	/* SFN index */
 	res = dir_sdi(dp, (dp->lfn_idx == 0xFFFF) ? i : dp->lfn_idx);	/* Goto the SFN or top of the LFN entries */
 	if (res == FR_OK) {
@@ -1642,6 +3256,11 @@ FRESULT dir_remove (	/* FR_OK: Successful, FR_DISK_ERR: A disk error */
 	}
 #endif
 
+#if _FS_DIRINDEX
+	if (res == FR_OK) di_removed(dp->fs, dp->sclust, top, idx);
+	else di_drop(dp->fs, dp->sclust);
+#endif
+
 	return res;
 }
 #endif /* !_FS_READONLY */
@@ -2032,6 +3651,9 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		for (;;) {
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if _FS_DCACHE
+			if (!(dp->fn[NSFLAG] & NS_LAST) && dc_enter(dp)) continue;	/* Cached sub-directory */
+#endif
 			res = dir_find(dp);				/* Find an object with the sagment name */
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
@@ -2196,6 +3818,24 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 
 	fs->fs_type = 0;					/* Clear the file system object */
 	fs->drv = LD2PD(vol);				/* Bind the logical drive and a physical drive */
+#if _FS_WINCACHE
+	wc_reset(fs);						/* Discard cached sectors of the previous volume */
+#endif
+#if _FS_FATCACHE
+	fc_reset(fs);
+#endif
+#if _FS_FREEMAP
+	fm_reset(fs);						/* The bitmap is rebuilt for the new volume */
+#endif
+#if _FS_FREECOUNT && !_FS_READONLY
+	fs->fcnt_clst = 0;					/* A count in progress is restarted */
+#endif
+#if _FS_DCACHE
+	dc_reset(fs);
+#endif
+#if _FS_DIRINDEX
+	di_free(fs);
+#endif
 	stat = disk_initialize(fs->drv);	/* Initialize the physical drive */
 	if (stat & STA_NOINIT)				/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
@@ -2282,6 +3922,12 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	/* Initialize cluster allocation information */
 	fs->last_clust = fs->free_clust = 0xFFFFFFFF;
 
+#if _FS_FATMIRROR
+	/* Nothing to mirror yet; a FAT32 volume may say only one FAT is active */
+	fs->fmcnt = 0;
+	fs->fmflag = (fmt == FS_FAT32 && (fs->win[BPB_ExtFlags] & 0x80)) ? 1 : 0;
+#endif
+
 	/* Get fsinfo if available */
 	fs->fsi_flag = 0x80;
 #if (_FS_NOFSINFO & 3) != 3
@@ -2343,6 +3989,35 @@ FRESULT validate (	/* FR_OK(0): The object is valid, !=0: Invalid */
 }
 
 
+static
+FRESULT validate_file (	/* validate() for a file object, which is locked before the volume */
+		FIL* fp,		/* Pointer to the file object to check validity */
+		int shared,		/* 1:The volume can be shared with other readers (f_read) */
+		BYTE nowait		/* 1:Fail with FR_TIMEOUT instead of waiting for a lock */
+		)
+{
+	if (!fp || !fp->fs || !fp->fs->fs_type || fp->fs->id != fp->id)
+		return FR_INVALID_OBJECT;
+
+#if FILE_LOCK
+	if (!ff_req_file(&fp->fsobj, fp->fs->sobj, nowait)) return FR_TIMEOUT;
+#endif
+#if _FS_REENTRANT
+	if (!(shared ? lock_fs_shared(fp->fs, nowait) : lock_fs(fp->fs, nowait))) {
+#if FILE_LOCK
+		ff_rel_file(&fp->fsobj);
+#endif
+		return FR_TIMEOUT;
+	}
+#endif
+
+	if (disk_status(fp->fs->drv) & STA_NOINIT)
+		return FR_NOT_READY;
+
+	return FR_OK;
+}
+
+
 
 
 /*--------------------------------------------------------------------------
@@ -2381,6 +4056,12 @@ FRESULT f_mount (
 		if (!ff_del_syncobj(cfs->sobj)) return FR_INT_ERR;
 #endif
 		cfs->fs_type = 0;				/* Clear old fs object */
+#if _FS_FREEMAP
+		fm_reset(cfs);
+#endif
+#if _FS_DIRINDEX
+		di_free(cfs);
+#endif
 	}
 
 	if (fs) {
@@ -2502,36 +4183,248 @@ FRESULT f_open (
 #endif
 		}
 
-#else				/* R/O configuration */
-		if (res == FR_OK) {					/* Follow succeeded */
-			dir = dj.dir;
-			if (!dir) {						/* Current directory itself */
-				res = FR_INVALID_NAME;
-			} else {
-				if (dir[DIR_Attr] & AM_DIR)	/* It is a directory */
-					res = FR_NO_FILE;
-			}
-		}
+#else				/* R/O configuration */
+		if (res == FR_OK) {					/* Follow succeeded */
+			dir = dj.dir;
+			if (!dir) {						/* Current directory itself */
+				res = FR_INVALID_NAME;
+			} else {
+				if (dir[DIR_Attr] & AM_DIR)	/* It is a directory */
+					res = FR_NO_FILE;
+			}
+		}
+#endif
+		FREE_BUF();
+
+#if FILE_LOCK
+		if (res == FR_OK && !ff_cre_filesync(&fp->fsobj)) {	/* Create the file lock */
+#if _FS_LOCK
+			dec_lock(fp->lockid);
+#endif
+			res = FR_INT_ERR;
+		}
+#endif
+		if (res == FR_OK) {
+			fp->flag = mode;					/* File access mode */
+			fp->err = 0;						/* Clear error flag */
+			fp->sclust = ld_clust(dj.fs, dir);	/* File start cluster */
+			fp->fsize = LD_DWORD(dir + DIR_FileSize);	/* File size */
+			fp->fptr = 0;						/* File pointer */
+			fp->dsect = 0;
+#if _USE_FASTSEEK
+			fp->cltbl = 0;						/* Normal seek mode */
+#endif
+#if _FS_READAHEAD
+			fp->rabuf = 0;						/* No read-ahead */
+			fp->rasize = fp->racnt = 0;
+#endif
+#if _FS_WRITEBEHIND
+			fp->wbbuf = 0;						/* No write-behind */
+			fp->wbsize = fp->wbcnt = 0;
+#endif
+			fp->fs = dj.fs;	 					/* Validate file object */
+			fp->id = fp->fs->id;
+		}
+	}
+
+	LEAVE_FF(dj.fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Stage sector transfers for a buffer that is not word aligned          */
+/*-----------------------------------------------------------------------*/
+
+#define	IS_WORD_ALIGNED(p)	(((uintptr_t)(p) & 3) == 0)	/* Buffer can be given to the disk driver */
+
+static
+BYTE* get_stage (	/* Get an aligned staging buffer, 0:disk error */
+		FIL* fp,		/* Pointer to the file object */
+		UINT* nmax		/* Returns number of sectors the buffer holds */
+		)
+{
+	FATFS *fs = fp->fs;
+
+
+#if _FS_BOUNCE
+	if (fs->bbuf) {					/* Multi-sector chunks through the volume's arena */
+		*nmax = _FS_BOUNCE * _MAX_SS / SS(fs);
+		return fs->bbuf;
+	}
+#endif
+	*nmax = 1;						/* Otherwise one sector at a time through a sector buffer */
+#if _FS_TINY
+#if !_FS_READONLY
+	if (sync_window(fs) != FR_OK) return 0;	/* Write-back the window before borrowing it */
+#endif
+	fs->winsect = 0xFFFFFFFF;
+	return fs->win;
+#else
+#if !_FS_READONLY
+	if (fp->flag & FA__DIRTY) {		/* Write-back the file's dirty sector before borrowing its buffer */
+		if (disk_write(fs->drv, fp->buf, fp->dsect, 1) != RES_OK) return 0;
+		fp->flag &= ~FA__DIRTY;
+	}
+#endif
+	return fp->buf;
+#endif
+}
+
+
+static
+FRESULT read_staged (	/* Read sectors into an unaligned buffer */
+		FIL* fp,		/* Pointer to the file object */
+		BYTE* buff,		/* Data buffer */
+		DWORD sect,		/* First sector */
+		UINT cc			/* Number of sectors */
+		)
+{
+	UINT n, nmax;
+	BYTE *stage;
+	FRESULT res = FR_OK;
+
+
+	LOCK_CACHE(fp->fs);			/* The bounce buffer is shared by the readers */
+	stage = get_stage(fp, &nmax);
+	if (!stage) res = FR_DISK_ERR;
+	for ( ; stage && cc; buff += n * SS(fp->fs), sect += n, cc -= n) {
+		n = cc < nmax ? cc : nmax;
+		if (disk_read(fp->fs->drv, stage, sect, n) != RES_OK) {
+			res = FR_DISK_ERR;
+			break;
+		}
+		mem_cpy(buff, stage, n * SS(fp->fs));
+	}
+	UNLOCK_CACHE(fp->fs);
+#if !_FS_TINY
+	if (res == FR_OK && stage == fp->buf) fp->dsect = sect - 1;	/* The file buffer now holds the last sector */
+#endif
+	return res;
+}
+
+
+#if !_FS_READONLY
+static
+FRESULT write_staged (	/* Write sectors from an unaligned buffer */
+		FIL* fp,		/* Pointer to the file object */
+		const BYTE* buff,	/* Data to be written */
+		DWORD sect,		/* First sector */
+		UINT cc			/* Number of sectors */
+		)
+{
+	UINT n, nmax;
+	BYTE *stage = get_stage(fp, &nmax);
+
+
+	if (!stage) return FR_DISK_ERR;
+	for ( ; cc; buff += n * SS(fp->fs), sect += n, cc -= n) {
+		n = cc < nmax ? cc : nmax;
+		mem_cpy(stage, buff, n * SS(fp->fs));
+		if (disk_write(fp->fs->drv, stage, sect, n) != RES_OK)
+			return FR_DISK_ERR;
+	}
+#if !_FS_TINY
+	if (stage == fp->buf) fp->dsect = sect - 1;	/* The file buffer now holds the last sector */
+#endif
+	return FR_OK;
+}
+#endif
+
+
+
+
+#if !_FS_READONLY && !_FS_TINY
+/*-----------------------------------------------------------------------*/
+/* Write-back the file sector buffer (through the write-behind buffer)   */
+/*-----------------------------------------------------------------------*/
+
+#if _FS_WRITEBEHIND
+static
+FRESULT flush_behind (	/* Write the sectors collected in the write-behind buffer */
+		FIL* fp		/* Pointer to the file object */
+		)
+{
+	if (fp->wbcnt) {
+		if (disk_write(fp->fs->drv, fp->wbbuf, fp->wbsect, fp->wbcnt) != RES_OK)
+			return FR_DISK_ERR;
+		fp->wbcnt = 0;
+	}
+	return FR_OK;
+}
+#endif
+
+
+static
+FRESULT write_back (	/* Write-back the dirty sector buffer */
+		FIL* fp		/* Pointer to the file object */
+		)
+{
+#if _FS_WRITEBEHIND
+	if (fp->wbsize) {	/* Collect consecutive sectors for one multi-sector write */
+		if (fp->wbcnt && fp->dsect != fp->wbsect + fp->wbcnt && flush_behind(fp) != FR_OK)
+			return FR_DISK_ERR;
+		if (!fp->wbcnt) fp->wbsect = fp->dsect;
+		mem_cpy(fp->wbbuf + fp->wbcnt * SS(fp->fs), fp->buf, SS(fp->fs));
+		fp->flag &= ~FA__DIRTY;
+		if (++fp->wbcnt >= fp->wbsize) return flush_behind(fp);	/* Flush when full */
+		return FR_OK;
+	}
+#endif
+	if (disk_write(fp->fs->drv, fp->buf, fp->dsect, 1) != RES_OK)
+		return FR_DISK_ERR;
+	fp->flag &= ~FA__DIRTY;
+	return FR_OK;
+}
+#endif
+
+
+
+
+#if _FS_READAHEAD
+/*-----------------------------------------------------------------------*/
+/* Load a file sector through the read-ahead buffer                      */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT load_ahead (
+		FIL* fp,		/* Pointer to the file object */
+		DWORD sect,		/* Sector to load into fp->buf */
+		UINT csect		/* Its offset in the current cluster */
+		)
+{
+	FATFS *fs = fp->fs;
+	DWORD clst;
+	UINT n;
+	DRESULT dr;
+#if FILE_LOCK
+	FRESULT res;
 #endif
-		FREE_BUF();
 
-		if (res == FR_OK) {
-			fp->flag = mode;					/* File access mode */
-			fp->err = 0;						/* Clear error flag */
-			fp->sclust = ld_clust(dj.fs, dir);	/* File start cluster */
-			fp->fsize = LD_DWORD(dir + DIR_FileSize);	/* File size */
-			fp->fptr = 0;						/* File pointer */
-			fp->dsect = 0;
-#if _USE_FASTSEEK
-			fp->cltbl = 0;						/* Normal seek mode */
+
+	if (sect - fp->rasect >= fp->racnt) {		/* Not in the buffer: fetch the following sectors too */
+		n = (UINT)((fp->fsize - fp->fptr + SS(fs) - 1) / SS(fs));	/* Sectors left in the file */
+		if (n > fp->rasize) n = fp->rasize;
+		clst = fp->clust;
+		n = clust_run(fp, csect, n, 0);			/* Only over consecutive clusters */
+		fp->clust = clst;
+		fp->racnt = 0;
+		UNLOCK_VOL(fp);							/* Other tasks can use the volume during the transfer */
+		dr = disk_read(fs->drv, fp->rabuf, sect, n);
+#if FILE_LOCK
+		res = relock_fs(fp, 1);
+		if (res != FR_OK) return res;			/* The volume is no longer held */
 #endif
-			fp->fs = dj.fs;	 					/* Validate file object */
-			fp->id = fp->fs->id;
-		}
+		if (dr != RES_OK)
+			return FR_DISK_ERR;
+		fp->rasect = sect;
+		fp->racnt = n;
 	}
-
-	LEAVE_FF(dj.fs, res);
+	mem_cpy(fp->buf, fp->rabuf + (sect - fp->rasect) * SS(fs), SS(fs));
+	return FR_OK;
 }
+#endif
 
 
 
@@ -2540,27 +4433,35 @@ FRESULT f_open (
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_read (
+FRESULT f_readnb (
 		FIL* fp, 		/* Pointer to the file object */
 		void* buff,		/* Pointer to data buffer */
 		UINT btr,		/* Number of bytes to read */
-		UINT* br		/* Pointer to number of bytes read */
+		UINT* br,		/* Pointer to number of bytes read */
+		BYTE nowait		/* 1:Fail with FR_TIMEOUT instead of waiting for a lock */
 		)
 {
 	FRESULT res;
 	DWORD clst, sect, remain;
 	UINT rcnt, cc;
 	BYTE csect, *rbuff = (BYTE*)buff;
+	DRESULT dr;
 
 
 	*br = 0;	/* Clear read byte counter */
 
-	res = validate(fp);							/* Check validity */
-	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	res = validate_file(fp, 1, nowait);			/* Check validity, other readers can get in */
+	if (res != FR_OK) LEAVE_FIL(fp, res);
 	if (fp->err)								/* Check error */
-		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+		LEAVE_FIL(fp, (FRESULT)fp->err);
 	if (!(fp->flag & FA_READ)) 					/* Check access mode */
-		LEAVE_FF(fp->fs, FR_DENIED);
+		LEAVE_FIL(fp, FR_DENIED);
+#if _FS_WRITEBEHIND && !_FS_READONLY
+	UNLOCK_VOL(fp);
+	res = flush_behind(fp);						/* Sectors are read from the disk */
+	RELOCK_VOL(fp, 1);
+	if (res != FR_OK) ABORT(fp->fs, FR_DISK_ERR);
+#endif
 	remain = fp->fsize - fp->fptr;
 	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
 
@@ -2577,7 +4478,7 @@ FRESULT f_read (
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					else
 #endif
-						clst = get_fat(fp->fs, fp->clust);	/* Follow cluster chain on the FAT */
+						clst = get_fat_shared(fp->fs, fp->clust);	/* Follow cluster chain on the FAT */
 				}
 				if (clst < 2) ABORT(fp->fs, FR_INT_ERR);
 				if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
@@ -2588,22 +4489,17 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fp->fs);				/* When remaining bytes >= sector size, */
 			if (cc) {							/* Read maximum contiguous sectors directly */
-				if (csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
-					cc = fp->fs->csize - csect;
-				if( ((LONG)rbuff & 0x03) == 0 ){ //must be word aligned
-					if (disk_read(fp->fs->drv, rbuff, sect, cc) != RES_OK)
-						ABORT(fp->fs, FR_DISK_ERR);
+				cc = clust_run(fp, csect, cc, 0);	/* Clip at the end of the consecutive clusters */
+				if (IS_WORD_ALIGNED(rbuff)) {	/* The driver needs word aligned memory */
+					UNLOCK_VOL(fp);				/* Other tasks can use the volume during the transfer */
+					dr = disk_read(fp->fs->drv, rbuff, sect, cc);
+					RELOCK_VOL(fp, 1);
+					if (dr != RES_OK) ABORT(fp->fs, FR_DISK_ERR);
 				} else {
-					//driver needs destination memory to be aligned
-					int cc_count;
-					for(cc_count=0; cc_count < cc; cc_count++){
-						if (disk_read(fp->fs->drv, fp->buf, sect+cc_count, 1) != RES_OK)
-							ABORT(fp->fs, FR_DISK_ERR);
-						memcpy(rbuff + SS(fp->fs)*cc_count, fp->buf, SS(fp->fs));
-					}
+					if (read_staged(fp, rbuff, sect, cc) != FR_OK)
+						ABORT(fp->fs, FR_DISK_ERR);
 				}
 
-
 #if !_FS_READONLY && _FS_MINIMIZE <= 2			/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if _FS_TINY
 				if (fp->fs->wflag && fp->fs->winsect - sect < cc)
@@ -2625,8 +4521,18 @@ FRESULT f_read (
 					fp->flag &= ~FA__DIRTY;
 				}
 #endif
-				if (disk_read(fp->fs->drv, fp->buf, sect, 1) != RES_OK)	/* Fill sector cache */
-					ABORT(fp->fs, FR_DISK_ERR);
+#if _FS_READAHEAD
+				if (fp->rasize) {
+					res = load_ahead(fp, sect, csect);	/* Fill sector cache from the read-ahead buffer */
+					if (res != FR_OK) ABORT_XFER(fp, res);
+				} else
+#endif
+				{
+					UNLOCK_VOL(fp);
+					dr = disk_read(fp->fs->drv, fp->buf, sect, 1);	/* Fill sector cache */
+					RELOCK_VOL(fp, 1);
+					if (dr != RES_OK) ABORT(fp->fs, FR_DISK_ERR);
+				}
 			}
 #endif
 			fp->dsect = sect;
@@ -2645,7 +4551,18 @@ FRESULT f_read (
 
 	}
 
-	LEAVE_FF(fp->fs, FR_OK);
+	LEAVE_FIL(fp, FR_OK);
+}
+
+
+FRESULT f_read (
+		FIL* fp, 		/* Pointer to the file object */
+		void* buff,		/* Pointer to data buffer */
+		UINT btr,		/* Number of bytes to read */
+		UINT* br		/* Pointer to number of bytes read */
+		)
+{
+	return f_readnb(fp, buff, btr, br, 0);
 }
 
 
@@ -2656,11 +4573,12 @@ FRESULT f_read (
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_write (
+FRESULT f_writenb (
 		FIL* fp,			/* Pointer to the file object */
 		const void *buff,	/* Pointer to the data to be written */
 		UINT btw,			/* Number of bytes to write */
-		UINT* bw			/* Pointer to number of bytes written */
+		UINT* bw,			/* Pointer to number of bytes written */
+		BYTE nowait			/* 1:Fail with FR_TIMEOUT instead of waiting for a lock */
 		)
 {
 	FRESULT res;
@@ -2668,17 +4586,21 @@ FRESULT f_write (
 	UINT wcnt, cc;
 	const BYTE *wbuff = (const BYTE*)buff;
 	BYTE csect;
+	DRESULT dr;
 
 
 	*bw = 0;	/* Clear write byte counter */
 
-	res = validate(fp);						/* Check validity */
-	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	res = validate_file(fp, 0, nowait);				/* Check validity */
+	if (res != FR_OK) LEAVE_FIL(fp, res);
 	if (fp->err)							/* Check error */
-		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+		LEAVE_FIL(fp, (FRESULT)fp->err);
 	if (!(fp->flag & FA_WRITE))				/* Check access mode */
-		LEAVE_FF(fp->fs, FR_DENIED);
+		LEAVE_FIL(fp, FR_DENIED);
 	if (fp->fptr + btw < fp->fptr) btw = 0;	/* File size cannot reach 4GB */
+#if _FS_READAHEAD
+	fp->racnt = 0;							/* Read-ahead data may become stale */
+#endif
 
 	for ( ;  btw;							/* Repeat until all data written */
 			wbuff += wcnt, fp->fptr += wcnt, *bw += wcnt, btw -= wcnt) {
@@ -2708,9 +4630,10 @@ FRESULT f_write (
 				ABORT(fp->fs, FR_DISK_ERR);
 #else
 			if (fp->flag & FA__DIRTY) {		/* Write-back sector cache */
-				if (disk_write(fp->fs->drv, fp->buf, fp->dsect, 1) != RES_OK)
-					ABORT(fp->fs, FR_DISK_ERR);
-				fp->flag &= ~FA__DIRTY;
+				UNLOCK_VOL(fp);				/* Other tasks can use the volume during the transfer */
+				res = write_back(fp);
+				RELOCK_VOL(fp, 0);
+				if (res != FR_OK) ABORT(fp->fs, FR_DISK_ERR);
 			}
 #endif
 			sect = clust2sect(fp->fs, fp->clust);	/* Get current sector */
@@ -2718,18 +4641,15 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fp->fs);			/* When remaining bytes >= sector size, */
 			if (cc) {						/* Write maximum contiguous sectors directly */
-				if (csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
-					cc = fp->fs->csize - csect;
-				if( ((LONG)wbuff & 0x03) == 0 ){
-					if (disk_write(fp->fs->drv, wbuff, sect, cc) != RES_OK)
-						ABORT(fp->fs, FR_DISK_ERR);
+				cc = clust_run(fp, csect, cc, 1);	/* Clip at the end of the consecutive clusters */
+				if (IS_WORD_ALIGNED(wbuff)) {	/* The driver needs word aligned memory */
+					UNLOCK_VOL(fp);
+					dr = disk_write(fp->fs->drv, wbuff, sect, cc);
+					RELOCK_VOL(fp, 0);
+					if (dr != RES_OK) ABORT(fp->fs, FR_DISK_ERR);
 				} else {
-					int cc_count;
-					for(cc_count=0; cc_count < cc; cc_count++){
-						memcpy(fp->buf, wbuff + SS(fp->fs)*cc_count, SS(fp->fs));
-						if (disk_write(fp->fs->drv, fp->buf, sect+cc_count, 1) != RES_OK)
-							ABORT(fp->fs, FR_DISK_ERR);
-					}
+					if (write_staged(fp, wbuff, sect, cc) != FR_OK)
+						ABORT(fp->fs, FR_DISK_ERR);
 				}
 #if _FS_MINIMIZE <= 2
 #if _FS_TINY
@@ -2751,12 +4671,16 @@ FRESULT f_write (
 			if (fp->fptr >= fp->fsize) {	/* Avoid silly cache filling at growing edge */
 				if (sync_window(fp->fs)) ABORT(fp->fs, FR_DISK_ERR);
 				fp->fs->winsect = sect;
+#if _FS_WINCACHE
+				wc_drop(fp->fs, sect, 1);
+#endif
 			}
 #else
-			if (fp->dsect != sect) {		/* Fill sector cache with file data */
-				if (fp->fptr < fp->fsize &&
-					 disk_read(fp->fs->drv, fp->buf, sect, 1) != RES_OK)
-					ABORT(fp->fs, FR_DISK_ERR);
+			if (fp->dsect != sect && fp->fptr < fp->fsize) {	/* Fill sector cache with file data */
+				UNLOCK_VOL(fp);
+				dr = disk_read(fp->fs->drv, fp->buf, sect, 1);
+				RELOCK_VOL(fp, 0);
+				if (dr != RES_OK) ABORT(fp->fs, FR_DISK_ERR);
 			}
 #endif
 			fp->dsect = sect;
@@ -2777,7 +4701,18 @@ FRESULT f_write (
 	if (fp->fptr > fp->fsize) fp->fsize = fp->fptr;	/* Update file size if needed */
 	fp->flag |= FA__WRITTEN;						/* Set file change flag */
 
-	LEAVE_FF(fp->fs, FR_OK);
+	LEAVE_FIL(fp, FR_OK);
+}
+
+
+FRESULT f_write (
+		FIL* fp,			/* Pointer to the file object */
+		const void *buff,	/* Pointer to the data to be written */
+		UINT btw,			/* Number of bytes to write */
+		UINT* bw			/* Pointer to number of bytes written */
+		)
+{
+	return f_writenb(fp, buff, btw, bw, 0);
 }
 
 
@@ -2796,16 +4731,19 @@ FRESULT f_sync (
 	BYTE *dir;
 
 
-	res = validate(fp);					/* Check validity of the object */
+	res = validate_file(fp, 0, 0);				/* Check validity of the object */
 	if (res == FR_OK) {
 		if (fp->flag & FA__WRITTEN) {	/* Has the file been written? */
 			/* Write-back dirty buffer */
 #if !_FS_TINY
 			if (fp->flag & FA__DIRTY) {
-				if (disk_write(fp->fs->drv, fp->buf, fp->dsect, 1) != RES_OK)
-					LEAVE_FF(fp->fs, FR_DISK_ERR);
-				fp->flag &= ~FA__DIRTY;
+				if (write_back(fp) != FR_OK)
+					LEAVE_FIL(fp, FR_DISK_ERR);
 			}
+#endif
+#if _FS_WRITEBEHIND
+			if (flush_behind(fp) != FR_OK)
+				LEAVE_FIL(fp, FR_DISK_ERR);
 #endif
 			/* Update the directory entry */
 			res = move_window(fp->fs, fp->dir_sect);
@@ -2824,8 +4762,33 @@ FRESULT f_sync (
 		}
 	}
 
-	LEAVE_FF(fp->fs, res);
+	LEAVE_FIL(fp, res);
+}
+
+
+
+
+#if _FS_WRITEBEHIND
+/*-----------------------------------------------------------------------*/
+/* Write the Write-behind Buffer of a File                               */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_flush (
+		FIL* fp		/* Pointer to the file object */
+		)
+{
+	FRESULT res;
+
+
+	res = validate_file(fp, 0, 0);				/* Check validity of the object */
+	if (res == FR_OK) {
+		res = flush_behind(fp);
+		if (res != FR_OK) fp->err = (FRESULT)res;
+	}
+
+	LEAVE_FIL(fp, res);
 }
+#endif
 
 #endif /* !_FS_READONLY */
 
@@ -2848,7 +4811,7 @@ FRESULT f_close (
 	if (res == FR_OK)
 #endif
 	{
-		res = validate(fp);				/* Lock volume */
+		res = validate_file(fp, 0, 0);	/* Lock the file and the volume */
 		if (res == FR_OK) {
 #if _FS_REENTRANT
 			FATFS *fs = fp->fs;
@@ -2858,6 +4821,10 @@ FRESULT f_close (
 			if (res == FR_OK)
 #endif
 				fp->fs = 0;				/* Invalidate file object */
+#if FILE_LOCK
+			ff_rel_file(&fp->fsobj);
+			if (res == FR_OK) ff_del_filesync(&fp->fsobj);	/* Nobody can get the file lock any more */
+#endif
 #if _FS_REENTRANT
 			unlock_fs(fs, FR_OK);		/* Unlock volume */
 #endif
@@ -3008,9 +4975,10 @@ FRESULT f_getcwd (
 /* Seek File R/W Pointer                                                 */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_lseek (
+FRESULT f_lseeknb (
 		FIL* fp,		/* Pointer to the file object */
-		DWORD ofs		/* File pointer from top of file */
+		DWORD ofs,		/* File pointer from top of file */
+		BYTE nowait		/* 1:Fail with FR_TIMEOUT instead of waiting for a lock */
 		)
 {
 	FRESULT res;
@@ -3020,10 +4988,14 @@ FRESULT f_lseek (
 #endif
 
 
-	res = validate(fp);					/* Check validity of the object */
-	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	res = validate_file(fp, 0, nowait);			/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FIL(fp, res);
 	if (fp->err)						/* Check error */
-		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+		LEAVE_FIL(fp, (FRESULT)fp->err);
+#if _FS_WRITEBEHIND && !_FS_READONLY
+	if (flush_behind(fp) != FR_OK)		/* Sectors may be read from the disk */
+		ABORT(fp->fs, FR_DISK_ERR);
+#endif
 
 #if _USE_FASTSEEK
 	if (fp->cltbl) {	/* Fast seek */
@@ -3156,7 +5128,16 @@ FRESULT f_lseek (
 #endif
 	}
 
-	LEAVE_FF(fp->fs, res);
+	LEAVE_FIL(fp, res);
+}
+
+
+FRESULT f_lseek (
+		FIL* fp,		/* Pointer to the file object */
+		DWORD ofs		/* File pointer from top of file */
+		)
+{
+	return f_lseeknb(fp, ofs, 0);
 }
 
 
@@ -3291,6 +5272,88 @@ FRESULT f_readdir (
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Read Directory Entries in Batch                                       */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readdirn (
+		FDIR* dp,			/* Pointer to the open directory object */
+		FILINFO* fno,		/* Pointer to the file information array to fill (NULL:Skip the items) */
+		UINT n,				/* Number of items to read */
+		UINT* nr			/* Pointer to number of items read (less than n at end of directory) */
+		)
+{
+	FRESULT res;
+	DEFINE_NAMEBUF;
+
+
+	*nr = 0;
+	res = validate(dp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		INIT_BUF(*dp);
+		while (*nr < n) {
+			res = dir_read(dp, 0);			/* Read an item */
+			if (res != FR_OK) break;
+			if (fno) get_fileinfo(dp, &fno[*nr]);	/* Get the object information */
+			(*nr)++;
+			res = dir_next(dp, 0);			/* Increment index for next */
+			if (res != FR_OK) break;
+		}
+		if (res == FR_NO_FILE) {			/* Reached end of directory */
+			dp->sect = 0;
+			res = FR_OK;
+		}
+		FREE_BUF();
+	}
+
+	LEAVE_FF(dp->fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Move to a Directory Entry                                             */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_seekdir (
+		FDIR* dp,			/* Pointer to the open directory object */
+		UINT idx,			/* Index of the entry to read next (as got by f_telldir()) */
+		DWORD clst			/* Cluster of the entry (dp->clust at f_telldir()), 0:Unknown */
+		)
+{
+	FRESULT res;
+	UINT ic;
+#if _FS_DIRINDEX
+	DIRIX *ix;
+#endif
+
+
+	res = validate(dp);						/* Check validity of the object */
+	if (res == FR_OK) {
+		if (clst >= 2 && clst < dp->fs->n_fatent) {	/* The cluster of the entry is known */
+			ic = SS(dp->fs) / SZ_DIRE;		/* Entries per sector */
+			dp->index = (WORD)idx;
+			dp->clust = clst;
+			dp->sect = clust2sect(dp->fs, clst) + idx / ic % dp->fs->csize;
+			dp->dir = dp->fs->win + (idx % ic) * SZ_DIRE;
+		} else {
+#if _FS_DIRINDEX
+			ix = di_get(dp->fs, dp->sclust);
+			if (ix && ix->flag == 1 && idx < ix->nent)
+				di_sdi(dp, ix, idx);		/* Take the cluster from the index */
+			else
+#endif
+				res = dir_sdi(dp, idx);		/* Follow the cluster chain */
+		}
+	}
+
+	LEAVE_FF(dp->fs, res);
+}
+
+
+
 #if _USE_FIND
 /*-----------------------------------------------------------------------*/
 /* Find next file                                                        */
@@ -3391,11 +5454,20 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, sect, stat;
-	UINT i;
-	BYTE fat, *p;
+	DWORD n;
+#if _FS_FREECOUNT
+	DWORD nleft;
 
 
+	do {	/* Count the free clusters in steps, each one with the volume locked */
+		res = f_countfree(path, _FS_FREECOUNT, &n, &nleft);
+	} while (res == FR_OK && nleft);
+	if (res != FR_OK) {
+		*fatfs = 0;
+		return res;
+	}
+#endif
+
 	/* Get logical drive number */
 	res = find_volume(fatfs, &path, 0);
 	fs = *fatfs;
@@ -3405,43 +5477,80 @@ FRESULT f_getfree (
 			*nclst = fs->free_clust;
 		} else {
 			/* Get number of free clusters */
-			fat = fs->fs_type;
-			n = 0;
-			if (fat == FS_FAT12) {
-				clst = 2;
-				do {
-					stat = get_fat(fs, clst);
-					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) n++;
-				} while (++clst < fs->n_fatent);
-			} else {
-				clst = fs->n_fatent;
-				sect = fs->fatbase;
-				i = 0; p = 0;
-				do {
-					if (!i) {
-						res = move_window(fs, sect++);
-						if (res != FR_OK) break;
-						p = fs->win;
-						i = SS(fs);
-					}
-					if (fat == FS_FAT16) {
-						if (LD_WORD(p) == 0) n++;
-						p += 2; i -= 2;
-					} else {
-						if ((LD_DWORD(p) & 0x0FFFFFFF) == 0) n++;
-						p += 4; i -= 4;
-					}
-				} while (--clst);
+			res = scan_fat(fs, 0, 2, fs->n_fatent, &n);
+			if (res == FR_OK) {
+				fs->free_clust = n;
+				fs->fsi_flag |= 1;
+				*nclst = n;
+			}
+		}
+	}
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+#if _FS_FREECOUNT
+/*-----------------------------------------------------------------------*/
+/* Count Free Clusters a Part at a Time                                  */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_countfree (
+		const TCHAR* path,	/* Path name of the logical drive number */
+		UINT nsect,			/* Number of FAT sectors to count in this call (0:Only get the progress) */
+		DWORD* nclst,		/* Pointer to return the free clusters counted so far */
+		DWORD* nleft		/* Pointer to return the number of clusters left to count (0:Count is complete) */
+		)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, ecl, *map;
+
+
+	/* Get logical drive number */
+	res = find_volume(&fs, &path, 0);
+	if (res == FR_OK) {
+		if (fs->free_clust <= fs->n_fatent - 2) {	/* Free cluster count is known */
+			fs->fcnt_clst = 0;
+			*nclst = fs->free_clust;
+			*nleft = 0;
+		} else {
+			if (fs->fcnt_clst < 2) {		/* Start to count */
+				fs->fcnt_clst = 2;
+				fs->fcnt_free = 0;
+			}
+			map = 0;
+#if _FS_FREEMAP
+			if (!fs->fmap && fm_start(fs) && fs->fmclst == fs->fcnt_clst)
+				map = fs->fmbuf;			/* Fill in the bitmap with the same FAT reads */
+#endif
+			ecl = fs->n_fatent;				/* Count up to the end of this step */
+			n = (fs->fs_type == FS_FAT12) ? SS(fs) * 2 / 3 : SS(fs) / (fs->fs_type == FS_FAT16 ? 2 : 4);
+			if ((ecl - fs->fcnt_clst) / n > nsect) ecl = fs->fcnt_clst + n * nsect;
+			res = scan_fat(fs, map, fs->fcnt_clst, ecl, &n);
+#if _FS_FREEMAP
+			if (map) {
+				if (res == FR_OK) fm_done(fs, ecl);
+				else fs->fmclst = 0;
+			}
+#endif
+			if (res == FR_OK) {
+				fs->fcnt_free += n;
+				fs->fcnt_clst = ecl;
+				*nclst = fs->fcnt_free;
+				*nleft = fs->n_fatent - ecl;
+				if (!*nleft) {				/* Publish the count */
+					fs->free_clust = fs->fcnt_free;
+					fs->fsi_flag |= 1;
+					fs->fcnt_clst = 0;
+				}
 			}
-			fs->free_clust = n;
-			fs->fsi_flag |= 1;
-			*nclst = n;
 		}
 	}
 	LEAVE_FF(fs, res);
 }
+#endif
 
 
 
@@ -3458,7 +5567,7 @@ FRESULT f_truncate (
 	DWORD ncl;
 
 
-	res = validate(fp);						/* Check validity of the object */
+	res = validate_file(fp, 0, 0);					/* Check validity of the object */
 	if (res == FR_OK) {
 		if (fp->err) {						/* Check error */
 			res = (FRESULT)fp->err;
@@ -3468,7 +5577,15 @@ FRESULT f_truncate (
 		}
 	}
 	if (res == FR_OK) {
+#if _FS_WRITEBEHIND
+		res = flush_behind(fp);		/* Removed clusters must not be written later */
+	}
+	if (res == FR_OK) {
+#endif
 		if (fp->fsize > fp->fptr) {
+#if _FS_READAHEAD
+			fp->racnt = 0;			/* Removed clusters may be reused by other files */
+#endif
 			fp->fsize = fp->fptr;	/* Set file size to current R/W point */
 			fp->flag |= FA__WRITTEN;
 			if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
@@ -3496,7 +5613,7 @@ FRESULT f_truncate (
 		if (res != FR_OK) fp->err = (FRESULT)res;
 	}
 
-	LEAVE_FF(fp->fs, res);
+	LEAVE_FIL(fp, res);
 }
 
 
@@ -3557,6 +5674,9 @@ FRESULT f_unlink (
 			}
 			if (res == FR_OK) {
 				res = dir_remove(&dj);		/* Remove the directory entry */
+#if _FS_DIRINDEX
+				if (res == FR_OK && dclst) di_drop(dj.fs, dclst);	/* The cluster may become another directory */
+#endif
 				if (res == FR_OK && dclst)	/* Remove the cluster chain if exist */
 					res = remove_chain(dj.fs, dclst);
 				if (res == FR_OK) res = sync_fs(dj.fs);
@@ -3604,6 +5724,9 @@ FRESULT f_mkdir (
 				res = sync_window(dj.fs);
 			if (res == FR_OK) {					/* Initialize the new directory table */
 				dsc = clust2sect(dj.fs, dcl);
+#if _FS_WINCACHE
+				wc_drop(dj.fs, dsc, dj.fs->csize);
+#endif
 				dir = dj.fs->win;
 				mem_set(dir, 0, SS(dj.fs));
 				mem_set(dir + DIR_Name, ' ', 11);	/* Create "." entry */
@@ -3953,6 +6076,9 @@ FRESULT f_setlabel (
 			if (res == FR_NO_FILE) {
 				res = FR_OK;
 				if (vn[0]) {				/* Create volume label as new */
+#if _FS_DIRINDEX
+					di_drop(dj.fs, dj.sclust);	/* The index does not track volume labels */
+#endif
 					res = dir_alloc(&dj, 1);	/* Allocate an entry for volume label */
 					if (res == FR_OK) {
 						mem_set(dj.dir, 0, SZ_DIRE);	/* Set volume label */
@@ -3996,12 +6122,12 @@ FRESULT f_forward (
 
 	*bf = 0;	/* Clear transfer byte counter */
 
-	res = validate(fp);								/* Check validity of the object */
-	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	res = validate_file(fp, 0, 0);							/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FIL(fp, res);
 	if (fp->err)									/* Check error */
-		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+		LEAVE_FIL(fp, (FRESULT)fp->err);
 	if (!(fp->flag & FA_READ))						/* Check access mode */
-		LEAVE_FF(fp->fs, FR_DENIED);
+		LEAVE_FIL(fp, FR_DENIED);
 
 	remain = fp->fsize - fp->fptr;
 	if (btf > remain) btf = (UINT)remain;			/* Truncate btf by remaining bytes */
@@ -4030,12 +6156,99 @@ FRESULT f_forward (
 		if (!rcnt) ABORT(fp->fs, FR_INT_ERR);
 	}
 
-	LEAVE_FF(fp->fs, FR_OK);
+	LEAVE_FIL(fp, FR_OK);
 }
 #endif /* _USE_FORWARD */
 
 
 
+#if _USE_EXPAND && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Blocks to the File                              */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+		FIL* fp,		/* Pointer to the file object */
+		DWORD fsz,		/* File size to be expanded to */
+		BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+		)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+
+
+	res = validate_file(fp, 0, 0);					/* Check validity of the object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res != FR_OK) LEAVE_FIL(fp, res);
+	fs = fp->fs;
+	if (fsz == 0 || fp->fsize != 0 || fp->sclust != 0 || !(fp->flag & FA_WRITE))
+		LEAVE_FIL(fp, FR_DENIED);			/* Only an empty file opened for writing can be expanded */
+
+	n = (DWORD)fs->csize * SS(fs);			/* Cluster size */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	stcl = fs->last_clust; lclst = 0;
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+#if _FS_FREEMAP
+	if (!fs->fmap) fm_step(fs, FM_STEP);
+#endif
+
+	scl = clst = stcl; ncl = 0;
+	for (;;) {								/* Find a contiguous free cluster block */
+#if _FS_FREEMAP
+		if (fs->fmap) {
+			n = (fs->fmap[clst / 32] >> (clst % 32)) & 1;	/* Bit set:cluster in use */
+		} else
+#endif
+		{
+			n = get_fat(fs, clst);
+			if (n == 1) { res = FR_INT_ERR; break; }
+			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		}
+		if (n == 0) {						/* Is it a free cluster? */
+			if (++ncl == tcl) break;		/* Break if a contiguous cluster block is found */
+		}
+		if (++clst >= fs->n_fatent) {		/* Wrap around (a block cannot span the end of the FAT) */
+			clst = 2; scl = 2; ncl = 0;
+		} else if (n != 0) {
+			scl = clst; ncl = 0;			/* Not a free cluster, restart the block next to it */
+		}
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous cluster block */
+	}
+
+	if (res == FR_OK) {						/* A contiguous free area is found */
+		if (opt) {							/* Allocate it now */
+			for (clst = scl, n = tcl; n; clst++, n--) {	/* Create a cluster chain on the FAT */
+				res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+				if (res != FR_OK) break;
+				lclst = clst;
+			}
+		} else {							/* Set it as suggested point for next allocation */
+			lclst = scl - 1;
+		}
+	}
+
+	if (res == FR_OK) {
+		fs->last_clust = lclst;				/* Set suggested start cluster to start next */
+		if (opt) {							/* Is it allocated now? */
+			fp->sclust = scl;				/* Update object allocation information */
+			fp->fsize = fsz;
+			fp->flag |= FA__WRITTEN;
+			if (fs->free_clust <= fs->n_fatent - 2) {	/* Update FSINFO */
+				fs->free_clust -= tcl;
+				fs->fsi_flag |= 1;
+			}
+		}
+	} else if (res != FR_DENIED) {
+		fp->err = (FRESULT)res;
+	}
+
+	LEAVE_FIL(fp, res);
+}
+#endif /* _USE_EXPAND && !_FS_READONLY */
+
+
+
 #if _USE_MKFS && !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Create file system on the logical drive                               */
@@ -7,21 +7,106 @@
 #include <pthread.h>
 #include <stdlib.h>		/* ANSI memory controls */
 #include <malloc.h>		/* ANSI memory controls */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ff.h"
 
 
-static pthread_mutex_t fatfs_lock_mutex[_VOLUMES];
-
 extern void cortexm_svcall(void (*function)(void*), void * args);
 extern void scheduler_svcall_set_delaymutex(void * args);
 extern int pthread_mutex_force_unlock(pthread_mutex_t *mutex);
 
 #if _FS_REENTRANT
 
-
+#define FF_READER_SLOTS	8
+
+/* A volume is locked shared by readers of file data (f_read) and exclusive
+/  by everything else. The exclusive holder keeps the mutex for the whole
+/  operation, a reader only holds it while it registers itself, so a waiting
+/  writer keeps new readers out until the ones inside have left. Every grant
+/  remembers the process of its holder so that ff_force_unlock() can give
+/  back what an exiting process held. */
+struct ff_sync {
+	pthread_mutex_t mutex;		/* Held by the exclusive owner (recursive) */
+	pthread_mutex_t state;		/* Guards the fields below */
+	pthread_cond_t idle;		/* Signaled when the last reader leaves */
+	pthread_mutex_t cache;		/* Serializes readers on the volume's shared buffers */
+	pthread_t owner;			/* Exclusive owner (valid while depth != 0) */
+	int owner_pid;				/* Its process */
+	int depth;					/* Exclusive grants held by the owner */
+	int readers;				/* Shared grants held */
+	int cache_pid;				/* Process holding the cache mutex (valid while cache_held) */
+	int cache_held;
+	int valid;					/* Created by ff_cre_syncobj() */
+	UINT timeout;				/* Longest wait for a grant (ms) */
+	DWORD hold_start;			/* When the exclusive owner got the volume (us) */
+	struct {
+		pthread_t thread;		/* Reader holding a shared grant */
+		int pid;				/* Its process */
+		DWORD start;			/* When it got it (us) */
+		int used;
+	} reader[FF_READER_SLOTS];	/* Readers inside (one more takes the volume exclusive) */
+	struct ff_filesync *held;	/* File locks held by tasks on this volume */
+	FFLOCKSTAT stat;			/* Wait times and the longest hold */
+};
+
+static struct ff_sync fatfs_lock[_VOLUMES];
+
+
+/* Called by the glue when a process exits, in the context of that process.
+/  Only the grants held by its threads are given back: its reader slots, an
+/  exclusive grant, the cache mutex and the file locks. Other processes keep
+/  what they hold. */
 int ff_force_unlock(int volume){
-	return pthread_mutex_force_unlock(&fatfs_lock_mutex[volume]);
+	struct ff_sync *s = &fatfs_lock[volume];
+	struct ff_filesync **link, *f;
+	int pid, i, n, left;
+
+	if( !s->valid ){
+		return 0;
+	}
+	pid = getpid();
+
+	pthread_mutex_lock(&s->state);
+	left = 0;
+	for(i = 0; i < FF_READER_SLOTS; i++){
+		if( s->reader[i].used && s->reader[i].pid == pid ){
+			s->reader[i].used = 0;
+			s->readers--;
+			left = 1;
+		}
+	}
+	if( left && s->readers == 0 ){
+		pthread_cond_broadcast(&s->idle);
+	}
+
+	if( s->cache_held && s->cache_pid == pid ){
+		s->cache_held = 0;
+		pthread_mutex_force_unlock(&s->cache);
+	}
+
+	for(link = &s->held; *link; ){
+		f = *link;
+		if( f->pid == pid ){
+			*link = f->next;
+			pthread_mutex_force_unlock(&f->mutex);
+		} else {
+			link = &f->next;
+		}
+	}
+
+	if( s->depth && s->owner_pid == pid ){
+		for(n = s->depth, s->depth = 0; n; n--){	/* The mutex is recursive */
+			if( pthread_mutex_force_unlock(&s->mutex) != 0 ){
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->state);
+
+	return 0;
 }
 
 /*------------------------------------------------------------------------*/
@@ -38,7 +123,9 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create due to any erro
 )
 {
 	int ret;
+	struct ff_sync *s = &fatfs_lock[vol];
 	pthread_mutexattr_t mutexattr;
+	pthread_condattr_t condattr;
 
 	if( pthread_mutexattr_init(&mutexattr) < 0 ){
 		return -1;
@@ -48,11 +135,34 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create due to any erro
 	pthread_mutexattr_setprioceiling(&mutexattr, 19);
 	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 
-	if( pthread_mutex_init(&fatfs_lock_mutex[vol], &mutexattr) < 0 ){
+	if( pthread_mutex_init(&s->mutex, &mutexattr) < 0 ){
+		return 0;
+	}
+
+	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_NORMAL);
+	if( pthread_mutex_init(&s->state, &mutexattr) < 0 ){
+		return 0;
+	}
+	if( pthread_mutex_init(&s->cache, &mutexattr) < 0 ){
+		return 0;
+	}
+	if( pthread_condattr_init(&condattr) < 0 ){
 		return 0;
 	}
+	pthread_condattr_setpshared(&condattr, 1);
+	if( pthread_cond_init(&s->idle, &condattr) < 0 ){
+		return 0;
+	}
+	s->depth = 0;
+	s->readers = 0;
+	s->cache_held = 0;
+	s->held = 0;
+	s->timeout = _FS_TIMEOUT;
+	memset(s->reader, 0, sizeof(s->reader));
+	memset(&s->stat, 0, sizeof(s->stat));
+	s->valid = 1;
 
-	*sobj = &fatfs_lock_mutex[vol];
+	*sobj = s;
 
 	return 1;
 
@@ -85,39 +195,201 @@ int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to any erro
 		_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	if( pthread_mutex_destroy(sobj) < 0 ){
+	if( pthread_mutex_destroy(&sobj->mutex) < 0 ){
 		return 0;
 	}
+	sobj->valid = 0;
+	pthread_mutex_destroy(&sobj->state);
+	pthread_mutex_destroy(&sobj->cache);
+	pthread_cond_destroy(&sobj->idle);
 
 	return 1;
 }
 
 
 
+static DWORD now_us(void){
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000UL + now.tv_nsec / 1000UL;
+}
+
+
+/* Called with sobj->state held */
+static void record_wait(
+		_SYNC_t sobj,
+		DWORD start,		/* When the request started (us) */
+		int waited			/* 0:Granted at once */
+)
+{
+	DWORD t;
+	int i;
+
+	i = 0;
+	if( waited ){
+		t = now_us() - start;
+		for(i = 1, t /= 100; t && i < FF_WAIT_BUCKETS - 1; i++, t /= 10) ;
+	}
+	sobj->stat.wait[i]++;
+}
+
+
+/* Called with sobj->state held */
+static void record_hold(
+		_SYNC_t sobj,
+		pthread_t thread,
+		DWORD start			/* When the grant was given (us) */
+)
+{
+	DWORD t = now_us() - start;
+
+	if( t > sobj->stat.hold_max ){
+		sobj->stat.hold_max = t;
+		sobj->stat.hold_task = (DWORD)thread;
+	}
+}
+
+
+static int take_mutex(	/* 1:Got it, 2:Got it after waiting, 0:Timeout */
+		_SYNC_t sobj,
+		BYTE nowait,
+		struct timespec * abs_time
+)
+{
+	int ret;
+
+	ret = 1;
+	if( pthread_mutex_trylock(&sobj->mutex) != 0 ){
+		ret = 2;
+		if( nowait || pthread_mutex_timedlock(&sobj->mutex, abs_time) != 0 ){
+			pthread_mutex_lock(&sobj->state);
+			sobj->stat.timeout++;
+			pthread_mutex_unlock(&sobj->state);
+			return 0;
+		}
+	}
+	return ret;
+}
+
+
+static void get_deadline(
+		_SYNC_t sobj,
+		struct timespec * abs_time
+)
+{
+	clock_gettime(CLOCK_REALTIME, abs_time);
+	abs_time->tv_sec += sobj->timeout / 1000;
+	abs_time->tv_nsec += (sobj->timeout % 1000) * 1000000L;
+	if( abs_time->tv_nsec >= 1000000000L ){
+		abs_time->tv_sec++;
+		abs_time->tv_nsec -= 1000000000L;
+	}
+}
+
+
+/* Called with sobj->mutex held */
+static int grant_exclusive(
+		_SYNC_t sobj,
+		int ret,			/* Result of take_mutex() */
+		DWORD start,		/* When the request started (us) */
+		BYTE nowait,
+		struct timespec * abs_time
+)
+{
+	pthread_mutex_lock(&sobj->state);
+	if( sobj->depth == 0 ){
+		while( sobj->readers ){		/* Wait for the readers inside to leave */
+			ret = 2;
+			if( nowait || pthread_cond_timedwait(&sobj->idle, &sobj->state, abs_time) != 0 ){
+				sobj->stat.timeout++;
+				pthread_mutex_unlock(&sobj->state);
+				pthread_mutex_unlock(&sobj->mutex);
+				return 0;
+			}
+		}
+		sobj->owner = pthread_self();
+		sobj->owner_pid = getpid();
+		record_wait(sobj, start, ret == 2);
+		sobj->hold_start = now_us();
+	}
+	sobj->depth++;
+	pthread_mutex_unlock(&sobj->state);
+	cortexm_svcall(scheduler_svcall_set_delaymutex, &sobj->mutex);
+
+	return ret;
+}
+
+
 /*------------------------------------------------------------------------*/
 /* Request Grant to Access the Volume                                     */
 /*------------------------------------------------------------------------*/
 /* This function is called on entering file functions to lock the volume.
 /  When a FALSE is returned, the file function fails with FR_TIMEOUT.
+/  A 2 tells the caller that the grant was held by another task first.
  */
 
-int ff_req_grant (	/* TRUE:Got a grant to access the volume, FALSE:Could not get a grant */
-		_SYNC_t sobj	/* Sync object to wait */
+int ff_req_grant (	/* 1:Got a grant, 2:Got a grant after waiting, 0:Could not get a grant */
+		_SYNC_t sobj,	/* Sync object to wait */
+		BYTE nowait		/* 1:Do not wait for another task */
 )
 {
 	int ret;
+	DWORD start;
 	struct timespec abs_time;
 
-	clock_gettime(CLOCK_REALTIME, &abs_time);
-	abs_time.tv_sec += 5;
+	start = now_us();
+	get_deadline(sobj, &abs_time);
 
-	ret = 1;
-	if( pthread_mutex_timedlock(sobj, &abs_time) < 0 ){
-		ret = 0;
-	} else {
-		cortexm_svcall(scheduler_svcall_set_delaymutex, sobj);
+	ret = take_mutex(sobj, nowait, &abs_time);
+	if( ret == 0 ){
+		return 0;
 	}
 
+	return grant_exclusive(sobj, ret, start, nowait, &abs_time);
+}
+
+
+/* Same as ff_req_grant() but the grant can be held by several tasks at a
+/  time; only f_read() asks for it */
+
+int ff_req_grant_shared (	/* 1:Got a grant, 2:Got a grant after waiting, 0:Could not get a grant */
+		_SYNC_t sobj,	/* Sync object to wait */
+		BYTE nowait		/* 1:Do not wait for another task */
+)
+{
+	int ret, i;
+	DWORD start;
+	struct timespec abs_time;
+
+	start = now_us();
+	get_deadline(sobj, &abs_time);
+
+	ret = take_mutex(sobj, nowait, &abs_time);
+	if( ret == 0 ){
+		return 0;
+	}
+
+	pthread_mutex_lock(&sobj->state);
+	if( sobj->depth && pthread_equal(sobj->owner, pthread_self()) ){
+		sobj->depth++;				/* Nested in an exclusive grant: stays exclusive */
+		pthread_mutex_unlock(&sobj->state);
+		return ret;
+	}
+	for(i = 0; i < FF_READER_SLOTS && sobj->reader[i].used; i++) ;
+	if( i == FF_READER_SLOTS ){		/* No slot to remember another reader: take it exclusive */
+		pthread_mutex_unlock(&sobj->state);
+		return grant_exclusive(sobj, ret, start, nowait, &abs_time);
+	}
+	sobj->reader[i].used = 1;
+	sobj->reader[i].thread = pthread_self();
+	sobj->reader[i].pid = getpid();
+	sobj->reader[i].start = now_us();
+	sobj->readers++;
+	record_wait(sobj, start, ret == 2);
+	pthread_mutex_unlock(&sobj->state);
+	pthread_mutex_unlock(&sobj->mutex);
+
 	return ret;
 }
 
@@ -127,15 +399,192 @@ int ff_req_grant (	/* TRUE:Got a grant to access the volume, FALSE:Could not get
 /* Release Grant to Access the Volume                                     */
 /*------------------------------------------------------------------------*/
 /* This function is called on leaving file functions to unlock the volume.
+/  It releases either kind of grant held by the calling task.
  */
 
 void ff_rel_grant (
 		_SYNC_t sobj	/* Sync object to be signaled */
 )
 {
+	pthread_t self = pthread_self();
+	int i;
+
+	pthread_mutex_lock(&sobj->state);
+	if( sobj->depth && pthread_equal(sobj->owner, self) ){
+		if( --sobj->depth == 0 ){
+			record_hold(sobj, self, sobj->hold_start);
+			cortexm_svcall(scheduler_svcall_set_delaymutex, 0);
+		}
+		pthread_mutex_unlock(&sobj->state);
+		pthread_mutex_unlock(&sobj->mutex);
+		return;
+	}
 
-	cortexm_svcall(scheduler_svcall_set_delaymutex, 0);
-	pthread_mutex_unlock(sobj);
+	for(i = 0; i < FF_READER_SLOTS; i++){
+		if( sobj->reader[i].used && pthread_equal(sobj->reader[i].thread, self) ){
+			sobj->reader[i].used = 0;
+			record_hold(sobj, self, sobj->reader[i].start);
+			break;
+		}
+	}
+	if( --sobj->readers == 0 ){
+		pthread_cond_broadcast(&sobj->idle);
+	}
+	pthread_mutex_unlock(&sobj->state);
+}
+
+
+
+/*------------------------------------------------------------------------*/
+/* Set the Lock Timeout / Get the Lock Statistics of a Volume             */
+/*------------------------------------------------------------------------*/
+/* The glue sets the timeout from fatfs_config_t after mounting.
+ */
+
+void ff_set_timeout (
+		_SYNC_t sobj,
+		UINT ms			/* Longest wait for a grant (0:_FS_TIMEOUT) */
+)
+{
+	sobj->timeout = ms ? ms : _FS_TIMEOUT;
+}
+
+
+void ff_get_lockstat (
+		_SYNC_t sobj,
+		FFLOCKSTAT* st,	/* Where to copy the statistics (NULL:only clear) */
+		BYTE clear		/* 1:Start counting again */
+)
+{
+	pthread_mutex_lock(&sobj->state);
+	if( st ){
+		*st = sobj->stat;
+	}
+	if( clear ){
+		memset(&sobj->stat, 0, sizeof(sobj->stat));
+	}
+	pthread_mutex_unlock(&sobj->state);
+}
+
+
+
+/*------------------------------------------------------------------------*/
+/* Lock/Unlock the Volume's Shared Buffers                                */
+/*------------------------------------------------------------------------*/
+/* Holders of a shared grant take this around the FAT cache, the sector
+/  window and the bounce buffer. Under an exclusive grant it is never
+/  contended.
+ */
+
+void ff_req_cache (
+		_SYNC_t sobj
+)
+{
+	pthread_mutex_lock(&sobj->cache);
+	pthread_mutex_lock(&sobj->state);
+	sobj->cache_pid = getpid();
+	sobj->cache_held = 1;
+	pthread_mutex_unlock(&sobj->state);
+}
+
+
+void ff_rel_cache (
+		_SYNC_t sobj
+)
+{
+	pthread_mutex_lock(&sobj->state);
+	sobj->cache_held = 0;
+	pthread_mutex_unlock(&sobj->state);
+	pthread_mutex_unlock(&sobj->cache);
+}
+
+
+
+
+/*------------------------------------------------------------------------*/
+/* Create/Delete the Sync Object of a File                                */
+/*------------------------------------------------------------------------*/
+/* Called by f_open() and f_close(). The file lock is taken before the
+/  volume's and held while file data moves with the volume released.
+ */
+
+int ff_cre_filesync (	/* 1:Function succeeded, 0:Could not create */
+		_FSYNC_t* fobj
+)
+{
+	pthread_mutexattr_t mutexattr;
+
+	if( pthread_mutexattr_init(&mutexattr) < 0 ){
+		return 0;
+	}
+
+	pthread_mutexattr_setpshared(&mutexattr, 1);
+	pthread_mutexattr_setprioceiling(&mutexattr, 19);
+	if( pthread_mutex_init(&fobj->mutex, &mutexattr) < 0 ){
+		return 0;
+	}
+	fobj->sobj = 0;
+
+	return 1;
+}
+
+
+void ff_del_filesync (
+		_FSYNC_t* fobj
+)
+{
+	pthread_mutex_destroy(&fobj->mutex);
+}
+
+
+
+/*------------------------------------------------------------------------*/
+/* Request/Release Grant to Access a File                                 */
+/*------------------------------------------------------------------------*/
+
+int ff_req_file (	/* 1:Got a grant, 0:Could not get a grant */
+		_FSYNC_t* fobj,
+		_SYNC_t sobj,	/* Sync object of the file's volume (timeout and statistics) */
+		BYTE nowait		/* 1:Do not wait for another task */
+)
+{
+	struct timespec abs_time;
+
+	if( pthread_mutex_trylock(&fobj->mutex) != 0 ){
+		get_deadline(sobj, &abs_time);
+		if( nowait || pthread_mutex_timedlock(&fobj->mutex, &abs_time) != 0 ){
+			pthread_mutex_lock(&sobj->state);
+			sobj->stat.timeout++;
+			pthread_mutex_unlock(&sobj->state);
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&sobj->state);	/* Remember the holder for ff_force_unlock() */
+	fobj->sobj = sobj;
+	fobj->pid = getpid();
+	fobj->next = sobj->held;
+	sobj->held = fobj;
+	pthread_mutex_unlock(&sobj->state);
+
+	return 1;
+}
+
+
+void ff_rel_file (
+		_FSYNC_t* fobj
+)
+{
+	_SYNC_t sobj = fobj->sobj;
+	struct ff_filesync **link;
+
+	pthread_mutex_lock(&sobj->state);
+	for(link = &sobj->held; *link && *link != fobj; link = &(*link)->next) ;
+	if( *link ){
+		*link = fobj->next;
+	}
+	pthread_mutex_unlock(&sobj->state);
+	pthread_mutex_unlock(&fobj->mutex);
 }
 
 #endif